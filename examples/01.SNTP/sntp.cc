@@ -11,6 +11,44 @@
 using Debug            = ConditionalDebug<true, "Network test">;
 constexpr bool UseIPv6 = CHERIOT_RTOS_OPTION_IPv6;
 
+/**
+ * Measure the cost of each way of reading the clock.
+ */
+void clock_benchmark()
+{
+	constexpr uint64_t Iterations = 1000;
+	auto measure = [](const char *name, auto &&read) {
+		uint64_t start = rdcycle64();
+		for (uint64_t i = 0; i < Iterations; i++)
+		{
+			read();
+		}
+		Debug::log(
+		  "{}: {} cycles/call", name, (rdcycle64() - start) / Iterations);
+	};
+	measure("gettimeofday", [] {
+		timeval tv;
+		gettimeofday(&tv, nullptr);
+	});
+	measure("time", [] { time(nullptr); });
+	measure("clock_gettime(CLOCK_REALTIME)", [] {
+		timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+	});
+	measure("clock_gettime(CLOCK_REALTIME_COARSE)", [] {
+		timespec ts;
+		clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+	});
+	measure("clock_gettime(CLOCK_MONOTONIC)", [] {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+	});
+	measure("clock_gettime(CLOCK_MONOTONIC_COARSE)", [] {
+		timespec ts;
+		clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	});
+}
+
 void __cheri_compartment("sntp_example") example()
 {
 	network_start();
@@ -22,6 +60,7 @@ void __cheri_compartment("sntp_example") example()
 		t = Timeout{MS_TO_TICKS(5000)};
 	}
 	Debug::log("Updating NTP took {} ticks", t.elapsed);
+	clock_benchmark();
 	t = UnlimitedTimeout;
 	time_t lastTime = 0;
 	while (true)
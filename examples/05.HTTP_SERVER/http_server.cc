@@ -7,20 +7,36 @@
 #include <string_view>
 #include <thread.h>
 #include <tick_macros.h>
+#if CHERIOT_HTTP_SERVER_TLS
+#	include <tls.h>
+
+#	include "server_certificate.h"
+#endif
 
 using CHERI::Capability;
 
 using Debug            = ConditionalDebug<true, "HTTP server example test">;
 constexpr bool UseIPv6 = CHERIOT_RTOS_OPTION_IPv6;
+constexpr bool UseTLS  = CHERIOT_HTTP_SERVER_TLS;
 
 /**
- * Bind capability for the server port 80. Use IPv6 if enabled in the
- * configuration, and allow at most two simultaneous connections to the server.
+ * Bind capability for the server port (80, or 443 for HTTPS). Use IPv6 if
+ * enabled in the configuration, and allow at most two simultaneous
+ * connections to the server.
  */
-#define LISTEN_PORT 80
+#if CHERIOT_HTTP_SERVER_TLS
+#	define LISTEN_PORT 443
+#else
+#	define LISTEN_PORT 80
+#endif
 DECLARE_AND_DEFINE_BIND_CAPABILITY(HTTPPort, UseIPv6, LISTEN_PORT, 10);
 
-DECLARE_AND_DEFINE_ALLOCATOR_CAPABILITY(TestMalloc, 32 * 1024);
+/**
+ * Each TLS connection needs about 10 KiB for the BearSSL engine and its
+ * buffers, in addition to the server configuration.
+ */
+DECLARE_AND_DEFINE_ALLOCATOR_CAPABILITY(TestMalloc,
+                                        UseTLS ? 48 * 1024 : 32 * 1024);
 #define TEST_MALLOC STATIC_SEALED_VALUE(TestMalloc)
 
 static char reply[] =
@@ -49,12 +65,85 @@ static const uint16_t MaxClients = 10;
  */
 static const uint16_t RestartDelay = 100; // in ticks
 
+/**
+ * The number of TLS sessions that the server remembers, so that returning
+ * clients can use an abbreviated handshake.
+ */
+static const size_t TLSSessionCacheEntries = 6;
+
+namespace
+{
+	/**
+	 * Start serving a client on `clientSocket`.  For HTTPS this performs the
+	 * TLS handshake and returns the TLS connection, which owns the socket.
+	 * Returns an untagged value on failure.
+	 */
+	SObj connection_open([[maybe_unused]] SObj tlsServer, SObj clientSocket)
+	{
+#if CHERIOT_HTTP_SERVER_TLS
+		// Don't let a client that never completes the handshake block the
+		// server forever.
+		Timeout handshakeTimeout{MS_TO_TICKS(10000)};
+		return tls_server_connection_create(
+		  &handshakeTimeout, TEST_MALLOC, tlsServer, clientSocket);
+#else
+		return clientSocket;
+#endif
+	}
+
+	NetworkReceiveResult connection_receive(Timeout *t, SObj connection)
+	{
+#if CHERIOT_HTTP_SERVER_TLS
+		return tls_connection_receive(t, connection);
+#else
+		return network_socket_receive(t, TEST_MALLOC, connection);
+#endif
+	}
+
+	ssize_t
+	connection_send(Timeout *t, SObj connection, void *buffer, size_t length)
+	{
+#if CHERIOT_HTTP_SERVER_TLS
+		return tls_connection_send(t, connection, buffer, length, 0);
+#else
+		return network_socket_send(t, connection, buffer, length);
+#endif
+	}
+
+	int connection_close(Timeout *t, SObj connection)
+	{
+#if CHERIOT_HTTP_SERVER_TLS
+		return tls_connection_close(t, connection);
+#else
+		return network_socket_close(t, TEST_MALLOC, connection);
+#endif
+	}
+} // namespace
+
 void __cheri_compartment("http_server_example") example()
 {
 	network_start();
 
 	auto heapAtStart = heap_quota_remaining(TEST_MALLOC);
 
+	SObj tlsServer = nullptr;
+#if CHERIOT_HTTP_SERVER_TLS
+	{
+		Timeout unlimited{UnlimitedTimeout};
+		tlsServer = tls_server_create(&unlimited,
+		                              TEST_MALLOC,
+		                              CHAIN,
+		                              CHAIN_LEN,
+		                              &EC,
+		                              TLSSessionCacheEntries);
+		if (!Capability{tlsServer}.is_valid())
+		{
+			Debug::log("Failed to create the TLS server configuration.");
+			return;
+		}
+	}
+#endif
+
 	uint16_t clientsCounter = 0;
 
 	Debug::log("Starting the server.");
@@ -109,8 +198,15 @@ void __cheri_compartment("http_server_example") example()
 
 			clientsCounter++;
 
-			auto [received, buffer] =
-			  network_socket_receive(&unlimited, TEST_MALLOC, clientSocket);
+			auto connection = connection_open(tlsServer, clientSocket);
+			if (!Capability{connection}.is_valid())
+			{
+				// The TLS stack has already closed the socket.
+				Debug::log("TLS handshake with the client failed.");
+				continue;
+			}
+
+			auto [received, buffer] = connection_receive(&unlimited, connection);
 
 			// For this simple server, we do not care about what the client
 			// sent (we will always serve the same content).
@@ -138,8 +234,8 @@ void __cheri_compartment("http_server_example") example()
 				{
 					size_t remaining = ToSend - sent;
 
-					ssize_t sentThisCall = network_socket_send(
-					  &unlimited, clientSocket, &(reply[sent]), remaining);
+					ssize_t sentThisCall = connection_send(
+					  &unlimited, connection, &(reply[sent]), remaining);
 					Debug::log("Sent {} bytes", sentThisCall);
 
 					if (sentThisCall >= 0)
@@ -165,8 +261,7 @@ void __cheri_compartment("http_server_example") example()
 			// In a retry loop to be more rebust to network stack crashes.
 			for (; retries > 0; retries--)
 			{
-				if (network_socket_close(
-				      &unlimited, TEST_MALLOC, clientSocket) == 0)
+				if (connection_close(&unlimited, connection) == 0)
 				{
 					break;
 				}
@@ -199,6 +294,10 @@ void __cheri_compartment("http_server_example") example()
 		}
 	}
 
+#if CHERIOT_HTTP_SERVER_TLS
+	tls_server_destroy(TEST_MALLOC, tlsServer);
+#endif
+
 	Debug::log("Now checking for leaks.");
 	auto heapAtEnd = heap_quota_remaining(TEST_MALLOC);
 	if (heapAtEnd < heapAtStart)
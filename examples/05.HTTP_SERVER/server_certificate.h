@@ -0,0 +1,58 @@
+// Generated by brssl chain and brssl skey from a self-signed certificate for
+// cheriot.local.  The private key is public: this is for demonstration only.
+// See README.md for how to generate a replacement.
+
+static const unsigned char CERT0[] = {
+	0x30, 0x82, 0x01, 0xA0, 0x30, 0x82, 0x01, 0x45, 0xA0, 0x03, 0x02, 0x01,
+	0x02, 0x02, 0x14, 0x47, 0x0B, 0xAF, 0x16, 0x07, 0x54, 0xD2, 0xAC, 0xC7,
+	0x0B, 0x03, 0x7B, 0xC8, 0xAD, 0x07, 0xCA, 0x62, 0x67, 0x81, 0x80, 0x30,
+	0x0A, 0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x04, 0x03, 0x02, 0x30,
+	0x18, 0x31, 0x16, 0x30, 0x14, 0x06, 0x03, 0x55, 0x04, 0x03, 0x0C, 0x0D,
+	0x63, 0x68, 0x65, 0x72, 0x69, 0x6F, 0x74, 0x2E, 0x6C, 0x6F, 0x63, 0x61,
+	0x6C, 0x30, 0x1E, 0x17, 0x0D, 0x32, 0x36, 0x31, 0x30, 0x31, 0x38, 0x30,
+	0x32, 0x31, 0x33, 0x35, 0x35, 0x5A, 0x17, 0x0D, 0x33, 0x36, 0x31, 0x30,
+	0x31, 0x35, 0x30, 0x32, 0x31, 0x33, 0x35, 0x35, 0x5A, 0x30, 0x18, 0x31,
+	0x16, 0x30, 0x14, 0x06, 0x03, 0x55, 0x04, 0x03, 0x0C, 0x0D, 0x63, 0x68,
+	0x65, 0x72, 0x69, 0x6F, 0x74, 0x2E, 0x6C, 0x6F, 0x63, 0x61, 0x6C, 0x30,
+	0x59, 0x30, 0x13, 0x06, 0x07, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x02, 0x01,
+	0x06, 0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x03, 0x01, 0x07, 0x03, 0x42,
+	0x00, 0x04, 0x35, 0x49, 0xC0, 0x71, 0xB4, 0x91, 0x4A, 0x9D, 0x7C, 0x77,
+	0xC2, 0xC7, 0xE9, 0x90, 0xF5, 0x81, 0xCD, 0xC0, 0xAE, 0xDD, 0x8A, 0x27,
+	0x19, 0x13, 0x7F, 0x40, 0x3A, 0x6A, 0xFA, 0x70, 0x08, 0x0A, 0x14, 0xF8,
+	0x07, 0x61, 0xF7, 0x2F, 0xAE, 0xFC, 0x33, 0xA0, 0x70, 0x9B, 0xB8, 0x11,
+	0xD0, 0x57, 0xD1, 0x39, 0x62, 0x48, 0x00, 0xE8, 0x86, 0x6E, 0xC3, 0x8E,
+	0x6F, 0x4F, 0x3F, 0x58, 0x56, 0xC8, 0xA3, 0x6D, 0x30, 0x6B, 0x30, 0x1D,
+	0x06, 0x03, 0x55, 0x1D, 0x0E, 0x04, 0x16, 0x04, 0x14, 0x72, 0x25, 0xF5,
+	0xCC, 0x2E, 0x15, 0xB9, 0x06, 0x50, 0x9C, 0xFC, 0xF8, 0xED, 0x01, 0xBC,
+	0x6B, 0x1B, 0xCD, 0x5D, 0x23, 0x30, 0x1F, 0x06, 0x03, 0x55, 0x1D, 0x23,
+	0x04, 0x18, 0x30, 0x16, 0x80, 0x14, 0x72, 0x25, 0xF5, 0xCC, 0x2E, 0x15,
+	0xB9, 0x06, 0x50, 0x9C, 0xFC, 0xF8, 0xED, 0x01, 0xBC, 0x6B, 0x1B, 0xCD,
+	0x5D, 0x23, 0x30, 0x0F, 0x06, 0x03, 0x55, 0x1D, 0x13, 0x01, 0x01, 0xFF,
+	0x04, 0x05, 0x30, 0x03, 0x01, 0x01, 0xFF, 0x30, 0x18, 0x06, 0x03, 0x55,
+	0x1D, 0x11, 0x04, 0x11, 0x30, 0x0F, 0x82, 0x0D, 0x63, 0x68, 0x65, 0x72,
+	0x69, 0x6F, 0x74, 0x2E, 0x6C, 0x6F, 0x63, 0x61, 0x6C, 0x30, 0x0A, 0x06,
+	0x08, 0x2A, 0x86, 0x48, 0xCE, 0x3D, 0x04, 0x03, 0x02, 0x03, 0x49, 0x00,
+	0x30, 0x46, 0x02, 0x21, 0x00, 0xAE, 0x46, 0x49, 0xD4, 0xB2, 0x67, 0xE3,
+	0x07, 0x71, 0xA9, 0x10, 0xA9, 0xD2, 0x92, 0x74, 0x94, 0x1E, 0x93, 0xBA,
+	0xCB, 0xA9, 0x24, 0xAA, 0x1B, 0xD8, 0x9E, 0x4B, 0x38, 0xF6, 0x96, 0x70,
+	0x38, 0x02, 0x21, 0x00, 0x85, 0x22, 0xC4, 0x88, 0xCA, 0xB2, 0x56, 0x6D,
+	0x81, 0x24, 0x1C, 0xAE, 0xB1, 0x30, 0xDB, 0xE5, 0x3C, 0xAB, 0x7A, 0xBD,
+	0x7F, 0xEE, 0x1B, 0x3A, 0x2A, 0x2C, 0x10, 0x48, 0xE5, 0x2B, 0xAE, 0x40
+};
+
+static const br_x509_certificate CHAIN[] = {
+	{(unsigned char *)CERT0, sizeof CERT0}
+};
+
+#define CHAIN_LEN 1
+
+static const unsigned char EC_X[] = {
+	0x1A, 0xEE, 0x09, 0x47, 0x6D, 0x02, 0xCD, 0x8F, 0xC2, 0x27, 0x1D, 0x2D,
+	0xF9, 0xD3, 0x68, 0x9B, 0x07, 0x97, 0x9E, 0x16, 0xDD, 0x9D, 0x5B, 0xB6,
+	0x4B, 0x8E, 0x7E, 0x37, 0xF0, 0xBC, 0x4E, 0x7B
+};
+
+static const br_ec_private_key EC = {
+	23,
+	(unsigned char *)EC_X, sizeof EC_X
+};
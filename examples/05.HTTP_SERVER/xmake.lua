@@ -16,14 +16,25 @@ includes("../../lib")
 option("board")
   set_default("ibex-arty-a7-100")
 
+option("http-server-tls")
+  set_default(false)
+  set_description("Serve HTTPS on port 443 instead of HTTP on port 80")
+  set_showmenu(true)
+
 compartment("http_server_example")
   add_includedirs("../../include")
   add_deps("freestanding", "TCPIP", "NetAPI")
+  if has_config("http-server-tls") then
+    add_deps("TLS", "SNTP", "time_helpers")
+  end
   add_files("http_server.cc")
   on_load(function(target)
     target:add('options', "IPv6")
     local IPv6 = get_config("IPv6")
     target:add("defines", "CHERIOT_RTOS_OPTION_IPv6=" .. tostring(IPv6))
+    target:add('options', "http-server-tls")
+    local tls = get_config("http-server-tls")
+    target:add("defines", "CHERIOT_HTTP_SERVER_TLS=" .. tostring(tls))
   end)
 
 firmware("05.http_server_example")
@@ -31,12 +42,14 @@ firmware("05.http_server_example")
   add_deps("DNS", "TCPIP", "Firewall", "NetAPI", "http_server_example", "atomic8", "debug")
   on_load(function(target)
     target:values_set("board", "$(board)")
+    -- TLS requires *huge* stacks!
+    local stackSize = get_config("http-server-tls") and 8160 or 0xe00
     target:values_set("threads", {
       {
         compartment = "http_server_example",
         priority = 1,
         entry_point = "example",
-        stack_size = 0xe00,
+        stack_size = stackSize,
         trusted_stack_frames = 6
       },
       {
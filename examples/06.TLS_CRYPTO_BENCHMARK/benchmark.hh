@@ -0,0 +1,193 @@
+// Copyright SCI Semiconductor and CHERIoT Contributors.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+#include <bearssl.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <tls-crypto-backend.h>
+
+/**
+ * Benchmarks for the BearSSL primitives that the TLS compartment uses with
+ * the cipher suites configured in `br_ssl_client_init`.  This harness is
+ * shared between the on-device example and the host build so that the two
+ * report directly comparable numbers.
+ *
+ * Implementations are selected in the same way as in the TLS compartment:
+ * AES, GHASH and SHA-256 come from the crypto backend selected with the
+ * `tls-crypto-backend` option, and ECDSA and ECDHE use the same defaults as
+ * `br_ssl_engine_set_default_ecdsa`.
+ */
+namespace TLSCryptoBenchmark
+{
+	/**
+	 * Run `body` once to warm up caches, then `iterations` times, and report
+	 * the total number of cycles.  `bytes` is the number of bytes processed
+	 * per iteration, or zero for per-operation benchmarks.
+	 */
+	template<typename Cycles, typename Report, typename Body>
+	void measure(Cycles     &cycles,
+	             Report     &report,
+	             const char *name,
+	             size_t      iterations,
+	             size_t      bytes,
+	             Body      &&body)
+	{
+		body();
+		uint64_t start = cycles();
+		for (size_t i = 0; i < iterations; i++)
+		{
+			body();
+		}
+		report(name, cycles() - start, iterations, bytes);
+	}
+
+	/**
+	 * Run all of the benchmarks.
+	 *
+	 * `cycles()` must return the current cycle count.  `report(name, cycles,
+	 * iterations, bytes)` is called once per benchmark with the total number
+	 * of cycles, the number of iterations and the number of bytes processed
+	 * per iteration (zero for per-operation benchmarks).  The iteration
+	 * counts are chosen to give short runs on a slow microcontroller and are
+	 * multiplied by `scale`.
+	 */
+	template<typename Cycles, typename Report>
+	void run(size_t scale, Cycles &&cycles, Report &&report)
+	{
+		static unsigned char       buffer[1024];
+		static const unsigned char Key[16] = {1, 2, 3, 4, 5, 6, 7, 8};
+		static const unsigned char Iv[12]  = {9, 10, 11, 12};
+		static const unsigned char Aad[13] = {0x17, 0x03, 0x03};
+		unsigned char              tag[16];
+		unsigned char              hash[br_sha256_SIZE];
+
+		memset(buffer, 0x5a, sizeof(buffer));
+
+		// AES-128-GCM record protection, using the backend's AES and GHASH.
+		const TLSCryptoBackend *backend = tls_crypto_backend();
+		br_aes_gen_ctr_keys     aes;
+		backend->aesCounter->init(&aes.vtable, Key, sizeof(Key));
+		br_gcm_context gcm;
+		br_gcm_init(&gcm, &aes.vtable, backend->ghash);
+		static const struct
+		{
+			size_t      size;
+			const char *name;
+		} GcmSizes[] = {
+		  {16, "AES-128-GCM encrypt, 16-byte records"},
+		  {256, "AES-128-GCM encrypt, 256-byte records"},
+		  {1024, "AES-128-GCM encrypt, 1024-byte records"},
+		};
+		for (auto &size : GcmSizes)
+		{
+			measure(cycles, report, size.name, 8 * scale, size.size, [&]() {
+				br_gcm_reset(&gcm, Iv, sizeof(Iv));
+				br_gcm_aad_inject(&gcm, Aad, sizeof(Aad));
+				br_gcm_flip(&gcm);
+				br_gcm_run(&gcm, 1, buffer, size.size);
+				br_gcm_get_tag(&gcm, tag);
+			});
+		}
+
+		// SHA-256, used for the handshake transcript and by the PRF.
+		static const struct
+		{
+			size_t      size;
+			const char *name;
+		} HashSizes[] = {
+		  {64, "SHA-256, 64-byte messages"},
+		  {1024, "SHA-256, 1024-byte messages"},
+		};
+		for (auto &size : HashSizes)
+		{
+			measure(cycles, report, size.name, 8 * scale, size.size, [&]() {
+				br_hash_compat_context sha;
+				backend->sha256->init(&sha.vtable);
+				backend->sha256->update(&sha.vtable, buffer, size.size);
+				backend->sha256->out(&sha.vtable, hash);
+			});
+		}
+
+		// TLS 1.2 SHA-256 PRF, computing a master secret.
+		unsigned char         masterSecret[48];
+		br_tls_prf_seed_chunk seeds[2] = {{buffer, 32}, {buffer + 32, 32}};
+		measure(cycles,
+		        report,
+		        "TLS 1.2 SHA-256 PRF (master secret)",
+		        scale,
+		        0,
+		        [&]() {
+			        br_tls12_sha256_prf(masterSecret,
+			                            sizeof(masterSecret),
+			                            buffer,
+			                            48,
+			                            "master secret",
+			                            2,
+			                            seeds);
+		        });
+
+		// ECDSA P-256 signature verification, for the server's key exchange
+		// and certificate chain.  The key and signature are generated
+		// deterministically.
+		const br_ec_impl    *ec = br_ec_get_default();
+		br_hmac_drbg_context rng;
+		br_hmac_drbg_init(&rng, &br_sha256_vtable, "benchmark", 9);
+		br_ec_private_key privateKey;
+		unsigned char     privateKeyBuffer[BR_EC_KBUF_PRIV_MAX_SIZE];
+		br_ec_keygen(
+		  &rng.vtable, ec, &privateKey, privateKeyBuffer, BR_EC_secp256r1);
+		br_ec_public_key publicKey;
+		unsigned char    publicKeyBuffer[BR_EC_KBUF_PUB_MAX_SIZE];
+		br_ec_compute_pub(ec, &publicKey, publicKeyBuffer, &privateKey);
+		memcpy(hash, buffer, sizeof(hash));
+		unsigned char signature[80];
+		size_t        signatureLength = br_ecdsa_sign_asn1_get_default()(
+		  ec, &br_sha256_vtable, hash, &privateKey, signature);
+		auto verify = br_ecdsa_vrfy_asn1_get_default();
+		measure(cycles, report, "ECDSA P-256 verify", scale, 0, [&]() {
+			verify(
+			  ec, hash, sizeof(hash), &publicKey, signature, signatureLength);
+		});
+
+		// ECDHE P-256: the client generates an ephemeral key and then
+		// multiplies the server's point by it.
+		unsigned char point[BR_EC_KBUF_PUB_MAX_SIZE];
+		measure(cycles, report, "ECDHE P-256 key generation", scale, 0, [&]() {
+			ec->mulgen(point, privateKey.x, privateKey.xlen, BR_EC_secp256r1);
+		});
+		measure(cycles, report, "ECDHE P-256 shared secret", scale, 0, [&]() {
+			memcpy(point, publicKey.q, publicKey.qlen);
+			ec->mul(point,
+			        publicKey.qlen,
+			        privateKey.x,
+			        privateKey.xlen,
+			        BR_EC_secp256r1);
+		});
+
+#ifdef CHERIOT_TLS_ENABLE_RSA
+		// RSA-2048 public-key operation with the i31 code, which dominates
+		// RSA signature verification.  The cost depends only on the size of
+		// the modulus and the exponent, so a synthetic odd modulus is used.
+		static unsigned char modulus[256];
+		static unsigned char message[256];
+		static unsigned char exponent[] = {0x01, 0x00, 0x01};
+		memset(modulus, 0xa5, sizeof(modulus));
+		modulus[0] = 0xc3;
+		modulus[sizeof(modulus) - 1] |= 1;
+		br_rsa_public_key rsaKey = {
+		  modulus, sizeof(modulus), exponent, sizeof(exponent)};
+		measure(cycles,
+		        report,
+		        "RSA-2048 public operation (i31)",
+		        scale,
+		        0,
+		        [&]() {
+			        memset(message, 0x5a, sizeof(message));
+			        message[0] = 0x12;
+			        br_rsa_i31_public(message, sizeof(message), &rsaKey);
+		        });
+#endif
+	}
+} // namespace TLSCryptoBenchmark
@@ -0,0 +1,33 @@
+// Copyright SCI Semiconductor and CHERIoT Contributors.
+// SPDX-License-Identifier: MIT
+
+#include "benchmark.hh"
+#include <compartment.h>
+#include <debug.hh>
+#include <riscvreg.h>
+
+using Debug = ConditionalDebug<true, "TLS crypto benchmark">;
+
+void __cheri_compartment("crypto_benchmark") benchmark()
+{
+	Debug::log("Running TLS crypto benchmarks");
+	TLSCryptoBenchmark::run(
+	  1,
+	  []() { return rdcycle64(); },
+	  [](const char *name, uint64_t cycles, size_t iterations, size_t bytes) {
+		  uint64_t perOperation = cycles / iterations;
+		  if (bytes == 0)
+		  {
+			  Debug::log("{}: {} cycles/op", name, perOperation);
+			  return;
+		  }
+		  // Report cycles per byte to one decimal place.
+		  uint64_t tenthsPerByte = (cycles * 10) / (iterations * bytes);
+		  Debug::log("{}: {} cycles/op, {}.{} cycles/byte",
+		             name,
+		             perOperation,
+		             tenthsPerByte / 10,
+		             tenthsPerByte % 10);
+	  });
+	Debug::log("Finished TLS crypto benchmarks");
+}
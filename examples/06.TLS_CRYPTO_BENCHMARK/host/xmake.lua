@@ -0,0 +1,27 @@
+-- Copyright CHERIoT Contributors.
+-- SPDX-License-Identifier: MIT
+
+-- Host build of the TLS crypto benchmark.  This uses the host's default
+-- toolchain and the same BearSSL sources and configuration as the TLS
+-- compartment.
+
+set_project("CHERIoT TLS Crypto Benchmark (host)")
+
+set_languages("c11", "cxx20")
+add_rules("mode.release", "mode.debug")
+set_defaultmode("release")
+
+includes("../../../lib/tls/bearssl.lua")
+
+option("tls-rsa")
+    set_default(true)
+    set_description("Benchmark RSA (match the TLS compartment's tls-rsa option)")
+    set_showmenu(true)
+    add_defines("CHERIOT_TLS_ENABLE_RSA")
+
+target("tls_crypto_benchmark")
+  set_kind("binary")
+  add_options("tls-rsa")
+  add_files("main.cc")
+  add_bearssl_crypto()
+  add_tls_crypto_backend()
@@ -0,0 +1,43 @@
+-- Copyright CHERIoT Contributors.
+-- SPDX-License-Identifier: MIT
+
+-- Update this to point to the location of the CHERIoT SDK
+sdkdir = path.absolute("../../../cheriot-rtos/sdk")
+
+set_project("CHERIoT TLS Crypto Benchmark")
+
+includes(sdkdir)
+
+set_toolchains("cheriot-clang")
+
+includes(path.join(sdkdir, "lib"))
+includes("../../lib")
+
+option("board")
+  set_default("ibex-arty-a7-100")
+
+compartment("crypto_benchmark")
+  add_options("tls-rsa")
+  add_deps("freestanding", "debug")
+  add_files("crypto_benchmark.cc")
+  -- The same BearSSL primitives, configuration and crypto backend as the TLS
+  -- compartment.
+  add_bearssl_crypto()
+  add_tls_crypto_backend()
+
+firmware("06.tls_crypto_benchmark")
+  set_policy("build.warning", true)
+  add_deps("crypto_benchmark")
+  on_load(function(target)
+    target:values_set("board", "$(board)")
+    target:values_set("threads", {
+      {
+        compartment = "crypto_benchmark",
+        priority = 1,
+        entry_point = "benchmark",
+        -- RSA and elliptic-curve operations use large stack buffers.
+        stack_size = 8160,
+        trusted_stack_frames = 2
+      }
+    }, {expand = false})
+  end)
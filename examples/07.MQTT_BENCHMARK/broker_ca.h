@@ -0,0 +1,36 @@
+// Generated by brssl ta from the certificate authority in broker/ca.pem,
+// which signed the benchmark broker's certificate for cheriot-broker.local.
+// This is for demonstration only.  See README.md for how to generate a
+// replacement.
+
+static const unsigned char TA0_DN[] = {
+	0x30, 0x24, 0x31, 0x22, 0x30, 0x20, 0x06, 0x03, 0x55, 0x04, 0x03, 0x0C,
+	0x19, 0x43, 0x48, 0x45, 0x52, 0x49, 0x6F, 0x54, 0x20, 0x4D, 0x51, 0x54,
+	0x54, 0x20, 0x62, 0x65, 0x6E, 0x63, 0x68, 0x6D, 0x61, 0x72, 0x6B, 0x20,
+	0x43, 0x41
+};
+
+static const unsigned char TA0_EC_Q[] = {
+	0x04, 0x2A, 0xAA, 0x0F, 0x36, 0xAE, 0x77, 0x5B, 0x99, 0x60, 0xC6, 0xE4,
+	0x4E, 0x84, 0x6D, 0x98, 0x98, 0xA2, 0x9D, 0xF9, 0xE3, 0x8E, 0xE5, 0xAD,
+	0xD1, 0x67, 0x24, 0xAE, 0x36, 0x52, 0x36, 0x70, 0xFA, 0x14, 0xC3, 0xC0,
+	0x93, 0x7C, 0x1A, 0x6E, 0xB1, 0x85, 0xCA, 0x6F, 0xB6, 0x39, 0x25, 0x37,
+	0x05, 0x68, 0x90, 0xEB, 0xFF, 0x45, 0xEA, 0xC5, 0x46, 0x89, 0x76, 0x19,
+	0x15, 0x62, 0xFD, 0xB0, 0xE2
+};
+
+static const br_x509_trust_anchor TAs[1] = {
+	{
+		{ (unsigned char *)TA0_DN, sizeof TA0_DN },
+		BR_X509_TA_CA,
+		{
+			BR_KEYTYPE_EC,
+			{ .ec = {
+				BR_EC_secp256r1,
+				(unsigned char *)TA0_EC_Q, sizeof TA0_EC_Q,
+			} }
+		}
+	}
+};
+
+#define TAs_NUM   1
@@ -0,0 +1,431 @@
+// Copyright SCI Semiconductor and CHERIoT Contributors.
+// SPDX-License-Identifier: MIT
+
+#include <NetAPI.h>
+#include <algorithm>
+#include <array>
+#include <debug.hh>
+#include <errno.h>
+#include <fail-simulator-on-error.h>
+#include <mqtt.h>
+#include <riscvreg.h>
+#include <sntp.h>
+#include <string.h>
+#include <tick_macros.h>
+
+#include "broker_ca.h"
+
+using CHERI::Capability;
+
+using Debug = ConditionalDebug<true, "MQTT benchmark">;
+
+/// The size of the payload of each message.
+constexpr size_t PayloadSize = MQTT_BENCHMARK_PAYLOAD_SIZE;
+/// The number of messages published at each QoS level.
+constexpr size_t MessageCount = MQTT_BENCHMARK_MESSAGES;
+/// The publish rate in messages per second, or zero to publish as fast as the
+/// in-flight window allows.
+constexpr size_t MessagesPerSecond = MQTT_BENCHMARK_RATE;
+// The sequence number of each message is stored at the start of its payload.
+static_assert(PayloadSize >= sizeof(uint32_t),
+              "The payload must be large enough to hold a sequence number");
+
+/// Maximum permitted MQTT client identifier length (from the MQTT
+/// specification)
+constexpr size_t MQTTMaximumClientLength = 23;
+/// Prefix for MQTT client identifier
+constexpr std::string_view clientIDPrefix{"cheriotBench"};
+/// Space for the random client ID.
+std::array<char, MQTTMaximumClientLength> clientID;
+static_assert(clientIDPrefix.size() < clientID.size());
+
+// MQTT network buffer sizes.  The buffer must hold a whole PUBLISH packet, so
+// it grows with the payload.
+constexpr const size_t networkBufferSize =
+  (PayloadSize + 128 > 1024) ? PayloadSize + 128 : 1024;
+constexpr const size_t incomingPublishCount = 20;
+constexpr const size_t outgoingPublishCount = 20;
+
+/// The largest number of messages that are awaiting an acknowledgement (or,
+/// for QoS 0, their own delivery) at any time.
+constexpr size_t InFlightWindow = outgoingPublishCount;
+
+// The broker runs on the same network as the device, see README.md.
+DECLARE_AND_DEFINE_CONNECTION_CAPABILITY(BenchmarkBroker,
+                                         MQTT_BENCHMARK_BROKER,
+                                         8883,
+                                         ConnectionTypeTCP);
+
+DECLARE_AND_DEFINE_ALLOCATOR_CAPABILITY(benchmarkMalloc, 48 * 1024);
+
+/// Topic for QoS 0, which the benchmark subscribes to so that each message
+/// comes back to it.
+constexpr std::string_view loopbackTopic{"cheriot/benchmark/loopback"};
+/// Topic for QoS 1 and 2, which nobody subscribes to.
+constexpr std::string_view ackedTopic{"cheriot/benchmark/acked"};
+
+namespace
+{
+	/**
+	 * A histogram of latencies, with power-of-two buckets in microseconds.
+	 * Bucket `i` counts latencies in [2^i, 2^(i+1)) microseconds, except
+	 * that the first also counts latencies under one microsecond.
+	 */
+	struct LatencyHistogram
+	{
+		static constexpr size_t BucketCount = 24;
+
+		std::array<uint32_t, BucketCount> buckets;
+		uint64_t                          totalMicroseconds;
+		uint32_t                          minimumMicroseconds;
+		uint32_t                          maximumMicroseconds;
+		uint32_t                          count;
+
+		void reset()
+		{
+			buckets.fill(0);
+			totalMicroseconds   = 0;
+			minimumMicroseconds = UINT32_MAX;
+			maximumMicroseconds = 0;
+			count               = 0;
+		}
+
+		void add(uint64_t cycles)
+		{
+			if (CPU_TIMER_HZ / 1000000 > 0)
+			{
+				cycles /= CPU_TIMER_HZ / 1000000;
+			}
+			uint32_t microseconds =
+			  cycles > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(cycles);
+			size_t bucket = 0;
+			while ((bucket + 1 < BucketCount) &&
+			       (microseconds >> (bucket + 1)) != 0)
+			{
+				bucket++;
+			}
+			buckets[bucket]++;
+			totalMicroseconds += microseconds;
+			minimumMicroseconds = std::min(minimumMicroseconds, microseconds);
+			maximumMicroseconds = std::max(maximumMicroseconds, microseconds);
+			count++;
+		}
+
+		void print() const
+		{
+			if (count == 0)
+			{
+				Debug::log("  No samples");
+				return;
+			}
+			Debug::log("  min {} us, mean {} us, max {} us",
+			           minimumMicroseconds,
+			           static_cast<uint32_t>(totalMicroseconds / count),
+			           maximumMicroseconds);
+			for (size_t i = 0; i < BucketCount; i++)
+			{
+				if (buckets[i] != 0)
+				{
+					Debug::log("  [{}, {}) us: {}",
+					           i == 0 ? 0 : 1U << i,
+					           1U << (i + 1),
+					           buckets[i]);
+				}
+			}
+		}
+	};
+
+	/**
+	 * A message that has been published and not yet acknowledged.  QoS 0
+	 * messages are identified by the sequence number in their payload, the
+	 * others by their packet ID.
+	 */
+	struct InFlightMessage
+	{
+		uint64_t sentCycles;
+		uint32_t key;
+		/// Acknowledgements still expected: one PUBACK for QoS 1, a PUBREC
+		/// and a PUBCOMP for QoS 2, and the loopback delivery for QoS 0.
+		uint8_t acksRemaining;
+	};
+
+	std::array<InFlightMessage, InFlightWindow> inFlight;
+	size_t                                      inFlightCount;
+	LatencyHistogram                            histogram;
+	uint64_t                                    lastAckCycles;
+
+	std::array<uint8_t, PayloadSize> payload;
+
+	/**
+	 * Record an acknowledgement for the in-flight message identified by
+	 * `key`.  Acknowledgements that do not match a message, such as the
+	 * SUBACK, are ignored.
+	 */
+	void acknowledge(uint32_t key)
+	{
+		uint64_t now = rdcycle64();
+		for (auto &message : inFlight)
+		{
+			if ((message.acksRemaining == 0) || (message.key != key))
+			{
+				continue;
+			}
+			if (--message.acksRemaining == 0)
+			{
+				histogram.add(now - message.sentCycles);
+				lastAckCycles = now;
+				inFlightCount--;
+			}
+			return;
+		}
+	}
+
+	/// Find a free in-flight slot.  There must be one.
+	InFlightMessage &in_flight_slot()
+	{
+		for (auto &message : inFlight)
+		{
+			if (message.acksRemaining == 0)
+			{
+				return message;
+			}
+		}
+		Debug::Assert(false, "No free in-flight slot");
+		__builtin_unreachable();
+	}
+
+	/**
+	 * Publish `MessageCount` messages at the given QoS level, at
+	 * `MessagesPerSecond`, and report the acknowledgement latencies, the
+	 * sustained throughput, and the heap cost of each in-flight message.
+	 * Returns false if the connection failed.
+	 */
+	bool run_phase(SObj handle, uint8_t qos)
+	{
+		std::string_view topic     = (qos == 0) ? loopbackTopic : ackedTopic;
+		SObj             allocator = STATIC_SEALED_VALUE(benchmarkMalloc);
+
+		histogram.reset();
+		inFlight.fill({});
+		inFlightCount = 0;
+
+		const uint64_t interval =
+		  (MessagesPerSecond == 0) ? 0 : CPU_TIMER_HZ / MessagesPerSecond;
+		size_t   heapAtStart  = heap_quota_remaining(allocator);
+		size_t   heapLowest   = heapAtStart;
+		size_t   peakInFlight = 0;
+		size_t   sent         = 0;
+		size_t   failed       = 0;
+		uint64_t start        = rdcycle64();
+		uint64_t nextSend     = start;
+		lastAckCycles         = start;
+		// Give up on messages that have not been acknowledged within 10 s of
+		// the last send.
+		Timeout drainTimeout{MS_TO_TICKS(10000)};
+
+		while ((sent < MessageCount) || (inFlightCount > 0))
+		{
+			uint64_t now = rdcycle64();
+			if ((sent < MessageCount) && (inFlightCount < InFlightWindow) &&
+			    (now >= nextSend))
+			{
+				uint32_t sequence = sent;
+				memcpy(payload.data(), &sequence, sizeof(sequence));
+				auto &message      = in_flight_slot();
+				message.sentCycles = rdcycle64();
+				Timeout t{MS_TO_TICKS(5000)};
+				int     ret = mqtt_publish(&t,
+				                           handle,
+				                           qos,
+				                           topic.data(),
+				                           topic.size(),
+				                           payload.data(),
+				                           payload.size());
+				sent++;
+				nextSend += interval;
+				if (ret < 0)
+				{
+					Debug::log("Publish {} failed: {}", sequence, ret);
+					if (ret == -ECONNABORTED)
+					{
+						return false;
+					}
+					failed++;
+					continue;
+				}
+				message.key           = (qos == 0) ? sequence : ret;
+				message.acksRemaining = (qos == 2) ? 2 : 1;
+				inFlightCount++;
+				peakInFlight = std::max(peakInFlight, inFlightCount);
+				heapLowest =
+				  std::min(heapLowest, heap_quota_remaining(allocator));
+				continue;
+			}
+			if (sent == MessageCount)
+			{
+				if (!drainTimeout.may_block())
+				{
+					break;
+				}
+			}
+			// Wait for acknowledgements until the next message is due.
+			Ticks wait = 1;
+			if ((sent < MessageCount) && (inFlightCount < InFlightWindow))
+			{
+				uint64_t cycles = (nextSend > now) ? nextSend - now : 0;
+				wait = cycles / (CPU_TIMER_HZ / 1000 * MS_PER_TICK);
+				if (wait == 0)
+				{
+					// Less than a tick to wait, just check for data.
+					Timeout t{0};
+					if (int ret = mqtt_run(&t, handle); ret == -ECONNABORTED)
+					{
+						return false;
+					}
+					continue;
+				}
+			}
+			Timeout t{wait};
+			int     ret = mqtt_run_blocking(&t, handle);
+			if (sent == MessageCount)
+			{
+				drainTimeout.elapse(t.elapsed);
+			}
+			if (ret == -ECONNABORTED)
+			{
+				Debug::log("Lost the connection to the broker");
+				return false;
+			}
+		}
+
+		uint64_t elapsed = lastAckCycles - start;
+		Debug::log("QoS {}: {} messages of {} bytes, {} failed, {} lost",
+		           qos,
+		           MessageCount,
+		           PayloadSize,
+		           failed,
+		           inFlightCount);
+		Debug::log("QoS {} {} latency:",
+		           qos,
+		           (qos == 0) ? "loopback" : "acknowledgement");
+		histogram.print();
+		if (elapsed > 0)
+		{
+			uint64_t messagesPerSecond =
+			  uint64_t(histogram.count) * CPU_TIMER_HZ / elapsed;
+			Debug::log("QoS {} throughput: {} messages/s, {} bytes/s",
+			           qos,
+			           static_cast<uint32_t>(messagesPerSecond),
+			           static_cast<uint32_t>(messagesPerSecond * PayloadSize));
+		}
+		if (peakInFlight > 0)
+		{
+			Debug::log("QoS {}: peak {} in flight, {} heap bytes each",
+			           qos,
+			           peakInFlight,
+			           (heapAtStart - heapLowest) / peakInFlight);
+		}
+		return true;
+	}
+} // namespace
+
+void __cheri_callback publishCallback(const char *topicName,
+                                      size_t      topicNameLength,
+                                      const void *messagePayload,
+                                      size_t      payloadLength)
+{
+	// Check input pointers (can be skipped if the MQTT library is trusted)
+	if (!CHERI::check_pointer(messagePayload, payloadLength) ||
+	    (payloadLength < sizeof(uint32_t)))
+	{
+		return;
+	}
+	uint32_t sequence;
+	memcpy(&sequence, messagePayload, sizeof(sequence));
+	acknowledge(sequence);
+}
+
+void __cheri_callback ackCallback(uint16_t packetID, bool isReject)
+{
+	if (isReject)
+	{
+		Debug::log("SUBSCRIBE rejected by the broker");
+		return;
+	}
+	acknowledge(packetID);
+}
+
+void __cheri_compartment("mqtt_benchmark") benchmark()
+{
+	int     ret;
+	Timeout t{MS_TO_TICKS(5000)};
+
+	network_start();
+
+	// SNTP must be run for the TLS stack to be able to check certificate dates.
+	while (sntp_update(&t) != 0)
+	{
+		Debug::log("Failed to update NTP time");
+		t = Timeout{MS_TO_TICKS(5000)};
+	}
+
+	memcpy(clientID.data(), clientIDPrefix.data(), clientIDPrefix.size());
+	mqtt_generate_client_id(clientID.data() + clientIDPrefix.size(),
+	                        clientID.size() - clientIDPrefix.size());
+
+	Debug::log("Connecting to the broker at {}...", MQTT_BENCHMARK_BROKER);
+	t           = Timeout{MS_TO_TICKS(30000)};
+	SObj handle = mqtt_connect(&t,
+	                           STATIC_SEALED_VALUE(benchmarkMalloc),
+	                           STATIC_SEALED_VALUE(BenchmarkBroker),
+	                           publishCallback,
+	                           ackCallback,
+	                           TAs,
+	                           TAs_NUM,
+	                           networkBufferSize,
+	                           incomingPublishCount,
+	                           outgoingPublishCount,
+	                           clientID.data(),
+	                           clientID.size());
+	if (!Capability{handle}.is_valid())
+	{
+		Debug::log("Failed to connect.");
+		return;
+	}
+
+	// Subscribe to the loopback topic, so that QoS 0 messages come back.
+	t   = Timeout{MS_TO_TICKS(5000)};
+	ret = mqtt_subscribe(
+	  &t, handle, 0, loopbackTopic.data(), loopbackTopic.size());
+	if (ret < 0)
+	{
+		Debug::log("Failed to subscribe, error {}.", ret);
+		return;
+	}
+	t = Timeout{MS_TO_TICKS(1000)};
+	mqtt_run_blocking(&t, handle);
+
+	Debug::log("Publishing {} messages of {} bytes at each QoS level, at {}",
+	           MessageCount,
+	           PayloadSize,
+	           MessagesPerSecond == 0 ? "full speed" : "a fixed rate");
+	if (MessagesPerSecond != 0)
+	{
+		Debug::log("Rate: {} messages/s", MessagesPerSecond);
+	}
+	for (uint8_t qos = 0; qos <= 2; qos++)
+	{
+		if (!run_phase(handle, qos))
+		{
+			return;
+		}
+	}
+
+	t   = Timeout{MS_TO_TICKS(5000)};
+	ret = mqtt_disconnect(&t, STATIC_SEALED_VALUE(benchmarkMalloc), handle);
+	if (ret != 0)
+	{
+		Debug::log("Failed to disconnect, error {}.", ret);
+	}
+	Debug::log("Finished MQTT benchmark");
+}
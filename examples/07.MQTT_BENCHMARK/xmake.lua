@@ -0,0 +1,90 @@
+-- Copyright SCI Semiconductor and CHERIoT Contributors.
+-- SPDX-License-Identifier: MIT
+
+-- Update this to point to the location of the CHERIoT SDK
+sdkdir = path.absolute("../../../cheriot-rtos/sdk")
+
+set_project("CHERIoT MQTT Benchmark")
+
+includes(sdkdir)
+
+set_toolchains("cheriot-clang")
+
+includes(path.join(sdkdir, "lib"))
+includes("../../lib")
+
+option("board")
+  set_default("ibex-arty-a7-100")
+
+option("mqtt-benchmark-broker")
+  set_default("cheriot-broker.local")
+  set_description("Host name of the MQTT broker, which must match its certificate")
+  set_showmenu(true)
+
+option("mqtt-benchmark-payload-size")
+  set_default("64")
+  set_description("Size in bytes of the payload of each message")
+  set_showmenu(true)
+
+option("mqtt-benchmark-messages")
+  set_default("200")
+  set_description("Number of messages to publish at each QoS level")
+  set_showmenu(true)
+
+option("mqtt-benchmark-rate")
+  set_default("0")
+  set_description("Messages to publish per second, or 0 for as fast as possible")
+  set_showmenu(true)
+
+compartment("mqtt_benchmark")
+  add_includedirs("../../include")
+  add_deps("freestanding", "DNS", "TCPIP", "NetAPI", "TLS", "Firewall", "SNTP", "MQTT", "time_helpers", "debug")
+  -- stdio only needed for debug prints in MQTT, can be removed with --debug-mqtt=n
+  add_deps("stdio")
+  add_files("mqtt_benchmark.cc")
+  on_load(function(target)
+    target:add('options', "IPv6")
+    local IPv6 = get_config("IPv6")
+    target:add("defines", "CHERIOT_RTOS_OPTION_IPv6=" .. tostring(IPv6))
+    target:add('options', "mqtt-benchmark-broker", "mqtt-benchmark-payload-size", "mqtt-benchmark-messages", "mqtt-benchmark-rate")
+    target:add("defines", "MQTT_BENCHMARK_BROKER=\"" .. get_config("mqtt-benchmark-broker") .. "\"")
+    target:add("defines", "MQTT_BENCHMARK_PAYLOAD_SIZE=" .. get_config("mqtt-benchmark-payload-size"))
+    target:add("defines", "MQTT_BENCHMARK_MESSAGES=" .. get_config("mqtt-benchmark-messages"))
+    target:add("defines", "MQTT_BENCHMARK_RATE=" .. get_config("mqtt-benchmark-rate"))
+  end)
+
+firmware("07.mqtt_benchmark")
+  set_policy("build.warning", true)
+  add_deps("mqtt_benchmark")
+  on_load(function(target)
+    target:values_set("board", "$(board)")
+    target:values_set("threads", {
+      {
+        compartment = "mqtt_benchmark",
+        priority = 1,
+        entry_point = "benchmark",
+        -- TLS requires *huge* stacks!
+        stack_size = 8160,
+        trusted_stack_frames = 6
+      },
+      {
+        -- TCP/IP stack thread.
+        compartment = "TCPIP",
+        priority = 1,
+        entry_point = "ip_thread_entry",
+        stack_size = 0xe00,
+        trusted_stack_frames = 5
+      },
+      {
+        -- Firewall thread, handles incoming packets as they arrive.
+        compartment = "Firewall",
+        -- Higher priority, this will be back-pressured by the message
+        -- queue if the network stack can't keep up, but we want
+        -- packets to arrive immediately.
+        priority = 2,
+        entry_point = "ethernet_run_driver",
+        stack_size = 0x1000,
+        trusted_stack_frames = 5
+      }
+    }, {expand = false})
+  end)
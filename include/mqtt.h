@@ -2,13 +2,17 @@
 // SPDX-License-Identifier: MIT
 
 #pragma once
+#include <errno.h>
+#include <futex.h>
+#include <stdatomic.h>
 #include <timeout.h>
 #include <tls.h>
 #include <token.h>
 
 /**
  * Type of the PUBLISH callback. This user callback, passed to `mqtt_connect`,
- * will be called on all PUBLISH notifications from the broker.
+ * will be called on all PUBLISH notifications from the broker, except those
+ * delivered to a callback passed to `mqtt_subscribe_with_callback`.
  *
  * `topicName` and `payload` (and their respective size arguments) indicate the
  * topic of the PUBLISH, and the corresponding payload. Both are only valid
@@ -35,6 +39,34 @@ typedef void __cheri_callback (*MQTTPublishCallback)(const char *topicName,
 typedef void __cheri_callback (*MQTTAckCallback)(uint16_t packetID,
                                                  bool     isReject);
 
+/**
+ * Type of the SUBACK callback passed to `mqtt_subscribe_multiple`.  This is
+ * called, in addition to the ACK callback, when the broker acknowledges the
+ * SUBSCRIBE packet with ID `packetID`.
+ *
+ * `returnCodes` holds one return code for each filter of the SUBSCRIBE, in
+ * the same order: the maximum QoS granted (0, 1, or 2), or 0x80 if the broker
+ * rejected that filter.  It is only valid within the context of the callback
+ * and thus passed as a read-only, non-capturable capability.
+ */
+typedef void __cheri_callback (*MQTTSubackCallback)(uint16_t packetID,
+                                                    const uint8_t *returnCodes,
+                                                    size_t returnCodesCount);
+
+/**
+ * One topic filter of a `mqtt_subscribe_multiple` or
+ * `mqtt_unsubscribe_multiple` request.
+ */
+struct MQTTSubscription
+{
+	/// The filter, which must be a valid MQTT 3.1.1 filter.
+	const char *filter;
+	/// The length of `filter`.
+	size_t filterLength;
+	/// The QoS (0, 1, or 2).  Ignored by `mqtt_unsubscribe_multiple`.
+	uint8_t qos;
+};
+
 /**
  * Creates a new unauthenticated TLS-tunneled MQTT connection. Returns null on
  * failure, or a sealed MQTT connection object on success.
@@ -171,6 +203,10 @@ int __cheri_compartment("MQTT")
  *
  * If a publish is successful and QoS > 0, an ACK must be fetched through
  * `mqtt_run`.
+ *
+ * If the offline queue has been enabled with `mqtt_offline_queue_enable`,
+ * publishes made while the link is down are queued and this returns zero
+ * instead of a packet ID, or `-EAGAIN` if the queue is full.
  */
 int __cheri_compartment("MQTT") mqtt_publish(Timeout    *t,
                                              SObj        mqttHandle,
@@ -181,6 +217,59 @@ int __cheri_compartment("MQTT") mqtt_publish(Timeout    *t,
                                              size_t      payloadLength,
                                              bool        retain = false);
 
+/**
+ * A message for `mqtt_publish_batch`.  The fields other than `result` have
+ * the same meaning as the corresponding arguments to `mqtt_publish`.
+ */
+struct MQTTPublishRequest
+{
+	const char *topic;
+	size_t      topicLength;
+	const void *payload;
+	size_t      payloadLength;
+	uint8_t     qos;
+	bool        retain;
+	/**
+	 * Set by `mqtt_publish_batch` to the value that `mqtt_publish` would
+	 * have returned for this message: the packet ID, or a negative error
+	 * code.  Messages after a failed one are not sent and have their result
+	 * set to `-ECANCELED`.
+	 */
+	int result;
+};
+
+/**
+ * Publish several messages on a given MQTT connection.
+ *
+ * Each call to `mqtt_publish` sends its packet in its own TLS record, and
+ * usually its own TCP segment.  This function instead sends the `count`
+ * messages in `requests`, in order, and flushes the TLS connection once at
+ * the end, so that a burst of small messages shares records and segments.
+ *
+ * The per-message outcome is stored in the `result` field of each request.
+ * Packet IDs of messages with QoS > 0 can be matched with ACK callback calls
+ * in the same way as for `mqtt_publish`.  Sending stops at the first message
+ * that fails.  The buffers that the requests point to must remain valid
+ * during the execution of this function, as for `mqtt_publish`.
+ *
+ * The return value is the number of messages that were sent, or a negative
+ * error code if none were.  The error codes are those of `mqtt_publish`.
+ * `-EINVAL` is also returned if `requests` cannot be read and written.
+ *
+ * If the link dies before the final flush completes, this returns
+ * `-ENOTCONN` if reconnection is enabled (see `mqtt_reconnect_enable`) and
+ * `-ECONNABORTED` otherwise, even though the `result` fields of the messages
+ * that were written hold packet IDs.  With reconnection enabled, the messages
+ * with QoS > 0 are sent again once the link has been re-established, but
+ * those with QoS 0 are lost.  This is the case even if the offline queue is
+ * enabled, because the messages were not queued.
+ */
+int __cheri_compartment("MQTT")
+  mqtt_publish_batch(Timeout                   *t,
+                     SObj                       mqttHandle,
+                     struct MQTTPublishRequest *requests,
+                     size_t                     count);
+
 /**
  * Subscribe on a given MQTT connection.
  *
@@ -222,6 +311,193 @@ int __cheri_compartment("MQTT") mqtt_subscribe(Timeout    *t,
                                                const char *filter,
                                                size_t      filterLength);
 
+/**
+ * Subscribe on a given MQTT connection, with a callback for the publishes
+ * that match `filter`.
+ *
+ * This behaves like `mqtt_subscribe`, but PUBLISH notifications whose topic
+ * matches `filter` are delivered to `callback` instead of to the callback
+ * passed to `mqtt_connect`.  Filters are matched in the MQTT compartment,
+ * including the `+` and `#` wildcards, so that callbacks do not need to parse
+ * topics.  If a topic matches several filters, the callback of each is
+ * invoked.  Topics that match no filter registered with this function are
+ * delivered to the callback passed to `mqtt_connect`.
+ *
+ * Subscribing again to the same filter replaces the callback.  The callback is
+ * removed by `mqtt_unsubscribe` with the same filter.  Filters may have at
+ * most 16 levels.
+ *
+ * The callback is registered with memory from the allocator passed to
+ * `mqtt_connect`, which is released by `mqtt_unsubscribe` and
+ * `mqtt_disconnect`.  In addition to the errors returned by `mqtt_subscribe`,
+ * this returns `-EINVAL` if `filter` has too many levels and `-ENOMEM` if the
+ * allocator does not have enough quota to register the callback.
+ */
+int __cheri_compartment("MQTT")
+  mqtt_subscribe_with_callback(Timeout            *t,
+                               SObj                mqttHandle,
+                               uint8_t             qos,
+                               const char         *filter,
+                               size_t              filterLength,
+                               MQTTPublishCallback callback);
+
+/**
+ * A ring into which the MQTT compartment writes PUBLISH notifications, for
+ * `mqtt_ring_attach`.
+ *
+ * The ring is a single-producer, single-consumer queue of records in `data`.
+ * `producer` and `consumer` are free-running byte counters: the next record to
+ * read is at `data[consumer % size]` and the ring is empty when the two are
+ * equal.  The MQTT compartment advances `producer` after writing a record and
+ * wakes any threads waiting on it with a futex.  The consumer advances
+ * `consumer` after it has finished with a record, which frees its space.
+ *
+ * Use the `mqtt_ring_*` inline functions below to read the ring.
+ */
+struct MQTTRing
+{
+	/// Bytes written by the MQTT compartment.  Also used as a futex word.
+	_Atomic(uint32_t) producer;
+	/// Bytes released by the consumer.
+	_Atomic(uint32_t) consumer;
+	/// Publishes that were dropped because the ring was full.
+	_Atomic(uint32_t) dropped;
+	/// The size of `data`, set by `mqtt_ring_attach`.  A power of two.
+	uint32_t size;
+	/// The records.
+	_Alignas(8) uint8_t data[];
+};
+
+/**
+ * The header of a record in an `MQTTRing`.  The payload follows the header
+ * and the next record starts at the next multiple of 8 bytes.
+ */
+struct MQTTRingRecord
+{
+	/**
+	 * The topic ID passed to `mqtt_subscribe_to_ring` for the filter that
+	 * matched the publish, or `MQTTRingPadding` for a record that only
+	 * fills the end of the ring.
+	 */
+	uint16_t topicId;
+	/// Reserved, zero.
+	uint16_t reserved;
+	/// The length of the payload.
+	uint32_t payloadLength;
+	/// The payload.
+	uint8_t payload[];
+};
+
+/**
+ * Topic ID of records that fill the end of the ring so that the next record
+ * does not wrap.  These are skipped by `mqtt_ring_next`.
+ */
+#define MQTTRingPadding 0xffff
+
+/**
+ * Attach `ring` to an MQTT connection.  `ring` must point to `ringSize`
+ * bytes, which must be writeable and capturable (for example, a heap
+ * allocation), and is claimed with the allocator passed to `mqtt_connect`
+ * until it is detached.  The usable part of the ring is rounded down to a
+ * power of two, which must be at least 64 bytes.  The ring is reset when it
+ * is attached.
+ *
+ * PUBLISH notifications that match filters subscribed with
+ * `mqtt_subscribe_to_ring` are then copied into the ring by `mqtt_run`
+ * instead of being delivered to a callback, so that a consumer on another
+ * thread can process them without holding the connection's lock.  If a
+ * publish does not fit, it is dropped and counted in `dropped`.
+ *
+ * Passing a null `ring` detaches the current ring.  Returns zero on success or
+ * a negative error code:
+ *
+ *  - `-EINVAL`: The handle is not valid, or the ring is too small or does not
+ *               have the required permissions.
+ *  - `-ENOMEM`: The ring could not be claimed.
+ *  - `-ETIMEDOUT`: The timeout was reached before the connection could be
+ *                  locked.
+ */
+int __cheri_compartment("MQTT") mqtt_ring_attach(Timeout         *t,
+                                                 SObj             mqttHandle,
+                                                 struct MQTTRing *ring,
+                                                 size_t           ringSize);
+
+/**
+ * Subscribe on a given MQTT connection, delivering the publishes that match
+ * `filter` into the connection's ring (see `mqtt_ring_attach`) as records
+ * with the topic ID `topicId`.
+ *
+ * This behaves like `mqtt_subscribe_with_callback`, with the same errors.
+ * `topicId` must not be `MQTTRingPadding`.  Publishes that match the filter
+ * while no ring is attached are dropped.
+ */
+int __cheri_compartment("MQTT")
+  mqtt_subscribe_to_ring(Timeout    *t,
+                         SObj        mqttHandle,
+                         uint8_t     qos,
+                         const char *filter,
+                         size_t      filterLength,
+                         uint16_t    topicId);
+
+/**
+ * Returns the next record in `ring`, or null if the ring is empty.  The
+ * record remains valid until it is released with `mqtt_ring_release`.
+ */
+static inline struct MQTTRingRecord *mqtt_ring_next(struct MQTTRing *ring)
+{
+	uint32_t consumer =
+	  __c11_atomic_load(&ring->consumer, __ATOMIC_RELAXED);
+	while (consumer != __c11_atomic_load(&ring->producer, __ATOMIC_ACQUIRE))
+	{
+		// C-style cast required because this file can be included in C.
+		struct MQTTRingRecord *record = (struct MQTTRingRecord *) // NOLINT
+		  &ring->data[consumer & (ring->size - 1)];
+		if (record->topicId != MQTTRingPadding)
+		{
+			return record;
+		}
+		consumer += ring->size - (consumer & (ring->size - 1));
+		__c11_atomic_store(&ring->consumer, consumer, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+/**
+ * Release `record`, which must be the record most recently returned by
+ * `mqtt_ring_next`, so that its space can be reused.
+ */
+static inline void mqtt_ring_release(struct MQTTRing       *ring,
+                                     struct MQTTRingRecord *record)
+{
+	uint32_t length =
+	  (sizeof(struct MQTTRingRecord) + record->payloadLength + 7) & ~7U;
+	__c11_atomic_fetch_add(&ring->consumer, length, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wait until `ring` is not empty.  Returns zero if there is a record to read,
+ * or `-ETIMEDOUT` if the timeout expired first.
+ */
+static inline int mqtt_ring_wait(Timeout *t, struct MQTTRing *ring)
+{
+	while (mqtt_ring_next(ring) == NULL)
+	{
+		uint32_t producer =
+		  __c11_atomic_load(&ring->producer, __ATOMIC_ACQUIRE);
+		if (producer != __c11_atomic_load(&ring->consumer, __ATOMIC_RELAXED))
+		{
+			continue;
+		}
+		// C-style cast required because this file can be included in C.
+		const uint32_t *word = (const uint32_t *)&ring->producer; // NOLINT
+		if (futex_timed_wait(t, word, producer) == -ETIMEDOUT)
+		{
+			return -ETIMEDOUT;
+		}
+	}
+	return 0;
+}
+
 /**
  * Unsubscribe on a given MQTT connection.
  *
@@ -231,6 +507,10 @@ int __cheri_compartment("MQTT") mqtt_subscribe(Timeout    *t,
  *
  * `qos` indicates the level of QoS (0, 1, or 2).
  *
+ * If a callback was registered for `filter` with
+ * `mqtt_subscribe_with_callback`, it is removed once the unsubscribe has been
+ * sent.
+ *
  * The filter buffer must remain valid during the execution of this function.
  * If the caller frees it during the execution of this function, the
  * unsubscribe may leak application data to the broker through the filter.
@@ -264,6 +544,50 @@ int __cheri_compartment("MQTT") mqtt_unsubscribe(Timeout    *t,
                                                  const char *filter,
                                                  size_t      filterLength);
 
+/**
+ * Subscribe to the `count` filters in `subscriptions` on a given MQTT
+ * connection, with a single SUBSCRIBE packet.
+ *
+ * This behaves like calling `mqtt_subscribe` for each filter, but the broker
+ * acknowledges all of the filters with a single SUBACK, so subscribing to
+ * many topics takes one round trip.  The SUBACK is reported to the ACK
+ * callback, with `isReject` set if the broker rejected any of the filters.
+ * If `subackCallback` is not null then it is also called with the return
+ * code for each filter.  Registering it uses memory from the allocator passed
+ * to `mqtt_connect` until the SUBACK arrives.
+ *
+ * The filters and the `subscriptions` array must remain valid during the
+ * execution of this function.  The whole packet must fit in the network
+ * buffer passed to `mqtt_connect`.
+ *
+ * The return value is the packet ID of the SUBSCRIBE packet, or a negative
+ * error code as for `mqtt_subscribe`.  `-EINVAL` is also returned if `count`
+ * is zero or `subscriptions` cannot be read, and `-ENOMEM` if the packet does
+ * not fit in the network buffer.
+ */
+int __cheri_compartment("MQTT")
+  mqtt_subscribe_multiple(Timeout                       *t,
+                          SObj                           mqttHandle,
+                          const struct MQTTSubscription *subscriptions,
+                          size_t                         count,
+                          MQTTSubackCallback             subackCallback);
+
+/**
+ * Unsubscribe from the `count` filters in `subscriptions` on a given MQTT
+ * connection, with a single UNSUBSCRIBE packet.
+ *
+ * This behaves like calling `mqtt_unsubscribe` for each filter, including
+ * removing the callbacks registered for the filters, but the broker
+ * acknowledges all of them with a single UNSUBACK.  The return value is the
+ * packet ID of the UNSUBSCRIBE packet, or a negative error code as for
+ * `mqtt_subscribe_multiple`.
+ */
+int __cheri_compartment("MQTT")
+  mqtt_unsubscribe_multiple(Timeout                       *t,
+                            SObj                           mqttHandle,
+                            const struct MQTTSubscription *subscriptions,
+                            size_t                         count);
+
 /**
  * Fetch ACK and PUBLISH notifications on a given MQTT connection, and keep
  * the connection alive.
@@ -287,9 +611,172 @@ int __cheri_compartment("MQTT") mqtt_unsubscribe(Timeout    *t,
  *                     with this handle.
  *  - `-EAGAIN`: An unspecified error happened in the underlying coreMQTT
  *               library. Try again.
+ *
+ * If reconnection has been enabled with `mqtt_reconnect_enable`, this also
+ * returns `-ENOTCONN` while the link is being re-established and
+ * `-ECONNRESET` once it has been re-established with a new session.
  */
 int __cheri_compartment("MQTT") mqtt_run(Timeout *t, SObj mqttHandle);
 
+/**
+ * Event-driven variant of `mqtt_run`.
+ *
+ * `mqtt_run` returns as soon as there are no more notifications to fetch, so
+ * a thread that calls it in a loop spins.  This function instead sleeps until
+ * the broker sends data or the connection's next keepalive deadline is due,
+ * whichever comes first, and then behaves like `mqtt_run`.  A thread that
+ * services a connection can simply call this in a loop with a long (or
+ * unlimited) timeout.
+ *
+ * The TLS compartment and the network stack keep the connection locked while
+ * they wait for data, so the wait is split into slices of 100 ms, with the
+ * connection unlocked for a tick between them.  Publish and subscribe calls
+ * from other threads are therefore delayed by at most about one slice.  The
+ * cost is that an idle connection is not free: the servicing thread wakes
+ * about ten times a second, and each wake-up calls into the TLS compartment
+ * and the network stack.  This is much cheaper than a thread spinning in
+ * `mqtt_run`, but it is periodic polling rather than a wait that uses no CPU
+ * until there is work to do.
+ *
+ * The return value is zero if notifications were fetched or a keepalive was
+ * handled, or a negative error code.  The error codes are those of
+ * `mqtt_run`, where `-ETIMEDOUT` means that the timeout was reached before
+ * anything happened on the connection.
+ */
+int __cheri_compartment("MQTT") mqtt_run_blocking(Timeout *t, SObj mqttHandle);
+
+/**
+ * Service several MQTT connections from a single thread.
+ *
+ * `mqttHandles` is an array of `count` MQTT handles.  This checks each
+ * connection, without waiting, for data from the broker, a keepalive that is
+ * due, or a dead link, and behaves like `mqtt_run` on those that need
+ * attention.  If none does, it sleeps and checks again, until at least one
+ * connection has been serviced or the timeout expires.  A gateway that bridges
+ * to several brokers can therefore use one thread, and one stack, for all of
+ * its connections by calling this in a loop.
+ *
+ * The network stack cannot wait for data on several sockets at once, so
+ * connections are checked periodically.  The interval starts at one tick and
+ * doubles while all of the connections are idle, up to 50 ms, so data that
+ * arrive after a quiet period may wait that long before being processed.
+ * Connections that another thread is using are skipped.  Connections that are
+ * waiting to reconnect (see `mqtt_reconnect_enable`) are skipped until their
+ * next attempt is due, but the attempt itself blocks the other connections.
+ *
+ * On return, `results[i]` holds the result for `mqttHandles[i]`: the value
+ * that `mqtt_run` returned for it, or `-ETIMEDOUT` if it did not need
+ * attention.
+ *
+ * The return value is the number of connections for which `results` is not
+ * `-ETIMEDOUT`, or a negative error code:
+ *
+ *  - `-EINVAL`: `count` is zero or an array is not valid.
+ *  - `-ETIMEDOUT`: The timeout was reached before any connection needed
+ *                  attention.
+ */
+int __cheri_compartment("MQTT")
+  mqtt_run_many(Timeout *t, SObj *mqttHandles, size_t count, int *results);
+
+/**
+ * Enable managed reconnection on a given MQTT connection.
+ *
+ * By default, a connection whose link dies is unusable: `mqtt_run` returns
+ * `-ECONNABORTED` and the client must call `mqtt_disconnect` and
+ * `mqtt_connect` again, which repeats the DNS lookup and the TCP and TLS
+ * handshakes, and loses the QoS state of publishes in flight.  With
+ * reconnection enabled, `mqtt_run` and `mqtt_run_blocking` instead
+ * re-establish the link themselves, reusing the connection's buffers:
+ *
+ *  - The TLS connection is re-established with `tls_connection_reconnect`,
+ *    which resumes the previous TLS session if the broker still has it.
+ *  - The MQTT connection is re-established with the client ID passed to
+ *    `mqtt_connect` and without a clean session, so the broker keeps the
+ *    subscriptions and the QoS state of the previous connection.
+ *  - Publishes with QoS > 0 that had not been acknowledged are sent again.
+ *    To make this possible, each QoS > 0 publish is copied (with the
+ *    allocator passed to `mqtt_connect`) until it is acknowledged, so
+ *    publishing can fail with `-ENOMEM` when the quota is exhausted.
+ *
+ * Attempts are spaced by a delay that starts at `minimumBackoffMilliseconds`
+ * and doubles after each failure up to `maximumBackoffMilliseconds`, with
+ * some random jitter.  The delay returns to the minimum once an attempt
+ * succeeds.  While the link is down, `mqtt_run` and `mqtt_run_blocking`
+ * return `-ENOTCONN` when the timeout expires before the link is back, and
+ * publish, subscribe and unsubscribe calls fail with `-ENOTCONN` instead of
+ * `-ECONNABORTED`.  If the link has been re-established but the broker had no
+ * session for the client (for example because `mqtt_connect` was called with
+ * `newSession` set, or the broker expired the session), the run functions
+ * return `-ECONNRESET`.  The connection is then usable, but the client must
+ * subscribe again and any unacknowledged publishes have been lost.
+ *
+ * `-ECONNABORTED` is still returned if the link cannot be re-established at
+ * all, for example because the TLS connection has been parked.  This applies
+ * to connections that have been parked at any point, even if they have since
+ * been unparked by use.
+ *
+ * Passing zero for `maximumBackoffMilliseconds` disables reconnection.
+ * Otherwise, `minimumBackoffMilliseconds` must be non-zero and not greater
+ * than `maximumBackoffMilliseconds`.
+ *
+ * The trust anchors passed to `mqtt_connect` must remain valid while
+ * reconnection is enabled, because a broker that does not resume the TLS
+ * session must be authenticated again.
+ *
+ * The return value is zero on success or a negative error code:
+ *
+ *  - `-EINVAL`: A parameter is not valid.
+ *  - `-ETIMEDOUT`: The timeout was reached before the connection's lock could
+ *                  be acquired.
+ */
+int __cheri_compartment("MQTT")
+  mqtt_reconnect_enable(Timeout *t,
+                        SObj     mqttHandle,
+                        uint32_t minimumBackoffMilliseconds,
+                        uint32_t maximumBackoffMilliseconds);
+
+/**
+ * Enable the offline publish queue on a given MQTT connection, which must
+ * have reconnection enabled with `mqtt_reconnect_enable`.
+ *
+ * While the link to the broker is down, publishes (with `mqtt_publish` or
+ * `mqtt_publish_batch`) are copied into a queue of up to `capacity` entries
+ * instead of failing with `-ENOTCONN`.  The copies are allocated with the
+ * allocator passed to `mqtt_connect`.  Once the link has been re-established,
+ * `mqtt_run` and `mqtt_run_blocking` send the queued publishes in order,
+ * sharing TLS records, before doing anything else.  Publishes made while
+ * queued publishes remain are queued behind them, so that the broker receives
+ * all publishes in the order in which they were made.
+ *
+ * Queued publishes have not been given a packet ID: `mqtt_publish` returns
+ * zero for them.  When the queue is full, `mqtt_publish` returns `-EAGAIN`
+ * and the publish is not queued.  The application can use
+ * `mqtt_offline_queue_depth` to decide when to try again.
+ *
+ * Passing zero for `capacity` disables the queue and discards the queued
+ * publishes, as does disabling reconnection.
+ *
+ * The return value is zero on success or a negative error code:
+ *
+ *  - `-EINVAL`: A parameter is not valid.
+ *  - `-EBUSY`: More than `capacity` publishes are already queued.
+ *  - `-ETIMEDOUT`: The timeout was reached before the connection's lock could
+ *                  be acquired.
+ */
+int __cheri_compartment("MQTT")
+  mqtt_offline_queue_enable(Timeout *t, SObj mqttHandle, uint32_t capacity);
+
+/**
+ * Returns the number of publishes in the offline queue of a given MQTT
+ * connection, or a negative error code:
+ *
+ *  - `-EINVAL`: A parameter is not valid.
+ *  - `-ETIMEDOUT`: The timeout was reached before the connection's lock could
+ *                  be acquired.
+ */
+int __cheri_compartment("MQTT")
+  mqtt_offline_queue_depth(Timeout *t, SObj mqttHandle);
+
 /**
  * Generate a valid, random MQTT 3.1.1 client ID of length `length` into
  * `buffer`, for passing to `mqtt_connect`.
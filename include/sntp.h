@@ -20,28 +20,109 @@ struct timeval // NOLINT
 	suseconds_t tv_usec; // NOLINT
 };
 
+struct timespec // NOLINT
+{
+	time_t tv_sec;  // NOLINT
+	long   tv_nsec; // NOLINT
+};
+
+typedef int clockid_t; // NOLINT
+
+/// The time since the UNIX epoch, synchronised with NTP.
+#define CLOCK_REALTIME 0
+/// The time since boot, from the cycle counter at its nominal frequency.
+#define CLOCK_MONOTONIC 1
+/// `CLOCK_REALTIME` with a resolution of about a millisecond, but faster.
+#define CLOCK_REALTIME_COARSE 5
+/// `CLOCK_MONOTONIC` with a resolution of about a millisecond, but faster.
+#define CLOCK_MONOTONIC_COARSE 6
+
 /**
  * The pair of a time synchronised from NTP and the cycle count where this time
- * was read.
+ * was read, and the corrections to apply to the cycle counter's nominal
+ * frequency when extrapolating from it.
+ *
+ * The clock advances from `seconds` and `nanoseconds` at the nominal rate of
+ * `CPU_TIMER_HZ`, corrected by `frequencyPpb`.  For the first `slewCycles`
+ * cycles after `cycles`, it is additionally corrected by `slewPpb`, which
+ * gradually removes an offset measured by `sntp_discipline` instead of
+ * stepping the clock.
+ *
+ * The SNTP compartment precomputes the resulting rates as 32.32 fixed-point
+ * nanoseconds per cycle, so that reading the clock needs only a few
+ * multiplications and no division.  A zero `nanosecondsPerCycle` means that
+ * the clock has never been set and advances at the nominal rate.
  */
 struct SynchronisedTime
 {
 	uint64_t          cycles;
 	time_t            seconds;
-	suseconds_t       microseconds;
+	uint32_t          nanoseconds;
 	_Atomic(uint32_t) updatingEpoch;
+	/// The estimated error of the cycle counter, in parts per billion.
+	int32_t frequencyPpb;
+	/// The additional rate correction while slewing, in parts per billion.
+	int32_t slewPpb;
+	/// The number of cycles over which `slewPpb` applies.
+	uint64_t slewCycles;
+	/// The rate during the first `slewCycles` cycles.
+	uint64_t slewNanosecondsPerCycle;
+	/// The number of nanoseconds that elapse during those cycles.
+	uint64_t slewNanoseconds;
+	/// The rate after the first `slewCycles` cycles.
+	uint64_t nanosecondsPerCycle;
 };
 
-_Static_assert(sizeof(struct SynchronisedTime) == 24,
+_Static_assert(sizeof(struct SynchronisedTime) == 64,
                "SynchronisedTime size has changed, please update the "
                "definition in xmake.lua");
 
 /**
  * Update the time using SNTP.  This updates the value stored in the
  * `SynchronisedTime` structure returned by `sntp_time_get()`.
+ *
+ * Each update samples several servers and keeps the sample with the lowest
+ * round-trip delay from each.  Servers that disagree with the majority are
+ * rejected, and the rest are combined.  A single delayed or wrong response
+ * therefore does not skew the clock.  The update usually completes after one
+ * round of samples.  If no server answers, or no majority of the servers that
+ * answered agree, the servers are sampled again, two seconds apart so that
+ * they do not rate-limit the client, up to four times or until the timeout
+ * expires.
+ *
+ * The socket, and the servers' addresses, are kept between updates.  The
+ * servers are only resolved again once a day or when one of them stops
+ * answering, so periodic updates do not repeat the DNS lookups.
+ *
+ * The time is stepped to the combined servers' time.  Any frequency
+ * correction estimated by `sntp_discipline` is kept.  Returns zero on
+ * success, `-ECONNREFUSED` if no majority of the servers that answered agree,
+ * or another negative error code if no server answered.
  */
 int __cheri_compartment("SNTP") sntp_update(Timeout *timeout);
 
+/**
+ * Keep the time disciplined to NTP until `timeout` expires.
+ *
+ * This is intended to be called, with an unlimited timeout, from a thread
+ * dedicated to it.  It polls the NTP servers periodically (each poll is a
+ * burst of samples as for `sntp_update`, except that all four rounds are
+ * taken so that the frequency estimate uses the lowest-delay samples) and,
+ * rather than stepping the clock after each poll, it estimates the error of
+ * the cycle counter's frequency and slews the clock to remove small offsets,
+ * so that the clock stays accurate and monotonic between polls.  The interval
+ * between polls starts at 64 seconds and doubles, up to 1024 seconds, while the
+ * measured offsets stay small, and shrinks again if they grow.  Offsets of
+ * more than 128 ms, including the one at the first poll, step the clock.
+ * Failed polls are retried after the minimum interval.
+ *
+ * Returns 0 when the timeout expires if the last poll succeeded, otherwise
+ * the error from the last poll (the error codes of `sntp_update`), or
+ * `-ETIMEDOUT` if no poll completed.  `-EINVAL` is returned if `timeout` is
+ * not valid.
+ */
+int __cheri_compartment("SNTP") sntp_discipline(Timeout *timeout);
+
 /**
  * Returns a read-only pointer to the synchronised time structure.  This can be
  * used to get the current time (modulo clock drift) without a
@@ -55,6 +136,22 @@ struct SynchronisedTime *__cheri_compartment("SNTP") sntp_time_get(void);
  */
 int __cheri_libcall timeval_calculate(struct timeval *__restrict tp);
 
+/**
+ * POSIX-compatible clock_gettime() implementation.
+ *
+ * `CLOCK_REALTIME` is calculated in the same way as for `gettimeofday`, but
+ * with nanosecond resolution.  `CLOCK_MONOTONIC` is calculated from the cycle
+ * counter alone, so it does not need to read the synchronised time and is
+ * never stepped or slewed by NTP.  The `_COARSE` variants drop the low bits of
+ * the cycle count and of the rate, which saves half of the multiplications,
+ * and have a resolution of about a millisecond.  They advance at the same
+ * rate as the precise clocks, to within about one part per billion, so they
+ * are truncated versions of them rather than separate clocks that drift.
+ *
+ * Returns zero on success, or `-EINVAL` if `clock` is not one of these.
+ */
+int __cheri_libcall clock_gettime(clockid_t clock, struct timespec *tp);
+
 /**
  * POSIX-compatible gettimeofday() implementation that uses the SNTP time.
  *
@@ -72,12 +169,13 @@ __always_inline static inline int gettimeofday(struct timeval *__restrict tp,
  * POSIX-compatible time() implementation that uses the SNTP time.
  *
  * Calculates the time based on the number of cycles that have elapsed since
- * the last update from SNTP.
+ * the last update from SNTP.  Only whole seconds are needed, so this uses the
+ * coarse clock.
  */
 static inline time_t time(time_t *tloc)
 {
-	struct timeval tv;
-	if (gettimeofday(&tv, NULL) == -1)
+	struct timespec tv;
+	if (clock_gettime(CLOCK_REALTIME_COARSE, &tv) != 0)
 	{
 		// C-style cast required because this file can be included in C.
 		return (time_t)-1; // NOLINT
@@ -43,6 +43,209 @@ SObj __cheri_compartment("TLS")
                         const br_x509_trust_anchor *trustAnchors,
                         size_t                      trustAnchorsCount);
 
+/**
+ * Starts creating a new TLS connection but does not connect to the host or
+ * wait for the TLS handshake.  Returns an untagged value on failure or a
+ * sealed TLS connection object, whose connection and handshake are pending,
+ * on success.
+ *
+ * The arguments are the same as for `tls_connection_create`.  This call only
+ * allocates and initialises the connection object.  Resolving the host name,
+ * establishing the TCP connection, and the handshake are all performed by
+ * subsequent calls to `tls_connection_progress`.  This allows a single thread
+ * to overlap the connections to several hosts, or to hand them to a worker
+ * thread.
+ *
+ * The trust anchors are used during the handshake and so, unlike with
+ * `tls_connection_create`, they must remain valid until the handshake has
+ * completed.
+ *
+ * Until the handshake has completed, `tls_connection_send` and the receive
+ * functions will fail with `-ENOTCONN`.  A pending connection may be closed
+ * with `tls_connection_close` at any time.
+ */
+SObj __cheri_compartment("TLS")
+  tls_connection_create_async(Timeout                    *t,
+                              SObj                        allocator,
+                              SObj                        connectionCapability,
+                              const br_x509_trust_anchor *trustAnchors,
+                              size_t                      trustAnchorsCount);
+
+/**
+ * Drive the handshake for a connection returned by
+ * `tls_connection_create_async`.  The first call connects to the host, which
+ * may block for up to the timeout; if the timeout expires first then the next
+ * call tries again, so the connection needs a non-zero timeout to make
+ * progress.  Once connected, this sends and receives handshake records until
+ * the handshake completes, fails, or the timeout expires.  A zero timeout
+ * then processes whatever is already available without blocking.
+ *
+ * The return value is one of:
+ *
+ *  - 0: The handshake has completed and the connection is ready for use.
+ *  - `-EINPROGRESS`: The timeout expired before the handshake completed.  Call
+ *    this function again to continue.
+ *  - `-ECONNABORTED`: The connection or handshake failed (for example, the
+ *    host was unreachable, the server's certificate was not trusted, or the
+ *    link died).  The connection must be closed.
+ *  - `-EINVAL`: The connection or timeout is not valid.
+ *  - `-ETIMEDOUT`: The timeout expired before the connection's lock could be
+ *    acquired.
+ *
+ * Calling this on a connection whose handshake has already completed returns
+ * 0 immediately.
+ */
+int __cheri_compartment("TLS")
+  tls_connection_progress(Timeout *t, SObj sealedConnection);
+
+/**
+ * Wait for the handshake of a connection returned by
+ * `tls_connection_create_async` to finish, without driving it.  This is
+ * intended for use when another thread is calling `tls_connection_progress`.
+ * Completion is signalled with a futex and so waiting threads do not consume
+ * CPU time.
+ *
+ * Returns 0 if the handshake completed, `-ECONNABORTED` if it failed (or the
+ * connection was closed), `-ETIMEDOUT` if the timeout expired first, or
+ * `-EINVAL` if the arguments are not valid.
+ */
+int __cheri_compartment("TLS")
+  tls_connection_wait(Timeout *t, SObj sealedConnection);
+
+/**
+ * Creates a trust anchor store from an array of `trustAnchorsCount` trust
+ * anchors.  Returns an untagged value on failure or a sealed trust anchor
+ * store on success.  The store is allocated with `allocator`.
+ *
+ * BearSSL's X.509 engine compares each certificate in a chain against every
+ * trust anchor that it is given, hashing the anchor's DN each time.  This is
+ * slow with a realistic CA bundle.  A trust anchor store sorts the anchors by
+ * the hash of their DN once, so that connections created with
+ * `tls_connection_create_with_store` consider only the anchors whose DN
+ * matches the issuer or subject of each certificate.
+ *
+ * The store copies the array of anchors but not the DNs or keys that they
+ * point to.  These must remain valid for as long as the store is in use.
+ */
+SObj __cheri_compartment("TLS")
+  tls_trust_anchor_store_create(Timeout                    *t,
+                                SObj                        allocator,
+                                const br_x509_trust_anchor *trustAnchors,
+                                size_t                      trustAnchorsCount);
+
+/**
+ * Enable a validation cache for a trust anchor store.  The cache holds up to
+ * `entries` end-entity certificates, allocated with `allocator`, and should be
+ * enabled before the store is used for any connections.  The cache is freed
+ * with the same allocator when the store is destroyed.
+ *
+ * When a certificate chain has been validated against the anchors in the
+ * store, the SHA-256 hash of the end-entity certificate is recorded.  If a
+ * later connection is presented with a byte-identical end-entity certificate,
+ * the certificate's validity period and server name are still checked but
+ * the rest of the chain is not verified, avoiding the signature checks.  An
+ * entry expires at the earliest `notAfter` time of any certificate in the
+ * chain that it was validated with, or `maxAgeSeconds` after it was added,
+ * whichever is sooner.  This requires the time to have been set with SNTP.
+ *
+ * Returns 0 on success or one of the following errors:
+ *
+ *  - `-EINVAL`: The arguments are not valid.
+ *  - `-EEXIST`: The cache has already been enabled for this store.
+ *  - `-ENOMEM`: The cache could not be allocated.
+ *  - `-ETIMEDOUT`: The timeout expired before the store's lock could be
+ *    acquired.
+ */
+int __cheri_compartment("TLS")
+  tls_trust_anchor_store_cache_enable(Timeout *t,
+                                      SObj     allocator,
+                                      SObj     trustAnchorStore,
+                                      size_t   entries,
+                                      uint32_t maxAgeSeconds);
+
+/**
+ * Destroy a trust anchor store created with `tls_trust_anchor_store_create`.
+ * The `allocator` must be the one used to create the store and, if it is
+ * enabled, its validation cache.  Returns 0 on success or a negative error
+ * code:
+ *
+ *  - `-EINVAL`: The store object or allocator is not valid.
+ *  - `-EBUSY`: Connections created with this store are still open and may
+ *    perform a handshake.
+ */
+int __cheri_compartment("TLS")
+  tls_trust_anchor_store_destroy(SObj allocator, SObj trustAnchorStore);
+
+/**
+ * Creates a new TLS connection, validating the server's certificates against
+ * the trust anchors in a store created with `tls_trust_anchor_store_create`.
+ * This is otherwise identical to `tls_connection_create`.
+ */
+SObj __cheri_compartment("TLS")
+  tls_connection_create_with_store(Timeout *t,
+                                   SObj     allocator,
+                                   SObj     connectionCapability,
+                                   SObj     trustAnchorStore);
+
+/**
+ * Creates a TLS server configuration.  Returns an untagged value on failure or
+ * a sealed server object on success.
+ *
+ * The server presents the `chainLength` certificates in `chain` (end-entity
+ * certificate first) and authenticates with the ECDSA private key `key`.  Only
+ * the ECDHE-ECDSA cipher suite with AES-128-GCM is offered.  The certificates
+ * and key are copied, so the caller may free them after this call returns.
+ *
+ * If `sessionCacheEntries` is non-zero then the server keeps the parameters of
+ * that many recent sessions so that returning clients can resume a session
+ * with an abbreviated handshake, which avoids the ECDHE computation and the
+ * ECDSA signature.  Each entry uses 100 bytes and at most 65535 entries are
+ * accepted.  The cache is shared by all connections created with this server
+ * object.
+ *
+ * The configuration is allocated with `allocator`.
+ */
+SObj __cheri_compartment("TLS")
+  tls_server_create(Timeout                   *t,
+                    SObj                       allocator,
+                    const br_x509_certificate *chain,
+                    size_t                     chainLength,
+                    const br_ec_private_key   *key,
+                    size_t                     sessionCacheEntries);
+
+/**
+ * Destroy a TLS server configuration created with `tls_server_create`.
+ * Returns 0 on success or a negative error code:
+ *
+ *  - `-EINVAL`: The server object or allocator is not valid.
+ *  - `-EBUSY`: Connections created with this server are still open.
+ */
+int __cheri_compartment("TLS")
+  tls_server_destroy(SObj allocator, SObj server);
+
+/**
+ * Performs the server side of a TLS handshake on `socket`, which must be a
+ * connected TCP socket returned by `network_socket_accept_tcp` and allocated
+ * with `allocator`.  Returns an untagged value on failure or a sealed TLS
+ * connection object on success.
+ *
+ * The returned object is used with the same send, receive and close functions
+ * as a client connection.  The connection takes ownership of `socket`: it is
+ * closed when the connection is closed or if this call fails.
+ *
+ * Each connection allocates a `br_ssl_server_context`, a 4421-byte input
+ * buffer (enough for the ClientHello of common browsers, and for requests
+ * that clients send as records of up to 4 KiB), an output buffer of
+ * `tls-output-buffer-size` bytes and the connection state.  With the default
+ * settings this is about 10 KiB, so six connections (the TCP/IP stack's limit)
+ * need about 60 KiB of quota.
+ */
+SObj __cheri_compartment("TLS")
+  tls_server_connection_create(Timeout *t,
+                               SObj     allocator,
+                               SObj     server,
+                               SObj     socket);
+
 /**
  * Flags that can control the behaviour of `tls_connection_send`.
  */
@@ -68,6 +271,13 @@ enum TLSSendFlags
  * and not send until a later send call.  If this is not provided then the
  * timeout may be exceeded. In the general case, this will block until the data
  * is sent, an error happens, or the timeout expires.
+ *
+ * Records are sized dynamically.  After the connection has been idle for a
+ * second, records carry at most 1369 bytes so that each fits in one TCP
+ * segment.  After 64 KiB have been sent without a pause, records grow to the
+ * size of the output buffer, which is set with the `tls-output-buffer-size`
+ * build option.  A record that reaches the current size limit is sent even if
+ * `TLSSendNoFlush` is set.
  */
 ssize_t __cheri_compartment("TLS") tls_connection_send(Timeout *t,
                                                        SObj   sealedConnection,
@@ -75,6 +285,227 @@ ssize_t __cheri_compartment("TLS") tls_connection_send(Timeout *t,
                                                        size_t length,
                                                        int    flags);
 
+/**
+ * A buffer for `tls_connection_sendv`.
+ */
+struct TLSSendVector
+{
+	/// The data to send.
+	void *buffer;
+	/// The number of bytes to send from `buffer`.
+	size_t length;
+};
+
+/**
+ * The maximum number of buffers that can be passed to `tls_connection_sendv`.
+ */
+enum
+{
+	TLSSendVectorMax = 8
+};
+
+/**
+ * Sends the contents of the `count` buffers described by `vectors`, in order,
+ * as if they were one buffer.  Returns the total number of bytes sent, or a
+ * negative error code.  This behaves like `tls_connection_send` but, unless
+ * `flags` contains `TLSSendNoFlush`, the engine is flushed only once, after
+ * the last buffer.  Small buffers (for example, a protocol header and its
+ * payload) therefore go out in a single TLS record and usually a single TCP
+ * segment.
+ *
+ * At most `TLSSendVectorMax` buffers can be sent in one call.  In addition to
+ * the errors from `tls_connection_send`, this fails with `-EINVAL` if `count`
+ * is too large or `vectors` cannot be read.
+ */
+ssize_t __cheri_compartment("TLS")
+  tls_connection_sendv(Timeout                    *t,
+                       SObj                        sealedConnection,
+                       const struct TLSSendVector *vectors,
+                       size_t                      count,
+                       int                         flags);
+
+/**
+ * Enable or disable auto-cork on a TLS connection.  Returns 0 on success or a
+ * negative error code.
+ *
+ * By default, each `tls_connection_send` call without `TLSSendNoFlush` forces
+ * the TLS engine to emit a record, and so a chatty writer produces one small
+ * record (and usually one TCP segment) per write.  With auto-cork enabled,
+ * sends without `TLSSendNoFlush` instead leave the data in the engine, so
+ * that writes made within `windowMilliseconds` of the oldest data that are
+ * held back are coalesced into the same record.  A record is emitted as soon
+ * as it is full.
+ *
+ * The window is not a deadline: there is no timer in the TLS compartment, so
+ * nothing flushes corked data when the window closes.  Corked data are sent
+ * by the first send after the window has closed, by any receive or
+ * `tls_connection_poll` before it waits for data from the network, and by
+ * `tls_connection_flush`.  Until one of these calls is made, they stay in the
+ * engine.  A writer that may go idle after a send must therefore either call
+ * `tls_connection_flush` when it has nothing more to send or ensure that
+ * another thread receives on the connection.
+ *
+ * Passing a window of zero disables auto-cork and flushes any data that are
+ * being held back.
+ */
+int __cheri_compartment("TLS")
+  tls_connection_autocork_set(Timeout *t,
+                              SObj     sealedConnection,
+                              uint32_t windowMilliseconds);
+
+/**
+ * Flush any data that the TLS engine is holding back (because of auto-cork or
+ * `TLSSendNoFlush`) and send the resulting records.  Returns 0 on success or a
+ * negative error code:
+ *
+ *  - `-EINVAL`: The connection is not valid.
+ *  - `-ETIMEDOUT`: The timeout expired before all records were sent.
+ *  - `-ENOTCONN`: The connection has been closed or the link has died.
+ */
+int __cheri_compartment("TLS")
+  tls_connection_flush(Timeout *t, SObj sealedConnection);
+
+/**
+ * Park an idle TLS connection to reduce its memory use.  This frees the
+ * connection's I/O buffers and its X.509 validation state, leaving only the
+ * BearSSL engine (which holds the keys, sequence numbers and cipher state) and
+ * the connection object.  Any data held back by auto-cork or `TLSSendNoFlush`
+ * are sent first.  Parking a connection that is already parked does nothing.
+ *
+ * A parked connection is unparked automatically, by reallocating its buffers
+ * from the connection's allocator, the next time that it is used to send,
+ * receive or flush.  Unparking can therefore fail with `-ENOMEM` if the quota
+ * is exhausted.  A thread that blocks in a receive call holds the buffers
+ * while it waits, so parking saves memory only for connections that nothing
+ * is reading from.
+ *
+ * Parked connections refuse renegotiation, because the certificate validation
+ * state is no longer available.  For the same reason, a connection that has
+ * been parked cannot be reconnected with `tls_connection_reconnect`, even
+ * after it has been unparked.
+ *
+ * Returns 0 on success or a negative error code:
+ *
+ *  - `-EINVAL`: The connection is not valid.
+ *  - `-ENOTCONN`: The handshake has not completed or the connection has been
+ *    closed.
+ *  - `-EBUSY`: There are received data that have not been read, or part of a
+ *    record has been received.  Read the pending data and try again.
+ *  - `-ETIMEDOUT`: The timeout expired before the lock could be acquired or
+ *    before buffered data could be sent.
+ */
+int __cheri_compartment("TLS")
+  tls_connection_park(Timeout *t, SObj sealedConnection);
+
+/**
+ * Profiling counters for a TLS connection.  Times are measured in CPU cycles
+ * with `rdcycle`.
+ *
+ * The handshake phase timers are valid once the handshake has completed.
+ * BearSSL performs the handshake cryptography while processing the records
+ * that it receives, so the CPU time spent in the TLS engine is reported
+ * separately from the time spent waiting for each flight.
+ */
+struct TLSStatistics
+{
+	/// Time taken to establish the TCP connection.
+	uint64_t tcpConnectCycles;
+	/**
+	 * Time from starting the handshake until the server's first flight
+	 * (ServerHello to ServerHelloDone) had been received, excluding the CPU
+	 * time spent processing it.  This is dominated by network round trips.
+	 */
+	uint64_t serverFlightCycles;
+	/**
+	 * CPU time spent in the TLS engine during the handshake, excluding
+	 * certificate validation.  This is dominated by the ECDHE computation
+	 * and the verification of the server's key exchange signature.
+	 */
+	uint64_t keyExchangeCycles;
+	/// CPU time spent validating the server's certificate chain.
+	uint64_t x509Cycles;
+	/**
+	 * Time from the end of the server's first flight until the server's
+	 * Finished message had been received, excluding the CPU time spent in the
+	 * TLS engine.
+	 */
+	uint64_t finishedCycles;
+	/// Total time for the handshake, excluding the TCP connection.
+	uint64_t handshakeCycles;
+	/// The number of TLS records received.
+	uint32_t recordsIn;
+	/// The number of TLS records sent.
+	uint32_t recordsOut;
+	/// The number of bytes of application data received.
+	uint64_t applicationBytesIn;
+	/// The number of bytes of application data sent.
+	uint64_t applicationBytesOut;
+	/// The number of bytes received from the TCP connection.
+	uint64_t wireBytesIn;
+	/// The number of bytes sent on the TCP connection.
+	uint64_t wireBytesOut;
+	/// The number of times that the TLS engine was asked to flush.
+	uint32_t flushes;
+	/**
+	 * The number of times that the network stack accepted only part of the
+	 * records that were ready to send.
+	 */
+	uint32_t partialSends;
+	/// The number of times that `tls_connection_reconnect` has been called.
+	uint32_t reconnects;
+	/**
+	 * The number of reconnections for which the server resumed the previous
+	 * session, skipping the key exchange and certificate validation.
+	 */
+	uint32_t sessionsResumed;
+};
+
+/**
+ * Re-establish a client TLS connection whose link has died, reusing the
+ * connection object and its buffers.  This closes the old TCP connection
+ * without sending a close_notify alert, connects to the host again with the
+ * capability passed when the connection was created, and performs a new
+ * handshake.  The handshake offers the previous session for resumption, so if
+ * the server still has it then it completes in one round trip without a key
+ * exchange or certificate validation.  Otherwise, the server's certificate is
+ * validated against the trust anchors passed when the connection was created,
+ * which must therefore still be valid.
+ *
+ * Any data that had not been sent on the old connection are discarded.
+ *
+ * Returns 0 on success or a negative error code:
+ *
+ *  - `-EINVAL`: The connection is not valid or is a server connection.
+ *  - `-ENOTSUP`: The connection has been parked (even if it has since been
+ *    unparked) and so can no longer validate certificates.
+ *  - `-ENOTCONN`: The TCP connection could not be established.
+ *  - `-EINPROGRESS`: The timeout expired during the handshake.  Call
+ *    `tls_connection_progress` to continue it.
+ *  - `-ECONNABORTED`: The handshake failed.
+ *  - `-ETIMEDOUT`: The timeout expired before the lock could be acquired.
+ *
+ * On failures other than `-EINVAL`, `-ENOTSUP` and `-ETIMEDOUT`, the
+ * connection can be used only for another reconnection attempt or closed.
+ */
+int __cheri_compartment("TLS")
+  tls_connection_reconnect(Timeout *t, SObj sealedConnection);
+
+/**
+ * Copy the profiling counters for a TLS connection into `statistics`.  This
+ * may be called while the handshake is in progress.  Returns 0 on success or a
+ * negative error code:
+ *
+ *  - `-EINVAL`: The connection is not valid.
+ *  - `-EPERM`: The `statistics` pointer does not permit storing a
+ *    `TLSStatistics` structure.
+ *  - `-ETIMEDOUT`: The timeout expired before the connection's lock could be
+ *    acquired.
+ */
+int __cheri_compartment("TLS")
+  tls_connection_statistics(Timeout              *t,
+                            SObj                  sealedConnection,
+                            struct TLSStatistics *statistics);
+
 /**
  * Receive data from the TLS connection.  This will block until data are
  * received, an error happens, or the timeout expires. If data are received,
@@ -111,6 +542,27 @@ int __cheri_compartment("TLS")
                                       SObj     sealedConnection,
                                       void    *buffer,
                                       size_t   length);
+
+/**
+ * Wait until application data can be read from the TLS connection, without
+ * reading them.  This blocks, processing records as they arrive from the
+ * network, until the TLS engine has data for a receive call, an error
+ * happens, or the timeout expires.  As with the receive functions, data held
+ * back by auto-cork are flushed before waiting.
+ *
+ * This lets callers that use their own framing (for example, a protocol
+ * library that asks for one byte at a time to check for a new message) sleep
+ * until there is work to do instead of polling with short timeouts.
+ *
+ * The return value is zero if data are ready, or a negative error code:
+ *
+ *  - `-EINVAL`: The connection is not valid.
+ *  - `-ETIMEDOUT`: The timeout was reached before data arrived.
+ *  - `-ENOTCONN`: The connection has been closed or the link has died.
+ */
+int __cheri_compartment("TLS")
+  tls_connection_poll(Timeout *t, SObj sealedConnection);
+
 /**
  * Close a TLS connection.
  */
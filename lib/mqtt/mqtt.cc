@@ -1,14 +1,19 @@
 // Copyright SCI Semiconductor and CHERIoT Contributors.
 // SPDX-License-Identifier: MIT
 
+#include "topic-trie.hh"
 #include <NetAPI.h>
 #include <cheri.hh>
 #include <core_mqtt.h>
+#include <core_mqtt_state.h>
 #include <debug.hh>
+#include <limits>
 #include <locks.hh>
 #include <mqtt.h>
 #include <platform-entropy.hh>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 #include <string_view>
 #include <transport_interface.h>
 
@@ -24,16 +29,93 @@ constexpr bool DebugMQTT =
 
 using Debug = ConditionalDebug<DebugMQTT, "MQTT Client">;
 
+/**
+ * A copy of a publish.  This is either a QoS 1 or 2 publish that the broker
+ * has not yet acknowledged, kept so that it can be sent again after a
+ * reconnection, or a publish in the offline queue, waiting for the link to
+ * come back.
+ */
+struct StoredPublish
+{
+	/// The next stored publish.
+	StoredPublish *next;
+	/// The packet ID with which the publish was sent, if it has been.
+	uint16_t packetId;
+	/// The QoS of the publish.
+	uint8_t qos;
+	/// True if the publish is retained.
+	bool retain;
+	/// The length of the topic.
+	uint16_t topicLength;
+	/// The length of the payload, which follows the topic.
+	size_t payloadLength;
+	/// The first character of the topic, the rest and the payload follow.
+	char topic;
+};
+
+/**
+ * A SUBSCRIBE sent by `mqtt_subscribe_multiple` whose SUBACK has not yet
+ * been received.
+ */
+struct PendingSuback
+{
+	/// The next pending SUBACK.
+	PendingSuback *next;
+	/// The callback for the SUBACK's return codes.
+	MQTTSubackCallback callback;
+	/// The packet ID of the SUBSCRIBE.
+	uint16_t packetId;
+};
+
 struct NetworkContext
 {
 	SObj tlsHandle;
 
+	/**
+	 * The allocator passed to `mqtt_connect`, used to free the stored
+	 * publishes in `unacknowledged`.
+	 */
+	SObj allocator;
+
+	/**
+	 * Copies of the QoS > 0 publishes that are waiting for a PUBACK or
+	 * PUBREC, kept only while reconnection is enabled.
+	 */
+	StoredPublish *unacknowledged;
+
+	/**
+	 * The SUBSCRIBE packets sent by `mqtt_subscribe_multiple` that are
+	 * waiting for a SUBACK.
+	 */
+	PendingSuback *pendingSubacks;
+
 	/**
 	 * Pointer to the caller-supplied PUBLISH callback. This callback will
-	 * be called on all PUBLISH notifications from the broker.
+	 * be called on PUBLISH notifications from the broker that do not match
+	 * any filter in `subscriptions`.
 	 */
 	MQTTPublishCallback publishCallback;
 
+	/**
+	 * Callbacks and ring topic IDs registered with
+	 * `mqtt_subscribe_with_callback` and `mqtt_subscribe_to_ring`, indexed
+	 * by filter.
+	 */
+	TopicTrie subscriptions;
+
+	/**
+	 * The ring attached with `mqtt_ring_attach`, if any.  The size of its
+	 * data is kept here, as the consumer can write to the ring.
+	 */
+	MQTTRing *ring;
+	uint32_t  ringSize;
+
+	/**
+	 * True if we hold a claim on `ring`, false if it is not a heap
+	 * allocation.
+	 */
+	bool ringClaimed;
+
 	/**
 	 * Pointer to the caller-supplied ACK callback. This callback will be
 	 * called on all ACKs from the broker (SUBACK, PUBACK, etc.).  Note
@@ -46,6 +128,13 @@ struct NetworkContext
 	 * Flag set when the connection is terminated.
 	 */
 	bool isDisconnected;
+
+	/**
+	 * Flag set while a batch of packets is being sent.  Sends then do not
+	 * flush the TLS engine, so that the packets share records, and the
+	 * batch is flushed once at the end.
+	 */
+	bool holdRecords;
 };
 
 namespace
@@ -58,6 +147,52 @@ namespace
 		// The underlying TLS stream.
 		SObj tlsHandle;
 
+		/**
+		 * The allocator passed to `mqtt_connect`, used for allocations
+		 * made after the connection is established.
+		 */
+		SObj allocator;
+
+		/**
+		 * The client ID passed to `mqtt_connect`, copied into the
+		 * variable length data so that reconnections can resume the
+		 * session.
+		 */
+		const char *clientID;
+		size_t      clientIDLength;
+
+		/**
+		 * The bounds on the delay between reconnection attempts, in
+		 * milliseconds.  Reconnection is disabled if the maximum is zero.
+		 */
+		uint32_t reconnectMinimumMilliseconds;
+		uint32_t reconnectMaximumMilliseconds;
+
+		/// The delay before the next reconnection attempt after this one.
+		uint32_t reconnectBackoffMilliseconds;
+
+		/**
+		 * The cycle count before which we must not attempt to reconnect.
+		 * This is kept in cycles rather than in the 32-bit milliseconds
+		 * from `get_current_time`, which wrap too soon to be compared with
+		 * a deadline that may be weeks old.
+		 */
+		uint64_t reconnectNotBefore;
+
+		/**
+		 * The publishes accepted while the link was down, oldest first,
+		 * and the last of them.
+		 */
+		StoredPublish *offlineQueue;
+		StoredPublish *offlineQueueTail;
+
+		/**
+		 * The number of publishes in `offlineQueue` and the maximum.  The
+		 * queue is disabled if the maximum is zero.
+		 */
+		uint32_t offlineQueueDepth;
+		uint32_t offlineQueueCapacity;
+
 		/**
 		 * MQTT internal buffers. We must keep a link to them here for
 		 * freeing.
@@ -82,7 +217,7 @@ namespace
 		 * track of all allocated objects to free them later on.
 		 */
 		CHERIoTMqttContext(SObj tlsHandle, SObj allocator)
-		  : tlsHandle{tlsHandle}
+		  : tlsHandle{tlsHandle}, allocator{allocator}
 		{
 		}
 
@@ -94,6 +229,78 @@ namespace
 		{
 			Timeout t{UnlimitedTimeout};
 			tls_connection_close(&t, tlsHandle);
+			networkContext.subscriptions.clear(allocator);
+			ring_detach();
+			unacknowledged_clear();
+			offline_queue_clear();
+			pending_subacks_clear();
+		}
+
+		/**
+		 * Free the publishes in the list that starts with `stored`.
+		 */
+		void stored_free(StoredPublish *stored)
+		{
+			while (stored != nullptr)
+			{
+				StoredPublish *next = stored->next;
+				heap_free(allocator, stored);
+				stored = next;
+			}
+		}
+
+		/**
+		 * Free the copies of unacknowledged publishes.
+		 */
+		void unacknowledged_clear()
+		{
+			stored_free(networkContext.unacknowledged);
+			networkContext.unacknowledged = nullptr;
+		}
+
+		/**
+		 * Forget the SUBSCRIBE packets that are waiting for a SUBACK.
+		 */
+		void pending_subacks_clear()
+		{
+			PendingSuback *pending = networkContext.pendingSubacks;
+			while (pending != nullptr)
+			{
+				PendingSuback *next = pending->next;
+				heap_free(allocator, pending);
+				pending = next;
+			}
+			networkContext.pendingSubacks = nullptr;
+		}
+
+		/**
+		 * Discard the publishes in the offline queue.
+		 */
+		void offline_queue_clear()
+		{
+			stored_free(offlineQueue);
+			offlineQueue      = nullptr;
+			offlineQueueTail  = nullptr;
+			offlineQueueDepth = 0;
+		}
+
+		/// Returns true if reconnection is enabled.
+		bool reconnect_enabled() const
+		{
+			return reconnectMaximumMilliseconds != 0;
+		}
+
+		/**
+		 * Release the claim on the attached ring, if any, and detach it.
+		 */
+		void ring_detach()
+		{
+			if (networkContext.ringClaimed)
+			{
+				heap_free(allocator, networkContext.ring);
+			}
+			networkContext.ring        = nullptr;
+			networkContext.ringClaimed = false;
 		}
 
 		/**
@@ -101,6 +308,7 @@ namespace
 		 * - incoming publishes (array of MQTTPubAckInfo_t)
 		 * - outgoing publishes (array of MQTTPubAckInfo_t)
 		 * - the network buffer (array of uint8_t)
+		 * - the client ID (array of char)
 		 */
 		alignas(MQTTPubAckInfo_t) uint8_t variableLengthData;
 	};
@@ -162,10 +370,14 @@ namespace
 				if (status == MQTTSendFailed)
 				{
 					// If the TLS link is still live, try
-					// again until we are out of time.
+					// again until we are out of time.  If
+					// it is dead and reconnection is
+					// enabled, `mqtt_run` will restore it.
 					if (connection->networkContext.isDisconnected)
 					{
-						return -ECONNABORTED;
+						return connection->reconnect_enabled()
+						         ? -ENOTCONN
+						         : -ECONNABORTED;
 					}
 				}
 				else if (status == MQTTBadParameter)
@@ -246,6 +458,16 @@ namespace
 	  "0123456789abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ";
 	constexpr const int MQTTMaximumClientIDSize = 23;
 
+	/// The smallest data area accepted by `mqtt_ring_attach`.
+	constexpr uint32_t MinimumRingSize = 64;
+
+	/**
+	 * The longest that `mqtt_run_many` sleeps between checks of its
+	 * connections, once they have been idle for a while.
+	 */
+	constexpr Ticks RunManyMaximumPollTicks =
+	  MS_TO_TICKS(50) > 0 ? MS_TO_TICKS(50) : 1;
+
 	/**
 	 * Helper to check if a client ID is valid according to the MQTT
 	 * specification.
@@ -363,7 +585,7 @@ namespace
 	                       size_t            bytesToSend)
 	{
 		SObj sealed = networkContext->tlsHandle;
-		int  flags  = 0;
+		int  flags  = networkContext->holdRecords ? TLSSendNoFlush : 0;
 
 		// TODO Determine a good value for this timeout.
 		Timeout t{MS_TO_TICKS(1000)};
@@ -400,6 +622,80 @@ namespace
 		return sent;
 	}
 
+	/**
+	 * Callback provided to coreMQTT.
+	 *
+	 * Provides vectored sends.  coreMQTT uses this to write a packet's
+	 * header and payload with a single call, which we pass to the TLS
+	 * compartment so that they are sent in one record rather than one
+	 * record per buffer.
+	 *
+	 * Returns the number of bytes sent or a negative value to indicate
+	 * error, with the same conventions as `transport_send`.
+	 */
+	int32_t transport_writev(NetworkContext_t     *networkContext,
+	                         TransportOutVector_t *ioVec,
+	                         size_t                ioVecCount)
+	{
+		SObj    sealed    = networkContext->tlsHandle;
+		int     flags     = networkContext->holdRecords ? TLSSendNoFlush : 0;
+		int32_t totalSent = 0;
+
+		// TODO Determine a good value for this timeout.
+		Timeout t{MS_TO_TICKS(1000)};
+
+		// coreMQTT never passes more than a handful of vectors, but split
+		// the call if it exceeds what the TLS compartment accepts.
+		while (ioVecCount > 0)
+		{
+			TLSSendVector vectors[TLSSendVectorMax];
+			size_t        count       = ioVecCount;
+			size_t        bytesToSend = 0;
+			if (count > TLSSendVectorMax)
+			{
+				count = TLSSendVectorMax;
+			}
+			for (size_t i = 0; i < count; i++)
+			{
+				vectors[i].buffer = const_cast<void *>(ioVec[i].iov_base);
+				vectors[i].length = ioVec[i].iov_len;
+				bytesToSend += ioVec[i].iov_len;
+			}
+
+			int32_t sent =
+			  tls_connection_sendv(&t, sealed, vectors, count, flags);
+
+			if (sent == -ETIMEDOUT)
+			{
+				// In the case of timeout, this send operation can be
+				// retried.
+				sent = 0;
+			}
+			else if (sent == -ENOTCONN)
+			{
+				// The TCP/TLS link is dead
+				networkContext->isDisconnected = true;
+			}
+
+			if (sent < 0)
+			{
+				// Report the error unless some data were already sent,
+				// in which case the caller will see it on the next call.
+				return totalSent > 0 ? totalSent : sent;
+			}
+			totalSent += sent;
+			if (size_t(sent) != bytesToSend)
+			{
+				Debug::log("Partial send: {} < {}", sent, bytesToSend);
+				break;
+			}
+			ioVec += count;
+			ioVecCount -= count;
+		}
+
+		return totalSent;
+	}
+
 	/**
 	 * Callback provided to coreMQTT.
 	 *
@@ -432,6 +728,120 @@ namespace
 		return currentTime & 0xFFFFFFFF;
 	}
 
+	/**
+	 * Copy a publish with `payloadLength` bytes of `payload` into the ring
+	 * attached to `networkContext`, as a record with the topic ID
+	 * `topicId`, and wake the consumer.  The publish is dropped if there is
+	 * no ring or it is full.
+	 */
+	void ring_write(NetworkContext_t *networkContext,
+	                uint16_t          topicId,
+	                const void       *payload,
+	                size_t            payloadLength)
+	{
+		MQTTRing *ring = networkContext->ring;
+		if (ring == nullptr)
+		{
+			Debug::log("No ring attached, dropping publish for topic {}",
+			           topicId);
+			return;
+		}
+		uint32_t size     = networkContext->ringSize;
+		uint32_t producer = __c11_atomic_load(&ring->producer, __ATOMIC_RELAXED);
+		uint32_t consumer = __c11_atomic_load(&ring->consumer, __ATOMIC_ACQUIRE);
+		uint32_t offset   = producer & (size - 1);
+		size_t   recordLength =
+		  (sizeof(MQTTRingRecord) + payloadLength + 7) & ~size_t(7);
+		// Records do not wrap, so pad to the end of the ring if this one
+		// would.  Offsets are multiples of 8, so a padding record always
+		// has space for its header.
+		uint32_t padding = (offset + recordLength > size) ? size - offset : 0;
+		if ((recordLength > size) ||
+		    (recordLength + padding > size - (producer - consumer)))
+		{
+			Debug::log("Ring full, dropping publish for topic {}", topicId);
+			__c11_atomic_fetch_add(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		if (padding != 0)
+		{
+			auto *record =
+			  reinterpret_cast<MQTTRingRecord *>(&ring->data[offset]);
+			record->topicId       = MQTTRingPadding;
+			record->reserved      = 0;
+			record->payloadLength = padding - sizeof(MQTTRingRecord);
+			producer += padding;
+			offset = 0;
+		}
+		auto *record = reinterpret_cast<MQTTRingRecord *>(&ring->data[offset]);
+		record->topicId       = topicId;
+		record->reserved      = 0;
+		record->payloadLength = payloadLength;
+		memcpy(record->payload, payload, payloadLength);
+		__c11_atomic_store(
+		  &ring->producer, producer + recordLength, __ATOMIC_RELEASE);
+		futex_wake(reinterpret_cast<uint32_t *>(&ring->producer),
+		           std::numeric_limits<uint32_t>::max());
+	}
+
+	/**
+	 * Free the stored copy of the publish with packet ID `packetId`, if
+	 * any, once the broker has acknowledged it.  After a PUBREC, a QoS 2
+	 * publish is never sent again: coreMQTT resends the PUBREL instead.
+	 */
+	void unacknowledged_release(NetworkContext_t *networkContext,
+	                            uint16_t          packetId)
+	{
+		for (StoredPublish **link = &networkContext->unacknowledged;
+		     *link != nullptr;
+		     link = &(*link)->next)
+		{
+			StoredPublish *stored = *link;
+			if (stored->packetId == packetId)
+			{
+				*link = stored->next;
+				heap_free(networkContext->allocator, stored);
+				return;
+			}
+		}
+	}
+
+	/**
+	 * Invoke the callback registered by `mqtt_subscribe_multiple` for the
+	 * SUBACK in `packetInfo`, if any, with the SUBACK's return codes.
+	 */
+	void suback_dispatch(NetworkContext_t *networkContext,
+	                     MQTTPacketInfo_t *packetInfo,
+	                     uint16_t          packetId)
+	{
+		for (PendingSuback **link = &networkContext->pendingSubacks;
+		     *link != nullptr;
+		     link = &(*link)->next)
+		{
+			PendingSuback *pending = *link;
+			if (pending->packetId != packetId)
+			{
+				continue;
+			}
+			*link = pending->next;
+
+			uint8_t *codes;
+			size_t   codesLength;
+			if (MQTT_GetSubAckStatusCodes(packetInfo, &codes, &codesLength) ==
+			    MQTTSuccess)
+			{
+				// As with publishes, the codes are only valid within the
+				// callback.
+				Capability readOnlyCodes{codes};
+				readOnlyCodes.permissions() &= CHERI::Permission::Load;
+				readOnlyCodes.bounds() = codesLength;
+				pending->callback(packetId, readOnlyCodes, codesLength);
+			}
+			heap_free(networkContext->allocator, pending);
+			return;
+		}
+	}
+
 	/**
 	 * Callback provided to coreMQTT.
 	 *
@@ -460,7 +870,7 @@ namespace
 
 		Debug::log("User callback triggered for packet type {}.", packetType);
 
-		if (packetType == MQTT_PACKET_TYPE_PUBLISH && publishCallback)
+		if (packetType == MQTT_PACKET_TYPE_PUBLISH)
 		{
 			// This should never fail - if the packet is of type
 			// PUBLISH, the topic and payload should always be set.
@@ -479,13 +889,55 @@ namespace
 			payload.permissions() &= CHERI::Permission::Load;
 			payload.bounds() = publishInfo->payloadLength;
 
-			publishCallback(topic,
-			                publishInfo->topicNameLength,
-			                payload,
-			                publishInfo->payloadLength);
+			// Dispatch to the callbacks of all matching
+			// subscriptions, falling back to the connection's
+			// callback.
+			size_t matches = networkContext->subscriptions.match(
+			  networkContext->allocator,
+			  {publishInfo->pTopicName, publishInfo->topicNameLength},
+			  [&](const TopicSubscription &subscription) {
+				  if (subscription.callback != nullptr)
+				  {
+					  subscription.callback(topic,
+					                        publishInfo->topicNameLength,
+					                        payload,
+					                        publishInfo->payloadLength);
+				  }
+				  else
+				  {
+					  ring_write(networkContext,
+					             subscription.topicId,
+					             publishInfo->pPayload,
+					             publishInfo->payloadLength);
+				  }
+			  });
+			if ((matches == 0) && publishCallback)
+			{
+				publishCallback(topic,
+				                publishInfo->topicNameLength,
+				                payload,
+				                publishInfo->payloadLength);
+			}
 		}
-		else if (ackCallback)
+		else
 		{
+			if ((packetType == MQTT_PACKET_TYPE_PUBACK) ||
+			    (packetType == MQTT_PACKET_TYPE_PUBREC))
+			{
+				unacknowledged_release(networkContext,
+				                       deserializedInfo->packetIdentifier);
+			}
+			else if (packetType == MQTT_PACKET_TYPE_SUBACK)
+			{
+				suback_dispatch(networkContext,
+				                packetInfo,
+				                deserializedInfo->packetIdentifier);
+			}
+			if (!ackCallback)
+			{
+				return;
+			}
+
 			bool isReject = false;
 			if (deserializedInfo->deserializationResult != MQTTSuccess)
 			{
@@ -502,77 +954,1050 @@ namespace
 			ackCallback(deserializedInfo->packetIdentifier, isReject);
 		}
 	}
-} // namespace
+	/**
+	 * Check the arguments of a publish.  Returns true if they are valid.
+	 */
+	bool check_publish(uint8_t     qos,
+	                   const char *topic,
+	                   size_t      topicLength,
+	                   const void *payload,
+	                   size_t      payloadLength)
+	{
+		if (!CHERI::check_pointer(topic, topicLength))
+		{
+			return false;
+		}
 
-// Public CHERIoT MQTT API
+		if (!CHERI::check_pointer(payload, payloadLength))
+		{
+			return false;
+		}
 
-SObj mqtt_connect(Timeout                    *t,
-                  SObj                        allocator,
-                  SObj                        hostCapability,
-                  MQTTPublishCallback         publishCallback,
-                  MQTTAckCallback             ackCallback,
-                  const br_x509_trust_anchor *trustAnchors,
-                  size_t                      trustAnchorsCount,
-                  size_t                      networkBufferSize,
-                  size_t                      incomingPublishCount,
-                  size_t                      outgoingPublishCount,
-                  const char                 *clientID,
-                  size_t                      clientIDLength,
-                  bool                        newSession)
-{
-	// Note: do not check trustAnchors because we don't use technically use
-	// it. We only pass it on to the TLS compartment which we assume will
-	// check the pointer.
-	//
-	// Similarly, no need to check the two callbacks, because the trusted
-	// switcher will do that for us. The only thing callers will achieve by
-	// passing invalid callbacks is not getting ACKs or PUBLISHEs.
+		if (qos > MQTTQoS2)
+		{
+			return false;
+		}
 
-	if (!check_timeout_pointer(t))
-	{
-		return nullptr;
-	}
+		// MQTT encodes the topic length in two bytes.
+		if (topicLength > std::numeric_limits<uint16_t>::max())
+		{
+			return false;
+		}
 
-	if (!CHERI::check_pointer(clientID, clientIDLength))
-	{
-		return nullptr;
+		/**
+		 * Validate the topic (done similarly with the filter in
+		 * `mqtt_subscribe` and `mqtt_unsubscribe`). Without these checks,
+		 * we would send an invalid PUBLISH to the broker, causing our
+		 * connection to be terminated. Since these are only there for
+		 * convenience / not security-relevant, only enable in debug mode.
+		 */
+
+		if constexpr (DebugMQTT)
+		{
+			// Note from the MQTT 3.1.1 spec: 'All Topic Names and Topic
+			// Filters MUST be at least one character long'
+			if (topicLength < 1)
+			{
+				return false;
+			}
+
+			// Note from the MQTT 3.1.1 spec: 'Topic Names and Topic
+			// Filters MUST NOT include the null character'
+			if (has_null_character(topic, topicLength))
+			{
+				return false;
+			}
+		}
+
+		return true;
 	}
 
-	if constexpr (DebugMQTT)
+	/**
+	 * Copy a publish, whose arguments must have been checked with
+	 * `check_publish`, into a new `StoredPublish` allocated with
+	 * `allocator`.  Returns null if allocation failed.
+	 */
+	StoredPublish *stored_publish_create(Timeout    *t,
+	                                     SObj        allocator,
+	                                     uint8_t     qos,
+	                                     const char *topic,
+	                                     size_t      topicLength,
+	                                     const void *payload,
+	                                     size_t      payloadLength,
+	                                     bool        retain)
 	{
-		if (!is_valid_client_id({clientID, clientIDLength}))
+		auto *stored = static_cast<StoredPublish *>(heap_allocate(
+		  t,
+		  allocator,
+		  offsetof(StoredPublish, topic) + topicLength + payloadLength));
+		if (stored == nullptr)
 		{
-			Debug::log("Passed invalid client ID.");
 			return nullptr;
 		}
+		stored->qos           = qos;
+		stored->retain        = retain;
+		stored->topicLength   = topicLength;
+		stored->payloadLength = payloadLength;
+		memcpy(&stored->topic, topic, topicLength);
+		memcpy(&stored->topic + topicLength, payload, payloadLength);
+		return stored;
 	}
 
-	// Allocate MQTT internal buffers as part of the sealed allocation.
-	// Note: no explicit zero-ing needed here (unlike suggested by
-	// coreMQTT), we can assume that the allocator zeroes out for us.
-	size_t handleSize =
-	  sizeof(CHERIoTMqttContext) -
-	  sizeof(CHERIoTMqttContext::variableLengthData) + networkBufferSize +
-	  sizeof(MQTTPubAckInfo_t) * (incomingPublishCount + outgoingPublishCount);
-
-	// Create a sealed MQTT handle.
-	void *unsealedMQTTHandle;
-	SObj  sealedMQTTHandle = token_sealed_unsealed_alloc(
-	   t, allocator, mqtt_key(), handleSize, &unsealedMQTTHandle);
-	if (sealedMQTTHandle == nullptr)
+	/**
+	 * Send a publish on `connection`, whose lock must be held, bypassing
+	 * the offline queue.  The arguments must have been checked with
+	 * `check_publish`.  Returns the packet ID or a negative error code, as
+	 * documented for `mqtt_publish`.
+	 */
+	int publish_now(Timeout            *t,
+	                CHERIoTMqttContext *connection,
+	                uint8_t             qos,
+	                const char         *topic,
+	                size_t              topicLength,
+	                const void         *payload,
+	                size_t              payloadLength,
+	                bool                retain)
 	{
-		Debug::log("Failed to allocate CHERIoT MQTT context.");
-		return nullptr;
-	}
-
-	Debug::log("Created CHERIoT MQTT context sealed with {}.", mqtt_key());
+		MQTTContext_t    *coreMQTTContext = &connection->coreMQTTContext;
+		MQTTPublishInfo_t publishInfo;
+
+		publishInfo.qos             = static_cast<MQTTQoS>(qos);
+		publishInfo.pTopicName      = topic;
+		publishInfo.topicNameLength = topicLength;
+		publishInfo.pPayload        = payload;
+		publishInfo.payloadLength   = payloadLength;
+		publishInfo.retain          = retain;
+
+		// Packet ID is needed for QoS > 0.
+		int packetId = MQTT_GetPacketId(coreMQTTContext);
+
+		// If reconnection is enabled, keep a copy of QoS > 0 publishes
+		// until they are acknowledged, so that they can be sent again if
+		// the link dies first.  Make the copy before sending, so that we
+		// never send a publish that we could not replay.
+		StoredPublish *stored = nullptr;
+		if ((qos > MQTTQoS0) && connection->reconnect_enabled())
+		{
+			stored = stored_publish_create(t,
+			                               connection->allocator,
+			                               qos,
+			                               topic,
+			                               topicLength,
+			                               payload,
+			                               payloadLength,
+			                               retain);
+			if (stored == nullptr)
+			{
+				return -ENOMEM;
+			}
+			stored->packetId = packetId;
+		}
 
-	// Set up a TLS stream with the broker.
-	SObj tlsHandle = tls_connection_create(
-	  t, allocator, hostCapability, trustAnchors, trustAnchorsCount);
-	if (!Capability{tlsHandle}.is_valid())
-	{
-		Debug::log("Failed to open TLS stream.");
+		int ret = with_sendfailed_retry(t, "MQTT_Publish", connection, [&]() {
+			return MQTT_Publish(coreMQTTContext, &publishInfo, packetId);
+		});
+
+		if (stored != nullptr)
+		{
+			// coreMQTT records the publish as waiting for an ACK only if
+			// it was sent completely.
+			if (ret == 0)
+			{
+				stored->next = connection->networkContext.unacknowledged;
+				connection->networkContext.unacknowledged = stored;
+			}
+			else
+			{
+				heap_free(connection->allocator, stored);
+			}
+		}
+
+		if (ret == 0)
+		{
+			return packetId;
+		}
+
+		return ret;
+	}
+
+	/**
+	 * Publish a message on `connection`, whose lock must be held.  The
+	 * arguments must have been checked with `check_publish`.  If the offline
+	 * queue is enabled and the link is down, or earlier publishes are still
+	 * queued, the publish is added to the queue instead of being sent.
+	 * Returns the packet ID, zero if the publish was queued, or a negative
+	 * error code, as documented for `mqtt_publish`.
+	 */
+	int publish(Timeout            *t,
+	            CHERIoTMqttContext *connection,
+	            uint8_t             qos,
+	            const char         *topic,
+	            size_t              topicLength,
+	            const void         *payload,
+	            size_t              payloadLength,
+	            bool                retain)
+	{
+		// Without reconnection, the link never comes back to drain the
+		// queue.
+		bool queueing = (connection->offlineQueueCapacity != 0) &&
+		                connection->reconnect_enabled();
+		if (!queueing || (!connection->networkContext.isDisconnected &&
+		                  (connection->offlineQueue == nullptr)))
+		{
+			int ret = publish_now(t,
+			                      connection,
+			                      qos,
+			                      topic,
+			                      topicLength,
+			                      payload,
+			                      payloadLength,
+			                      retain);
+			// If the link died during the send, queue the publish to be
+			// sent again once the link is back.
+			if (!queueing || (ret != -ENOTCONN))
+			{
+				return ret;
+			}
+		}
+
+		if (connection->offlineQueueDepth >= connection->offlineQueueCapacity)
+		{
+			return -EAGAIN;
+		}
+		StoredPublish *stored = stored_publish_create(t,
+		                                              connection->allocator,
+		                                              qos,
+		                                              topic,
+		                                              topicLength,
+		                                              payload,
+		                                              payloadLength,
+		                                              retain);
+		if (stored == nullptr)
+		{
+			return -ENOMEM;
+		}
+		if (connection->offlineQueueTail == nullptr)
+		{
+			connection->offlineQueue = stored;
+		}
+		else
+		{
+			connection->offlineQueueTail->next = stored;
+		}
+		connection->offlineQueueTail = stored;
+		connection->offlineQueueDepth++;
+		Debug::log("Queued publish, {} publishes waiting",
+		           connection->offlineQueueDepth);
+		return 0;
+	}
+
+	/**
+	 * Check the arguments of a subscribe or unsubscribe.  Returns true if
+	 * they are valid.
+	 */
+	bool check_filter(uint8_t qos, const char *filter, size_t filterLength)
+	{
+		if (!CHERI::check_pointer(filter, filterLength))
+		{
+			return false;
+		}
+
+		if (qos > MQTTQoS2)
+		{
+			return false;
+		}
+
+		// MQTT encodes the filter length in two bytes.
+		if (filterLength > std::numeric_limits<uint16_t>::max())
+		{
+			return false;
+		}
+
+		if constexpr (DebugMQTT)
+		{
+			if (filterLength < 1)
+			{
+				return false;
+			}
+
+			if (has_null_character(filter, filterLength))
+			{
+				return false;
+			}
+		}
+
+		return true;
+	}
+
+	/**
+	 * Subscribe to `filter` on `connection`, whose lock must be held.  The
+	 * arguments must have been checked with `check_filter`.  Returns the
+	 * packet ID or a negative error code, as documented for
+	 * `mqtt_subscribe`.
+	 */
+	int subscribe(Timeout            *t,
+	              CHERIoTMqttContext *connection,
+	              uint8_t             qos,
+	              const char         *filter,
+	              size_t              filterLength)
+	{
+		MQTTContext_t *coreMQTTContext = &connection->coreMQTTContext;
+
+		MQTTSubscribeInfo_t subscription;
+		subscription.qos               = static_cast<MQTTQoS>(qos);
+		subscription.pTopicFilter      = filter;
+		subscription.topicFilterLength = filterLength;
+
+		// Obtain a new packet id for the subscription.
+		int packetId = MQTT_GetPacketId(coreMQTTContext);
+
+		int ret = with_sendfailed_retry(t, "MQTT_Subscribe", connection, [&]() {
+			return MQTT_Subscribe(coreMQTTContext, &subscription, 1, packetId);
+		});
+
+		if (ret == 0)
+		{
+			return packetId;
+		}
+
+		return ret;
+	}
+
+	/**
+	 * Register `subscription` for `filter` and subscribe to it on
+	 * `connection`, whose lock must be held.  The arguments must have been
+	 * checked with `check_filter`.  Returns the packet ID or a negative
+	 * error code, as documented for `mqtt_subscribe_with_callback`.
+	 */
+	int subscribe_registered(Timeout                 *t,
+	                         CHERIoTMqttContext      *connection,
+	                         uint8_t                  qos,
+	                         const char              *filter,
+	                         size_t                   filterLength,
+	                         const TopicSubscription &subscription)
+	{
+		TopicTrie &subscriptions = connection->networkContext.subscriptions;
+		std::string_view filterView{filter, filterLength};
+
+		// Remember any subscription that this replaces, so that it can be
+		// restored if the SUBSCRIBE cannot be sent.
+		const TopicSubscription *existing  = subscriptions.find(filterView);
+		bool                     replacing = (existing != nullptr);
+		TopicSubscription        previous  = {};
+		if (replacing)
+		{
+			previous = *existing;
+		}
+
+		// Register the subscription first, so that it is in place for
+		// messages that the broker sends as soon as it processes the
+		// SUBSCRIBE.
+		if (int ret = subscriptions.insert(
+		      t, connection->allocator, filterView, subscription);
+		    ret != 0)
+		{
+			return ret;
+		}
+
+		int ret = subscribe(t, connection, qos, filter, filterLength);
+		if (ret < 0)
+		{
+			if (replacing)
+			{
+				// The nodes for the filter already exist, so this
+				// does not allocate and cannot fail.
+				subscriptions.insert(
+				  t, connection->allocator, filterView, previous);
+			}
+			else
+			{
+				subscriptions.remove(connection->allocator, filterView);
+			}
+		}
+
+		return ret;
+	}
+
+	/**
+	 * Copy the `count` entries of `subscriptions`, which must have been
+	 * claimed by the caller, into a new array of coreMQTT subscriptions
+	 * allocated with `allocator`, checking each with `check_filter`.  Each
+	 * entry is read once, as the caller may be modifying the array
+	 * concurrently.  Returns the array, or null with `error` set to
+	 * `-EINVAL` or `-ENOMEM`.
+	 */
+	MQTTSubscribeInfo_t *
+	subscriptions_copy(Timeout                       *t,
+	                   SObj                           allocator,
+	                   const struct MQTTSubscription *subscriptions,
+	                   size_t                         count,
+	                   int                           &error)
+	{
+		auto *filters = static_cast<MQTTSubscribeInfo_t *>(
+		  heap_allocate(t, allocator, count * sizeof(MQTTSubscribeInfo_t)));
+		if (filters == nullptr)
+		{
+			error = -ENOMEM;
+			return nullptr;
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			MQTTSubscription subscription = subscriptions[i];
+			if (!check_filter(subscription.qos,
+			                  subscription.filter,
+			                  subscription.filterLength))
+			{
+				heap_free(allocator, filters);
+				error = -EINVAL;
+				return nullptr;
+			}
+			filters[i].qos               = static_cast<MQTTQoS>(subscription.qos);
+			filters[i].pTopicFilter      = subscription.filter;
+			filters[i].topicFilterLength = subscription.filterLength;
+		}
+		return filters;
+	}
+
+	/**
+	 * Run `MQTT_ProcessLoop` on `connection`, whose lock must be held, until
+	 * it succeeds or `t` expires.  Returns zero on success or a negative
+	 * error code, as documented for `mqtt_run`.
+	 */
+	int process_loop(Timeout *t, CHERIoTMqttContext *connection)
+	{
+		MQTTContext_t *coreMQTTContext = &connection->coreMQTTContext;
+		MQTTStatus_t   status;
+
+		// Note: do not use `with_sendfailed_retry` here, as we need
+		// more thorough error handling.
+		do
+		{
+			status = with_elapse_timeout(t, [&]() {
+				// `MQTT_ProcessLoop` handles keepalive.
+				return MQTT_ProcessLoop(coreMQTTContext);
+			});
+
+			if (status != MQTTSuccess)
+			{
+				Debug::log("MQTT ProcessLoop failed, error: {}", status);
+
+				if (status == MQTTNoMemory)
+				{
+					return -ENOMEM;
+				}
+				if (status == MQTTSendFailed || status == MQTTRecvFailed ||
+				    status == MQTTNeedMoreBytes)
+				{
+					// If the TLS link is still live, try
+					// again until we are out of time.
+					if (connection->networkContext.isDisconnected)
+					{
+						return -ECONNABORTED;
+					}
+				}
+				else if (status == MQTTBadResponse ||
+				         status == MQTTIllegalState ||
+				         status == MQTTKeepAliveTimeout)
+				{
+					// Something is broken in the
+					// coreMQTT client, or in the broker.
+					// Consider this connection dead.
+					return -ECONNABORTED;
+				}
+				else if (status == MQTTBadParameter)
+				{
+					// This one shouldn't happen and would
+					// possibly indicate a bug in our code.
+					Debug::log("MQTT_ProcessLoop gave -EINVAL, this "
+					           "may indicate a bug in this code.");
+					return -EINVAL;
+				}
+				else
+				{
+					Debug::log("MQTT_ProcessLoop gave unknown error.");
+					return -EAGAIN;
+				}
+			}
+		} while (t->remaining > 0 && status != MQTTSuccess);
+
+		if (status != MQTTSuccess)
+		{
+			return -ETIMEDOUT;
+		}
+
+		return 0;
+	}
+
+	/**
+	 * Returns the number of milliseconds until `MQTT_ProcessLoop` next needs
+	 * to run to keep the connection alive: to send a PINGREQ, or to notice
+	 * that the PINGRESP is late.  This mirrors the checks in coreMQTT's
+	 * `handleKeepAlive`.
+	 */
+	uint32_t keepalive_due_in(const MQTTContext_t *context)
+	{
+		uint32_t now = get_current_time();
+		// The subtraction is correct across wraparound of the clock.
+		auto remaining = [&](uint32_t since, uint32_t interval) -> uint32_t {
+			uint32_t elapsed = now - since;
+			return elapsed < interval ? interval - elapsed : 0;
+		};
+		if (context->waitingForPingResp)
+		{
+			// coreMQTT gives up once strictly more than the timeout has
+			// elapsed.
+			return remaining(context->pingReqSendTimeMs,
+			                 MQTT_PINGRESP_TIMEOUT_MS + 1);
+		}
+		uint32_t due =
+		  remaining(context->lastPacketRxTime, PACKET_RX_TIMEOUT_MS);
+		uint32_t txTimeout = 1000U * context->keepAliveIntervalSec;
+		if (txTimeout > PACKET_TX_TIMEOUT_MS)
+		{
+			txTimeout = PACKET_TX_TIMEOUT_MS;
+		}
+		if (txTimeout != 0)
+		{
+			uint32_t txDue = remaining(context->lastPacketTxTime, txTimeout);
+			due            = txDue < due ? txDue : due;
+		}
+		return due;
+	}
+
+	/**
+	 * The longest time for which `mqtt_run_blocking` waits for the broker
+	 * with the connection locked.  The TLS connection and the socket stay
+	 * locked while they wait for data, so releasing only our lock would not
+	 * let other threads send.  Instead, the wait is split into slices of
+	 * this length and the lock is released between them, which bounds how
+	 * long an idle connection delays publishes and subscribes from other
+	 * threads.
+	 */
+	constexpr uint32_t WaitSliceMilliseconds = 100;
+
+	/**
+	 * Returned by `wait_and_process` when a slice of the wait ended with
+	 * nothing to do.
+	 */
+	constexpr int WaitSliceExpired = 1;
+
+	/**
+	 * Wait, for at most `WaitSliceMilliseconds`, until the broker sends data
+	 * or the keepalive is due and then process packets on `connection`,
+	 * whose lock must be held.  Returns `WaitSliceExpired` if neither
+	 * happened during the slice, or zero or a negative error code, as
+	 * documented for `mqtt_run_blocking`.
+	 */
+	int wait_and_process(Timeout *t, CHERIoTMqttContext *connection)
+	{
+		MQTTContext_t *coreMQTTContext = &connection->coreMQTTContext;
+
+		// If coreMQTT still has bytes from a previous read in its
+		// buffer, process them before waiting for more.
+		if (coreMQTTContext->index == 0)
+		{
+			// Round up, waking a little late is harmless, waking
+			// early would mean waiting again.
+			uint32_t dueMilliseconds = keepalive_due_in(coreMQTTContext);
+			Ticks    dueTicks =
+			  (dueMilliseconds + MS_PER_TICK - 1) / MS_PER_TICK;
+			Ticks sliceTicks =
+			  (WaitSliceMilliseconds + MS_PER_TICK - 1) / MS_PER_TICK;
+			bool    keepaliveFirst = dueTicks <= sliceTicks;
+			Timeout wait{std::min(
+			  {keepaliveFirst ? dueTicks : sliceTicks, t->remaining})};
+
+			int ret = tls_connection_poll(&wait, connection->tlsHandle);
+			t->elapse(wait.elapsed);
+			if (ret == -ETIMEDOUT)
+			{
+				if (!t->may_block())
+				{
+					return -ETIMEDOUT;
+				}
+				if (!keepaliveFirst)
+				{
+					return WaitSliceExpired;
+				}
+			}
+			else if (ret != 0)
+			{
+				// The TCP/TLS link is dead
+				Debug::log("Waiting for the broker failed: {}", ret);
+				connection->networkContext.isDisconnected = true;
+				return -ECONNABORTED;
+			}
+		}
+
+		return process_loop(t, connection);
+	}
+
+	/**
+	 * Send a CONNECT packet with the client ID of `connection`, whose lock
+	 * must be held, and wait for the CONNACK, retrying until `t` expires.
+	 * Returns the coreMQTT status and, on success, sets `sessionPresent` to
+	 * indicate whether the broker had a session for the client ID.
+	 */
+	MQTTStatus_t broker_connect(Timeout            *t,
+	                            CHERIoTMqttContext *connection,
+	                            bool                newSession,
+	                            bool               &sessionPresent)
+	{
+		MQTTConnectInfo_t connectInfo = {0};
+
+		connectInfo.cleanSession           = newSession;
+		connectInfo.pClientIdentifier      = connection->clientID;
+		connectInfo.clientIdentifierLength = connection->clientIDLength;
+
+		// Note: there are a number of optional fields in connectInfo to
+		// specify a keepalive (`connectInfo.keepAliveSeconds`), a username
+		// (`pUserName`, `userNameLength`), a password (`pPassword`,
+		// `passwordLength`), and others. We don't support these for now.
+
+		MQTTStatus_t ret;
+		do
+		{
+			// `remaining` is in milliseconds
+			uint32_t remaining = (t->remaining * MS_PER_TICK) / 1000;
+			ret                = with_elapse_timeout(t, [&]() {
+				return MQTT_Connect(&connection->coreMQTTContext,
+				                    &connectInfo,
+				                    nullptr,
+				                    remaining,
+				                    &sessionPresent);
+			});
+
+			if (ret == MQTTNoMemory || ret == MQTTBadParameter)
+			{
+				// If we run OOM, or pass invalid parameters (which is
+				// likely a bug in this code), retrying won't help.
+				break;
+			}
+
+			if (connection->networkContext.isDisconnected)
+			{
+				// If the link died, retrying won't help.
+				Debug::log("Connection aborted while connecting.");
+				break;
+			}
+		} while (t->remaining > 0 && ret != MQTTSuccess);
+
+		return ret;
+	}
+
+	/**
+	 * Send the stored copies of the publishes that coreMQTT still expects
+	 * to be acknowledged after a session has been resumed, with the DUP
+	 * flag set, and free the copies of any others.  Returns zero on
+	 * success or a negative error code, as for `mqtt_publish`.  Publishes
+	 * that could not be sent are kept for the next reconnection.
+	 */
+	int replay(Timeout *t, CHERIoTMqttContext *connection)
+	{
+		MQTTContext_t    *coreMQTTContext = &connection->coreMQTTContext;
+		StoredPublish    *stale    = connection->networkContext.unacknowledged;
+		StoredPublish    *replayed = nullptr;
+		MQTTStateCursor_t cursor   = MQTT_STATE_CURSOR_INITIALIZER;
+		uint16_t          packetId;
+		int               ret = 0;
+
+		while ((packetId = MQTT_PublishToResend(coreMQTTContext, &cursor)) !=
+		       MQTT_PACKET_ID_INVALID)
+		{
+			StoredPublish **link = &stale;
+			while ((*link != nullptr) && ((*link)->packetId != packetId))
+			{
+				link = &(*link)->next;
+			}
+			if (*link == nullptr)
+			{
+				// Published before reconnection was enabled.
+				Debug::log("No copy of publish {} to replay", packetId);
+				continue;
+			}
+			StoredPublish *stored = *link;
+			*link                 = stored->next;
+			stored->next          = replayed;
+			replayed              = stored;
+			if (ret != 0)
+			{
+				continue;
+			}
+
+			MQTTPublishInfo_t publishInfo = {};
+			publishInfo.qos               = static_cast<MQTTQoS>(stored->qos);
+			publishInfo.retain            = stored->retain;
+			publishInfo.dup               = true;
+			publishInfo.pTopicName        = &stored->topic;
+			publishInfo.topicNameLength   = stored->topicLength;
+			publishInfo.pPayload          = &stored->topic + stored->topicLength;
+			publishInfo.payloadLength     = stored->payloadLength;
+
+			Debug::log("Replaying publish {}", packetId);
+			ret = with_sendfailed_retry(t, "MQTT_Publish", connection, [&]() {
+				return MQTT_Publish(coreMQTTContext, &publishInfo, packetId);
+			});
+		}
+
+		// The remaining copies are for publishes that were acknowledged
+		// just before the link died.
+		connection->networkContext.unacknowledged = stale;
+		connection->unacknowledged_clear();
+		connection->networkContext.unacknowledged = replayed;
+		return ret;
+	}
+
+	/// The number of cycles in a millisecond.
+	constexpr uint64_t CyclesPerMilliSecond = CPU_TIMER_HZ / 1000;
+
+	/**
+	 * Returns the number of milliseconds until `connection` may attempt to
+	 * reconnect, or zero if it may do so now.
+	 */
+	uint32_t reconnect_wait(CHERIoTMqttContext *connection)
+	{
+		uint64_t now = rdcycle64();
+		if (now >= connection->reconnectNotBefore)
+		{
+			return 0;
+		}
+		// Round up, so that waiting for the result is enough.
+		uint64_t wait = (connection->reconnectNotBefore - now +
+		                 CyclesPerMilliSecond - 1) /
+		                CyclesPerMilliSecond;
+		return std::min<uint64_t>(wait, std::numeric_limits<uint32_t>::max());
+	}
+
+	/**
+	 * Re-establish the link of `connection`, whose lock must be held, after
+	 * it has died, resuming both the TLS session and the MQTT session.
+	 * Attempts are spaced by an exponentially growing delay, which is reset
+	 * when an attempt succeeds.
+	 *
+	 * Returns zero if the MQTT session was resumed, `-ECONNRESET` if the
+	 * link was re-established but the broker started a new session,
+	 * `-ENOTCONN` if `t` expired first, `-ECONNABORTED` if the link cannot
+	 * be re-established, or an error from replaying publishes.
+	 */
+	int reconnect(Timeout *t, CHERIoTMqttContext *connection)
+	{
+		MQTTContext_t *coreMQTTContext = &connection->coreMQTTContext;
+
+		while (true)
+		{
+			if (!t->may_block())
+			{
+				return -ENOTCONN;
+			}
+			uint32_t wait = reconnect_wait(connection);
+			if (wait > 0)
+			{
+				Ticks   ticks = (wait + MS_PER_TICK - 1) / MS_PER_TICK;
+				Timeout sleep{std::min<Ticks>(ticks, t->remaining)};
+				thread_sleep(&sleep);
+				t->elapse(sleep.elapsed);
+				continue;
+			}
+
+			// Schedule the next attempt before making this one.  Add up to
+			// 25% of jitter, so that clients that lost their links at the
+			// same time do not all come back at the same time.
+			uint32_t backoff = connection->reconnectBackoffMilliseconds;
+			uint64_t delay   = backoff + rand() % (backoff / 4 + 1);
+			connection->reconnectNotBefore =
+			  rdcycle64() + delay * CyclesPerMilliSecond;
+			connection->reconnectBackoffMilliseconds =
+			  (backoff > connection->reconnectMaximumMilliseconds / 2)
+			    ? connection->reconnectMaximumMilliseconds
+			    : backoff * 2;
+
+			Debug::log("Reconnecting to the broker.");
+			int ret = tls_connection_reconnect(t, connection->tlsHandle);
+			if ((ret == -EINVAL) || (ret == -ENOTSUP))
+			{
+				return -ECONNABORTED;
+			}
+			if (ret != 0)
+			{
+				Debug::log("TLS reconnection failed: {}", ret);
+				continue;
+			}
+
+			// Discard the state of the dead link.  coreMQTT refuses to
+			// connect a context that it believes is still connected.
+			connection->networkContext.isDisconnected = false;
+			coreMQTTContext->connectStatus            = MQTTNotConnected;
+			coreMQTTContext->waitingForPingResp       = false;
+			coreMQTTContext->index                    = 0;
+
+			bool         sessionPresent = false;
+			MQTTStatus_t status =
+			  broker_connect(t, connection, false, sessionPresent);
+			if (status != MQTTSuccess)
+			{
+				Debug::log("MQTT reconnection failed, error {}.", status);
+				connection->networkContext.isDisconnected = true;
+				continue;
+			}
+
+			connection->reconnectBackoffMilliseconds =
+			  connection->reconnectMinimumMilliseconds;
+			if (!sessionPresent)
+			{
+				// coreMQTT has discarded the QoS state, so there is
+				// nothing to replay, and the broker has discarded the
+				// subscriptions.
+				Debug::log("Reconnected, but the broker started a new "
+				           "session.");
+				connection->unacknowledged_clear();
+				connection->pending_subacks_clear();
+				return -ECONNRESET;
+			}
+			Debug::log("Reconnected to the broker.");
+			return replay(t, connection);
+		}
+	}
+
+	/**
+	 * Send the publishes in the offline queue of `connection`, whose lock
+	 * must be held, in order.  The publishes share TLS records, which are
+	 * flushed once at the end.  Returns zero once the queue is empty, or a
+	 * negative error code as for `mqtt_publish`, in which case the
+	 * publishes that were not sent remain queued.  Publishes that fail for
+	 * reasons that retrying would not fix are dropped.
+	 */
+	int offline_queue_drain(Timeout *t, CHERIoTMqttContext *connection)
+	{
+		NetworkContext_t *networkContext = &connection->networkContext;
+		int               ret            = 0;
+
+		if (connection->offlineQueue == nullptr)
+		{
+			return 0;
+		}
+
+		Debug::log("Sending {} queued publishes",
+		           connection->offlineQueueDepth);
+		networkContext->holdRecords = true;
+		while (StoredPublish *queued = connection->offlineQueue)
+		{
+			ret = publish_now(t,
+			                  connection,
+			                  queued->qos,
+			                  &queued->topic,
+			                  queued->topicLength,
+			                  &queued->topic + queued->topicLength,
+			                  queued->payloadLength,
+			                  queued->retain);
+			if ((ret == -ENOTCONN) || (ret == -ETIMEDOUT) || (ret == -ENOMEM))
+			{
+				break;
+			}
+			if (ret < 0)
+			{
+				Debug::log("Dropping queued publish, error {}", ret);
+			}
+			connection->offlineQueue = queued->next;
+			connection->offlineQueueDepth--;
+			heap_free(connection->allocator, queued);
+			ret = 0;
+		}
+		if (connection->offlineQueue == nullptr)
+		{
+			connection->offlineQueueTail = nullptr;
+		}
+		networkContext->holdRecords = false;
+
+		// As in `mqtt_publish_batch`, give the flush at least a short
+		// time.
+		Timeout flushTimeout{t->remaining > 0 ? t->remaining
+		                                      : MS_TO_TICKS(1000)};
+		int     flushed =
+		  tls_connection_flush(&flushTimeout, connection->tlsHandle);
+		t->elapse(flushTimeout.elapsed);
+		if (flushed == -ENOTCONN)
+		{
+			networkContext->isDisconnected = true;
+		}
+		if ((ret == 0) && (flushed != 0))
+		{
+			ret = networkContext->isDisconnected ? -ENOTCONN : flushed;
+		}
+		return ret;
+	}
+
+	/**
+	 * Run `callback`, which processes incoming packets on `connection` and
+	 * returns an error code as documented for `mqtt_run`.  If reconnection
+	 * is enabled and the link is dead, or dies, re-establish it instead.
+	 * Publishes queued while the link was down are sent before anything
+	 * else.
+	 */
+	int with_reconnect(Timeout            *t,
+	                   CHERIoTMqttContext *connection,
+	                   auto                callback)
+	{
+		NetworkContext_t *networkContext = &connection->networkContext;
+		int               ret            = 0;
+
+		if (!connection->reconnect_enabled())
+		{
+			return callback();
+		}
+		if (!networkContext->isDisconnected)
+		{
+			ret = offline_queue_drain(t, connection);
+			if (ret == 0)
+			{
+				ret = callback();
+			}
+			if (ret == -ECONNABORTED)
+			{
+				// coreMQTT also gives up on links that are still up,
+				// for example if the broker stops answering PINGREQs.
+				networkContext->isDisconnected = true;
+			}
+		}
+		if (networkContext->isDisconnected)
+		{
+			ret = reconnect(t, connection);
+			if ((ret == 0) || (ret == -ECONNRESET))
+			{
+				int drained = offline_queue_drain(t, connection);
+				ret         = (drained != 0) ? drained : ret;
+			}
+		}
+		return ret;
+	}
+
+	/**
+	 * Process packets on `connection`, whose lock must be held, if that can
+	 * be done without waiting: if the broker has sent data, a keepalive is
+	 * due, or the link has died.  Returns an error code as documented for
+	 * `mqtt_run`, or `-ETIMEDOUT` without doing anything if there was
+	 * nothing to do, in which case `dueMilliseconds` is lowered to the time
+	 * until the connection will need attention even if the broker stays
+	 * quiet.
+	 */
+	int run_if_ready(Timeout            *t,
+	                 CHERIoTMqttContext *connection,
+	                 uint32_t           &dueMilliseconds)
+	{
+		MQTTContext_t *coreMQTTContext = &connection->coreMQTTContext;
+		auto notReady = [&](uint32_t due) {
+			dueMilliseconds = std::min(dueMilliseconds, due);
+			return -ETIMEDOUT;
+		};
+
+		if (connection->networkContext.isDisconnected)
+		{
+			// Don't wait for the reconnection backoff here, as that
+			// would delay the other connections.
+			if (connection->reconnect_enabled())
+			{
+				uint32_t wait = reconnect_wait(connection);
+				if (wait > 0)
+				{
+					return notReady(wait);
+				}
+			}
+		}
+		else if ((coreMQTTContext->index == 0) &&
+		         (connection->offlineQueue == nullptr))
+		{
+			uint32_t keepaliveDue = keepalive_due_in(coreMQTTContext);
+			if (keepaliveDue > 0)
+			{
+				Timeout noWait{0};
+				int ret = tls_connection_poll(&noWait, connection->tlsHandle);
+				if (ret == -ETIMEDOUT)
+				{
+					return notReady(keepaliveDue);
+				}
+				if (ret != 0)
+				{
+					// The TCP/TLS link is dead
+					Debug::log("Polling the broker failed: {}", ret);
+					connection->networkContext.isDisconnected = true;
+				}
+			}
+		}
+
+		return with_reconnect(
+		  t, connection, [&]() { return process_loop(t, connection); });
+	}
+} // namespace
+
+// Public CHERIoT MQTT API
+
+SObj mqtt_connect(Timeout                    *t,
+                  SObj                        allocator,
+                  SObj                        hostCapability,
+                  MQTTPublishCallback         publishCallback,
+                  MQTTAckCallback             ackCallback,
+                  const br_x509_trust_anchor *trustAnchors,
+                  size_t                      trustAnchorsCount,
+                  size_t                      networkBufferSize,
+                  size_t                      incomingPublishCount,
+                  size_t                      outgoingPublishCount,
+                  const char                 *clientID,
+                  size_t                      clientIDLength,
+                  bool                        newSession)
+{
+	// Note: do not check trustAnchors because we don't use technically use
+	// it. We only pass it on to the TLS compartment which we assume will
+	// check the pointer.
+	//
+	// Similarly, no need to check the two callbacks, because the trusted
+	// switcher will do that for us. The only thing callers will achieve by
+	// passing invalid callbacks is not getting ACKs or PUBLISHEs.
+
+	if (!check_timeout_pointer(t))
+	{
+		return nullptr;
+	}
+
+	if (!CHERI::check_pointer(clientID, clientIDLength))
+	{
+		return nullptr;
+	}
+
+	if constexpr (DebugMQTT)
+	{
+		if (!is_valid_client_id({clientID, clientIDLength}))
+		{
+			Debug::log("Passed invalid client ID.");
+			return nullptr;
+		}
+	}
+
+	// Allocate MQTT internal buffers as part of the sealed allocation.
+	// Note: no explicit zero-ing needed here (unlike suggested by
+	// coreMQTT), we can assume that the allocator zeroes out for us.
+	size_t handleSize =
+	  sizeof(CHERIoTMqttContext) -
+	  sizeof(CHERIoTMqttContext::variableLengthData) + networkBufferSize +
+	  sizeof(MQTTPubAckInfo_t) * (incomingPublishCount + outgoingPublishCount) +
+	  clientIDLength;
+
+	// Create a sealed MQTT handle.
+	void *unsealedMQTTHandle;
+	SObj  sealedMQTTHandle = token_sealed_unsealed_alloc(
+	   t, allocator, mqtt_key(), handleSize, &unsealedMQTTHandle);
+	if (sealedMQTTHandle == nullptr)
+	{
+		Debug::log("Failed to allocate CHERIoT MQTT context.");
+		return nullptr;
+	}
+
+	Debug::log("Created CHERIoT MQTT context sealed with {}.", mqtt_key());
+
+	// Set up a TLS stream with the broker.
+	SObj tlsHandle = tls_connection_create(
+	  t, allocator, hostCapability, trustAnchors, trustAnchorsCount);
+	if (!Capability{tlsHandle}.is_valid())
+	{
+		Debug::log("Failed to open TLS stream.");
 
 		// Manually destroy the handle, as we have not yet wrapped it
 		// into a smart pointer.
@@ -595,17 +2020,22 @@ SObj mqtt_connect(Timeout                    *t,
 	  incomingPublishes + incomingPublishCount;
 	uint8_t *networkBuffer = reinterpret_cast<uint8_t *>(outgoingPublishes) +
 	                         sizeof(MQTTPubAckInfo_t) * outgoingPublishCount;
+	char *storedClientID =
+	  reinterpret_cast<char *>(networkBuffer + networkBufferSize);
+	memcpy(storedClientID, clientID, clientIDLength);
 
 	// Initialize context nested structures.
-	context->networkContext.tlsHandle       = tlsHandle;
-	context->networkContext.publishCallback = publishCallback;
-	context->networkContext.ackCallback     = ackCallback;
-	context->networkBuffer.pBuffer          = networkBuffer;
-	context->networkBuffer.size             = networkBufferSize;
-	context->transportInterface.recv        = transport_recv;
-	context->transportInterface.send        = transport_send;
-	// TODO we do not support writev yet, which is optional.
-	context->transportInterface.writev          = NULL;
+	context->clientID                           = storedClientID;
+	context->clientIDLength                     = clientIDLength;
+	context->networkContext.tlsHandle           = tlsHandle;
+	context->networkContext.allocator           = allocator;
+	context->networkContext.publishCallback     = publishCallback;
+	context->networkContext.ackCallback         = ackCallback;
+	context->networkBuffer.pBuffer              = networkBuffer;
+	context->networkBuffer.size                 = networkBufferSize;
+	context->transportInterface.recv            = transport_recv;
+	context->transportInterface.send            = transport_send;
+	context->transportInterface.writev          = transport_writev;
 	context->transportInterface.pNetworkContext = &context->networkContext;
 
 	auto cleanup = [&](auto *) {
@@ -656,54 +2086,16 @@ SObj mqtt_connect(Timeout                    *t,
 		return nullptr;
 	}
 
-	// Prepare the low-level MQTT API connect call.
-	MQTTConnectInfo_t connectInfo = {0};
-
-	connectInfo.cleanSession           = newSession;
-	connectInfo.pClientIdentifier      = clientID;
-	connectInfo.clientIdentifierLength = clientIDLength;
-
 	Debug::log("Using client ID {}",
 	           std::string_view(clientID, clientIDLength));
 
-	// Note: there are a number of optional fields in connectInfo to
-	// specify a keepalive (`connectInfo.keepAliveSeconds`), a username
-	// (`pUserName`, `userNameLength`), a password (`pPassword`,
-	// `passwordLength`), and others. We don't support these for now.
-
 	Debug::log("Connecting to the broker.");
 
 	// `sessionPresent` will be set to true by `MQTT_Connect` if a previous
 	// session was present; otherwise it will be set to false. It is only
 	// relevant if not establishing a clean session.
 	bool sessionPresent;
-
-	do
-	{
-		// `remaining` is in milliseconds
-		uint32_t remaining = (t->remaining * MS_PER_TICK) / 1000;
-		ret                = with_elapse_timeout(t, [&]() {
-            return MQTT_Connect(&context->coreMQTTContext,
-			                                   &connectInfo,
-			                                   nullptr,
-			                                   remaining,
-			                                   &sessionPresent);
-		               });
-
-		if (ret == MQTTNoMemory || ret == MQTTBadParameter)
-		{
-			// If we run OOM, or pass invalid parameters (which is
-			// likely a bug in this code), retrying won't help.
-			break;
-		}
-
-		if (context->networkContext.isDisconnected)
-		{
-			// If the link died, retrying won't help.
-			Debug::log("Connection aborted while connecting.");
-			break;
-		}
-	} while (t->remaining > 0 && ret != MQTTSuccess);
+	ret = broker_connect(t, context, newSession, sessionPresent);
 
 	if (ret != MQTTSuccess)
 	{
@@ -792,162 +2184,316 @@ int mqtt_disconnect(Timeout *t, SObj allocator, SObj mqttHandle)
 		  return 0;
 	  });
 
-	if (ret < 0)
+	if (ret < 0)
+	{
+		// Disconnecting failed. Leave the TLS link open and return an
+		// error.
+		return ret;
+	}
+
+	// Now terminate the TLS connection and free our resources. This cannot
+	// fail.
+	return with_sealed_mqtt_context(
+	  t,
+	  mqttHandle,
+	  [&](CHERIoTMqttContext *connection) {
+		  connection->~CHERIoTMqttContext();
+		  token_obj_destroy(allocator, mqtt_key(), mqttHandle);
+		  return 0;
+	  },
+	  true /* grab the context in destruct mode */);
+}
+
+int mqtt_publish(Timeout    *t,
+                 SObj        mqttHandle,
+                 uint8_t     qos,
+                 const char *topic,
+                 size_t      topicLength,
+                 const void *payload,
+                 size_t      payloadLength,
+                 bool        retain)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+
+	if (!check_publish(qos, topic, topicLength, payload, payloadLength))
+	{
+		return -EINVAL;
+	}
+
+	return with_sealed_mqtt_context(
+	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
+		  return publish(t,
+		                 connection,
+		                 qos,
+		                 topic,
+		                 topicLength,
+		                 payload,
+		                 payloadLength,
+		                 retain);
+	  });
+}
+
+int mqtt_publish_batch(Timeout                   *t,
+                       SObj                       mqttHandle,
+                       struct MQTTPublishRequest *requests,
+                       size_t                     count)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+
+	if ((count == 0) || (heap_claim_fast(t, requests) != 0) ||
+	    !CHERI::check_pointer<CHERI::PermissionSet{CHERI::Permission::Load,
+	                                               CHERI::Permission::Store}>(
+	      requests, count * sizeof(MQTTPublishRequest)))
+	{
+		return -EINVAL;
+	}
+
+	return with_sealed_mqtt_context(
+	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
+		  NetworkContext_t *networkContext = &connection->networkContext;
+		  size_t            sent           = 0;
+		  int               error          = 0;
+
+		  // Hold back TLS records until the whole batch has been
+		  // handed to the TLS compartment.
+		  networkContext->holdRecords = true;
+		  for (size_t i = 0; i < count; i++)
+		  {
+			  // Read each request once: the caller may be modifying
+			  // the array concurrently.
+			  MQTTPublishRequest request = requests[i];
+			  int                ret;
+			  if (error != 0)
+			  {
+				  // Stop at the first failure.  The state of the
+				  // connection is unknown after most errors and
+				  // the following messages may depend on this one.
+				  ret = -ECANCELED;
+			  }
+			  else if (!check_publish(request.qos,
+			                          request.topic,
+			                          request.topicLength,
+			                          request.payload,
+			                          request.payloadLength))
+			  {
+				  ret = error = -EINVAL;
+			  }
+			  else
+			  {
+				  ret = publish(t,
+				                connection,
+				                request.qos,
+				                request.topic,
+				                request.topicLength,
+				                request.payload,
+				                request.payloadLength,
+				                request.retain);
+				  if (ret < 0)
+				  {
+					  error = ret;
+				  }
+				  else
+				  {
+					  sent++;
+				  }
+			  }
+			  requests[i].result = ret;
+		  }
+		  networkContext->holdRecords = false;
+
+		  // Send everything that was written, even if the batch stopped
+		  // early.  Give the flush at least a short time, as the batch
+		  // may have used up all of the caller's timeout.
+		  Timeout flushTimeout{t->remaining > 0 ? t->remaining
+		                                        : MS_TO_TICKS(1000)};
+		  int     ret =
+		    tls_connection_flush(&flushTimeout, connection->tlsHandle);
+		  t->elapse(flushTimeout.elapsed);
+		  if (ret == -ENOTCONN)
+		  {
+			  networkContext->isDisconnected = true;
+			  return connection->reconnect_enabled() ? -ENOTCONN
+			                                         : -ECONNABORTED;
+		  }
+		  if ((ret < 0) && (sent > 0))
+		  {
+			  return ret;
+		  }
+
+		  return sent > 0 ? int(sent) : error;
+	  });
+}
+
+int mqtt_subscribe(Timeout    *t,
+                   SObj        mqttHandle,
+                   uint8_t     qos,
+                   const char *filter,
+                   size_t      filterLength)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+
+	if (!check_filter(qos, filter, filterLength))
 	{
-		// Disconnecting failed. Leave the TLS link open and return an
-		// error.
-		return ret;
+		return -EINVAL;
 	}
 
-	// Now terminate the TLS connection and free our resources. This cannot
-	// fail.
 	return with_sealed_mqtt_context(
-	  t,
-	  mqttHandle,
-	  [&](CHERIoTMqttContext *connection) {
-		  connection->~CHERIoTMqttContext();
-		  token_obj_destroy(allocator, mqtt_key(), mqttHandle);
-		  return 0;
-	  },
-	  true /* grab the context in destruct mode */);
+	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
+		  return subscribe(t, connection, qos, filter, filterLength);
+	  });
 }
 
-int mqtt_publish(Timeout    *t,
-                 SObj        mqttHandle,
-                 uint8_t     qos,
-                 const char *topic,
-                 size_t      topicLength,
-                 const void *payload,
-                 size_t      payloadLength,
-                 bool        retain)
+int mqtt_subscribe_with_callback(Timeout            *t,
+                                 SObj                mqttHandle,
+                                 uint8_t             qos,
+                                 const char         *filter,
+                                 size_t              filterLength,
+                                 MQTTPublishCallback callback)
 {
-	if (!CHERI::check_pointer(topic, topicLength))
+	if (!check_timeout_pointer(t))
 	{
 		return -EINVAL;
 	}
 
-	if (!CHERI::check_pointer(payload, payloadLength))
+	if (!check_filter(qos, filter, filterLength))
 	{
 		return -EINVAL;
 	}
 
+	return with_sealed_mqtt_context(
+	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
+		  return subscribe_registered(
+		    t, connection, qos, filter, filterLength, {callback, 0});
+	  });
+}
+
+int mqtt_subscribe_to_ring(Timeout    *t,
+                           SObj        mqttHandle,
+                           uint8_t     qos,
+                           const char *filter,
+                           size_t      filterLength,
+                           uint16_t    topicId)
+{
 	if (!check_timeout_pointer(t))
 	{
 		return -EINVAL;
 	}
 
-	if (qos > MQTTQoS2)
+	if (!check_filter(qos, filter, filterLength) ||
+	    (topicId == MQTTRingPadding))
 	{
 		return -EINVAL;
 	}
 
-	/**
-	 * Validate the topic (done similarly with the filter in
-	 * `mqtt_subscribe` and `mqtt_unsubscribe`). Without these checks, we
-	 * would send an invalid PUBLISH to the broker, causing our connection
-	 * to be terminated. Since these are only there for convenience / not
-	 * security-relevant, only enable in debug mode.
-	 */
+	return with_sealed_mqtt_context(
+	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
+		  return subscribe_registered(
+		    t, connection, qos, filter, filterLength, {nullptr, topicId});
+	  });
+}
 
-	if constexpr (DebugMQTT)
+int mqtt_ring_attach(Timeout  *t,
+                     SObj      mqttHandle,
+                     MQTTRing *ring,
+                     size_t    ringSize)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+
+	// The usable size is the largest power of two that fits.
+	uint32_t dataSize = 0;
+	if (ring != nullptr)
 	{
-		// Note from the MQTT 3.1.1 spec: 'All Topic Names and Topic Filters
-		// MUST be at least one character long'
-		if (topicLength < 1)
+		if ((ringSize < sizeof(MQTTRing) + MinimumRingSize) ||
+		    !CHERI::check_pointer<
+		      CHERI::PermissionSet{CHERI::Permission::Load,
+		                           CHERI::Permission::Store,
+		                           CHERI::Permission::Global}>(ring, ringSize))
 		{
 			return -EINVAL;
 		}
-
-		// Note from the MQTT 3.1.1 spec: 'Topic Names and Topic Filters MUST
-		// NOT include the null character'
-		if (has_null_character(topic, topicLength))
+		size_t available = ringSize - sizeof(MQTTRing);
+		dataSize         = MinimumRingSize;
+		while ((dataSize * 2 <= available) && (dataSize * 2 != 0))
 		{
-			return -EINVAL;
+			dataSize *= 2;
 		}
 	}
 
 	return with_sealed_mqtt_context(
 	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
-		  MQTTContext_t    *coreMQTTContext = &connection->coreMQTTContext;
-		  MQTTPublishInfo_t publishInfo;
-
-		  publishInfo.qos             = static_cast<MQTTQoS>(qos);
-		  publishInfo.pTopicName      = topic;
-		  publishInfo.topicNameLength = topicLength;
-		  publishInfo.pPayload        = payload;
-		  publishInfo.payloadLength   = payloadLength;
-		  publishInfo.retain          = retain;
-
-		  // Packet ID is needed for QoS > 0.
-		  int packetId = MQTT_GetPacketId(coreMQTTContext);
-
-		  int ret = with_sendfailed_retry(t, "MQTT_Publish", connection, [&]() {
-			  return MQTT_Publish(coreMQTTContext, &publishInfo, packetId);
-		  });
-
-		  if (ret == 0)
+		  NetworkContext_t *networkContext = &connection->networkContext;
+		  connection->ring_detach();
+		  if (ring == nullptr)
 		  {
-			  return packetId;
+			  return 0;
 		  }
-
-		  return ret;
+		  // Make sure that the ring is not freed while we write to it.
+		  bool isHeapObject = heap_address_is_valid(ring);
+		  if (isHeapObject && (heap_claim(connection->allocator, ring) <= 0))
+		  {
+			  return -ENOMEM;
+		  }
+		  __c11_atomic_store(&ring->producer, 0, __ATOMIC_RELAXED);
+		  __c11_atomic_store(&ring->consumer, 0, __ATOMIC_RELAXED);
+		  __c11_atomic_store(&ring->dropped, 0, __ATOMIC_RELAXED);
+		  ring->size                  = dataSize;
+		  networkContext->ring        = ring;
+		  networkContext->ringSize    = dataSize;
+		  networkContext->ringClaimed = isHeapObject;
+		  return 0;
 	  });
 }
 
-int mqtt_subscribe(Timeout    *t,
-                   SObj        mqttHandle,
-                   uint8_t     qos,
-                   const char *filter,
-                   size_t      filterLength)
+int mqtt_unsubscribe(Timeout    *t,
+                     SObj        mqttHandle,
+                     uint8_t     qos,
+                     const char *filter,
+                     size_t      filterLength)
 {
-	if (!CHERI::check_pointer(filter, filterLength))
-	{
-		return -EINVAL;
-	}
-
 	if (!check_timeout_pointer(t))
 	{
 		return -EINVAL;
 	}
 
-	if (qos > MQTTQoS2)
+	if (!check_filter(qos, filter, filterLength))
 	{
 		return -EINVAL;
 	}
 
-	if constexpr (DebugMQTT)
-	{
-		if (filterLength < 1)
-		{
-			return -EINVAL;
-		}
-
-		if (has_null_character(filter, filterLength))
-		{
-			return -EINVAL;
-		}
-	}
-
 	return with_sealed_mqtt_context(
 	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
 		  MQTTContext_t *coreMQTTContext = &connection->coreMQTTContext;
 
-		  MQTTSubscribeInfo_t subscription;
-		  subscription.qos               = static_cast<MQTTQoS>(qos);
-		  subscription.pTopicFilter      = filter;
-		  subscription.topicFilterLength = filterLength;
+		  MQTTSubscribeInfo_t unsubscribe;
+		  unsubscribe.qos               = static_cast<MQTTQoS>(qos);
+		  unsubscribe.pTopicFilter      = filter;
+		  unsubscribe.topicFilterLength = filterLength;
 
-		  // Obtain a new packet id for the subscription.
+		  // Obtain a new packet id for the unsubscribe request.
 		  int packetId = MQTT_GetPacketId(coreMQTTContext);
 
 		  int ret =
-		    with_sendfailed_retry(t, "MQTT_Subscribe", connection, [&]() {
-			    return MQTT_Subscribe(
-			      coreMQTTContext, &subscription, 1, packetId);
+		    with_sendfailed_retry(t, "MQTT_Unsubscribe", connection, [&]() {
+			    return MQTT_Unsubscribe(
+			      coreMQTTContext, &unsubscribe, 1, packetId);
 		    });
 
 		  if (ret == 0)
 		  {
+			  connection->networkContext.subscriptions.remove(
+			    connection->allocator, {filter, filterLength});
 			  return packetId;
 		  }
 
@@ -955,64 +2501,131 @@ int mqtt_subscribe(Timeout    *t,
 	  });
 }
 
-int mqtt_unsubscribe(Timeout    *t,
-                     SObj        mqttHandle,
-                     uint8_t     qos,
-                     const char *filter,
-                     size_t      filterLength)
+int mqtt_subscribe_multiple(Timeout                       *t,
+                            SObj                           mqttHandle,
+                            const struct MQTTSubscription *subscriptions,
+                            size_t                         count,
+                            MQTTSubackCallback             subackCallback)
 {
-	if (!CHERI::check_pointer(filter, filterLength))
+	if (!check_timeout_pointer(t))
 	{
 		return -EINVAL;
 	}
 
-	if (!check_timeout_pointer(t))
+	if ((count == 0) || (heap_claim_fast(t, subscriptions) != 0) ||
+	    !CHERI::check_pointer(subscriptions,
+	                          count * sizeof(MQTTSubscription)))
 	{
 		return -EINVAL;
 	}
 
-	if (qos > MQTTQoS2)
+	return with_sealed_mqtt_context(
+	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
+		  MQTTContext_t    *coreMQTTContext = &connection->coreMQTTContext;
+		  NetworkContext_t *networkContext  = &connection->networkContext;
+		  SObj              allocator       = connection->allocator;
+		  int               ret             = 0;
+
+		  MQTTSubscribeInfo_t *filters =
+		    subscriptions_copy(t, allocator, subscriptions, count, ret);
+		  if (filters == nullptr)
+		  {
+			  return ret;
+		  }
+
+		  PendingSuback *pending = nullptr;
+		  if (subackCallback != nullptr)
+		  {
+			  pending = static_cast<PendingSuback *>(
+			    heap_allocate(t, allocator, sizeof(PendingSuback)));
+			  if (pending == nullptr)
+			  {
+				  heap_free(allocator, filters);
+				  return -ENOMEM;
+			  }
+		  }
+
+		  // Obtain a new packet id for the subscription.
+		  int packetId = MQTT_GetPacketId(coreMQTTContext);
+
+		  ret = with_sendfailed_retry(t, "MQTT_Subscribe", connection, [&]() {
+			  return MQTT_Subscribe(coreMQTTContext, filters, count, packetId);
+		  });
+		  heap_free(allocator, filters);
+
+		  if (ret != 0)
+		  {
+			  if (pending != nullptr)
+			  {
+				  heap_free(allocator, pending);
+			  }
+			  return ret;
+		  }
+
+		  // The SUBACK cannot arrive before the next `mqtt_run`, which
+		  // needs the lock that we hold.
+		  if (pending != nullptr)
+		  {
+			  pending->callback              = subackCallback;
+			  pending->packetId              = packetId;
+			  pending->next                  = networkContext->pendingSubacks;
+			  networkContext->pendingSubacks = pending;
+		  }
+		  return packetId;
+	  });
+}
+
+int mqtt_unsubscribe_multiple(Timeout                       *t,
+                              SObj                           mqttHandle,
+                              const struct MQTTSubscription *subscriptions,
+                              size_t                         count)
+{
+	if (!check_timeout_pointer(t))
 	{
 		return -EINVAL;
 	}
 
-	if constexpr (DebugMQTT)
+	if ((count == 0) || (heap_claim_fast(t, subscriptions) != 0) ||
+	    !CHERI::check_pointer(subscriptions,
+	                          count * sizeof(MQTTSubscription)))
 	{
-		if (filterLength < 1)
-		{
-			return -EINVAL;
-		}
-
-		if (has_null_character(filter, filterLength))
-		{
-			return -EINVAL;
-		}
+		return -EINVAL;
 	}
 
 	return with_sealed_mqtt_context(
 	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
 		  MQTTContext_t *coreMQTTContext = &connection->coreMQTTContext;
+		  SObj           allocator       = connection->allocator;
+		  int            ret             = 0;
 
-		  MQTTSubscribeInfo_t unsubscribe;
-		  unsubscribe.qos               = static_cast<MQTTQoS>(qos);
-		  unsubscribe.pTopicFilter      = filter;
-		  unsubscribe.topicFilterLength = filterLength;
+		  MQTTSubscribeInfo_t *filters =
+		    subscriptions_copy(t, allocator, subscriptions, count, ret);
+		  if (filters == nullptr)
+		  {
+			  return ret;
+		  }
 
 		  // Obtain a new packet id for the unsubscribe request.
 		  int packetId = MQTT_GetPacketId(coreMQTTContext);
 
-		  int ret =
+		  ret =
 		    with_sendfailed_retry(t, "MQTT_Unsubscribe", connection, [&]() {
 			    return MQTT_Unsubscribe(
-			      coreMQTTContext, &unsubscribe, 1, packetId);
+			      coreMQTTContext, filters, count, packetId);
 		    });
 
 		  if (ret == 0)
 		  {
-			  return packetId;
+			  for (size_t i = 0; i < count; i++)
+			  {
+				  connection->networkContext.subscriptions.remove(
+				    allocator,
+				    {filters[i].pTopicFilter, filters[i].topicFilterLength});
+			  }
 		  }
+		  heap_free(allocator, filters);
 
-		  return ret;
+		  return ret == 0 ? packetId : ret;
 	  });
 }
 
@@ -1025,70 +2638,172 @@ int mqtt_run(Timeout *t, SObj mqttHandle)
 
 	return with_sealed_mqtt_context(
 	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
-		  MQTTContext_t *coreMQTTContext = &connection->coreMQTTContext;
-		  MQTTStatus_t   status;
+		  return with_reconnect(
+		    t, connection, [&]() { return process_loop(t, connection); });
+	  });
+}
 
-		  // Note: do not use `with_sendfailed_retry` here, as we need
-		  // more thorough error handling.
-		  do
-		  {
-			  status = with_elapse_timeout(t, [&]() {
-				  // `MQTT_ProcessLoop` handles keepalive.
-				  return MQTT_ProcessLoop(coreMQTTContext);
+int mqtt_run_blocking(Timeout *t, SObj mqttHandle)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+
+	while (true)
+	{
+		int ret = with_sealed_mqtt_context(
+		  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
+			  return with_reconnect(t, connection, [&]() {
+				  return wait_and_process(t, connection);
 			  });
+		  });
+		if (ret != WaitSliceExpired)
+		{
+			return ret;
+		}
+		// Sleep for a tick without the lock between slices of the wait.
+		// Releasing the lock does not hand it over, so without this a
+		// thread waiting for it, in particular one with a lower priority,
+		// might never get it.
+		Timeout pause{1};
+		thread_sleep(&pause);
+		t->elapse(pause.elapsed);
+	}
+}
 
-			  if (status != MQTTSuccess)
-			  {
-				  Debug::log("MQTT ProcessLoop failed, error: {}", status);
+int mqtt_run_many(Timeout *t, SObj *mqttHandles, size_t count, int *results)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
 
-				  if (status == MQTTNoMemory)
-				  {
-					  return -ENOMEM;
-				  }
-				  if (status == MQTTSendFailed || status == MQTTRecvFailed ||
-				      status == MQTTNeedMoreBytes)
-				  {
-					  // If the TLS link is still live, try
-					  // again until we are out of time.
-					  if (connection->networkContext.isDisconnected)
-					  {
-						  return -ECONNABORTED;
-					  }
-				  }
-				  else if (status == MQTTBadResponse ||
-				           status == MQTTIllegalState ||
-				           status == MQTTKeepAliveTimeout)
-				  {
-					  // Something is broken in the
-					  // coreMQTT client, or in the broker.
-					  // Consider this connection dead.
-					  return -ECONNABORTED;
-				  }
-				  else if (status == MQTTBadParameter)
-				  {
-					  // This one shouldn't happen and would
-					  // possibly indicate a bug in our code.
-					  Debug::log("MQTT_ProcessLoop gave -EINVAL, this "
-					             "may indicate a bug in this code.");
-					  return -EINVAL;
-				  }
-				  else
-				  {
-					  Debug::log("MQTT_ProcessLoop gave unknown error.");
-					  return -EAGAIN;
-				  }
-			  }
-		  } while (t->remaining > 0 && status != MQTTSuccess);
+	if ((count == 0) || (heap_claim_fast(t, mqttHandles, results) != 0) ||
+	    !CHERI::check_pointer<
+	      CHERI::PermissionSet{CHERI::Permission::Load,
+	                           CHERI::Permission::LoadStoreCapability}>(
+	      mqttHandles, count * sizeof(SObj)) ||
+	    !CHERI::check_pointer<CHERI::PermissionSet{CHERI::Permission::Store}>(
+	      results, count * sizeof(int)))
+	{
+		return -EINVAL;
+	}
 
-		  if (status != MQTTSuccess)
+	// The network stack cannot wait for data on several sockets at once,
+	// so check each connection without blocking and sleep between rounds.
+	// Start with short sleeps, so that a burst of traffic is handled
+	// promptly, and back off while all of the connections are idle.
+	Ticks pollTicks = 1;
+	while (true)
+	{
+		int      ready           = 0;
+		uint32_t dueMilliseconds = std::numeric_limits<uint32_t>::max();
+		for (size_t i = 0; i < count; i++)
+		{
+			// Skip connections that another thread is using.
+			Timeout noWait{0};
+			int     ret = with_sealed_mqtt_context(
+			  &noWait, mqttHandles[i], [&](CHERIoTMqttContext *connection) {
+				  return run_if_ready(t, connection, dueMilliseconds);
+			  });
+			results[i] = ret;
+			if (ret != -ETIMEDOUT)
+			{
+				ready++;
+			}
+		}
+		if (ready > 0)
+		{
+			return ready;
+		}
+		if (!t->may_block())
+		{
+			return -ETIMEDOUT;
+		}
+
+		// Round up, as in `mqtt_run_blocking`, but always sleep for at
+		// least a tick.
+		Ticks sleepTicks = std::min<uint64_t>(
+		  (uint64_t(dueMilliseconds) + MS_PER_TICK - 1) / MS_PER_TICK,
+		  pollTicks);
+		sleepTicks = std::max<Ticks>(sleepTicks, 1);
+		Timeout sleep{std::min<Ticks>(sleepTicks, t->remaining)};
+		thread_sleep(&sleep);
+		t->elapse(sleep.elapsed);
+		pollTicks = std::min(pollTicks * 2, RunManyMaximumPollTicks);
+	}
+}
+
+int mqtt_reconnect_enable(Timeout *t,
+                          SObj     mqttHandle,
+                          uint32_t minimumBackoffMilliseconds,
+                          uint32_t maximumBackoffMilliseconds)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+
+	if ((maximumBackoffMilliseconds != 0) &&
+	    ((minimumBackoffMilliseconds == 0) ||
+	     (minimumBackoffMilliseconds > maximumBackoffMilliseconds)))
+	{
+		return -EINVAL;
+	}
+
+	return with_sealed_mqtt_context(
+	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
+		  connection->reconnectMinimumMilliseconds =
+		    minimumBackoffMilliseconds;
+		  connection->reconnectMaximumMilliseconds =
+		    maximumBackoffMilliseconds;
+		  connection->reconnectBackoffMilliseconds =
+		    minimumBackoffMilliseconds;
+		  if (maximumBackoffMilliseconds == 0)
 		  {
-			  return -ETIMEDOUT;
+			  connection->unacknowledged_clear();
+			  connection->offline_queue_clear();
 		  }
+		  return 0;
+	  });
+}
+
+int mqtt_offline_queue_enable(Timeout *t, SObj mqttHandle, uint32_t capacity)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
 
+	return with_sealed_mqtt_context(
+	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
+		  if (capacity == 0)
+		  {
+			  connection->offline_queue_clear();
+		  }
+		  else if (capacity < connection->offlineQueueDepth)
+		  {
+			  return -EBUSY;
+		  }
+		  connection->offlineQueueCapacity = capacity;
 		  return 0;
 	  });
 }
 
+int mqtt_offline_queue_depth(Timeout *t, SObj mqttHandle)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+
+	return with_sealed_mqtt_context(
+	  t, mqttHandle, [&](CHERIoTMqttContext *connection) {
+		  return static_cast<int>(connection->offlineQueueDepth);
+	  });
+}
+
 int mqtt_generate_client_id(char *buffer, size_t length)
 {
 	auto characters =
@@ -0,0 +1,280 @@
+// Copyright SCI Semiconductor and CHERIoT Contributors.
+// SPDX-License-Identifier: MIT
+
+#include "topic-trie.hh"
+#include <debug.hh>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+using Debug = ConditionalDebug<false, "MQTT topic trie">;
+
+/**
+ * A node of the trie, corresponding to one level of one or more filters.
+ */
+struct TopicTrie::Node
+{
+	/// The next node with the same parent.
+	Node *next;
+	/// The first node for the next level.
+	Node *children;
+	/// Where to deliver publishes for the filter that ends at this level.
+	TopicSubscription subscription;
+	/// True if a filter ends at this level.
+	bool isSubscribed;
+	/// The length of this level's name.
+	uint16_t length;
+	/// The first character of this level's name, the rest follow.
+	char name;
+
+	std::string_view level() const
+	{
+		return {&name, length};
+	}
+};
+
+namespace
+{
+	/**
+	 * Split the first level off `topic`.  Returns the level and sets
+	 * `isLast` if there are no more levels, otherwise removes the level and
+	 * its separator from `topic`.
+	 */
+	std::string_view next_level(std::string_view &topic, bool &isLast)
+	{
+		size_t           separator = topic.find('/');
+		std::string_view level     = topic.substr(0, separator);
+		isLast                     = (separator == std::string_view::npos);
+		topic.remove_prefix(isLast ? topic.size() : separator + 1);
+		return level;
+	}
+} // namespace
+
+void TopicTrie::prune(SObj allocator, Node **path[], size_t depth)
+{
+	if (dispatching)
+	{
+		prunePending = true;
+		return;
+	}
+	while (depth > 0)
+	{
+		Node **link = path[--depth];
+		Node  *node = *link;
+		if (node->isSubscribed || (node->children != nullptr))
+		{
+			return;
+		}
+		*link = node->next;
+		heap_free(allocator, node);
+	}
+}
+
+void TopicTrie::prune_all(SObj allocator, Node **link)
+{
+	while (*link != nullptr)
+	{
+		Node *node = *link;
+		prune_all(allocator, &node->children);
+		if (node->isSubscribed || (node->children != nullptr))
+		{
+			link = &node->next;
+			continue;
+		}
+		*link = node->next;
+		heap_free(allocator, node);
+	}
+}
+
+int TopicTrie::insert(Timeout                 *t,
+                      SObj                     allocator,
+                      std::string_view         filter,
+                      const TopicSubscription &subscription)
+{
+	Node **path[MaxFilterLevels];
+	size_t depth = 0;
+	Node **list  = &root;
+	bool   isLast;
+	do
+	{
+		std::string_view level = next_level(filter, isLast);
+		// Wildcards must be whole levels, and `#` must be the last one.
+		if (((level.find_first_of("+#") != std::string_view::npos) &&
+		     (level.size() != 1)) ||
+		    ((level == "#") && !isLast) || (depth == MaxFilterLevels))
+		{
+			prune(allocator, path, depth);
+			return -EINVAL;
+		}
+		Node **link = list;
+		while ((*link != nullptr) && ((*link)->level() != level))
+		{
+			link = &(*link)->next;
+		}
+		if (*link == nullptr)
+		{
+			void *allocation = heap_allocate(
+			  t, allocator, offsetof(Node, name) + level.size());
+			if (allocation == nullptr)
+			{
+				Debug::log("Failed to allocate trie node for {}", level);
+				prune(allocator, path, depth);
+				return -ENOMEM;
+			}
+			// The allocation is zeroed, so the links are already null and
+			// the node has no subscription.
+			auto *node   = static_cast<Node *>(allocation);
+			node->length = level.size();
+			memcpy(&node->name, level.data(), level.size());
+			*link = node;
+		}
+		path[depth++] = link;
+		list          = &(*link)->children;
+	} while (!isLast);
+	Node *node         = *path[depth - 1];
+	node->subscription = subscription;
+	node->isSubscribed = true;
+	return 0;
+}
+
+bool TopicTrie::remove(SObj allocator, std::string_view filter)
+{
+	Node **path[MaxFilterLevels];
+	size_t depth = 0;
+	Node **list  = &root;
+	bool   isLast;
+	do
+	{
+		std::string_view level = next_level(filter, isLast);
+		if (depth == MaxFilterLevels)
+		{
+			return false;
+		}
+		Node **link = list;
+		while ((*link != nullptr) && ((*link)->level() != level))
+		{
+			link = &(*link)->next;
+		}
+		if (*link == nullptr)
+		{
+			return false;
+		}
+		path[depth++] = link;
+		list          = &(*link)->children;
+	} while (!isLast);
+	Node *node         = *path[depth - 1];
+	bool  found        = node->isSubscribed;
+	node->isSubscribed = false;
+	prune(allocator, path, depth);
+	return found;
+}
+
+const TopicSubscription *TopicTrie::find(std::string_view filter) const
+{
+	const Node *list = root;
+	const Node *node;
+	bool        isLast;
+	do
+	{
+		std::string_view level = next_level(filter, isLast);
+		node                   = list;
+		while ((node != nullptr) && (node->level() != level))
+		{
+			node = node->next;
+		}
+		if (node == nullptr)
+		{
+			return nullptr;
+		}
+		list = node->children;
+	} while (!isLast);
+	return node->isSubscribed ? &node->subscription : nullptr;
+}
+
+size_t
+TopicTrie::match(const Node                                      *children,
+                 std::string_view                                 topic,
+                 bool                                             isFirstLevel,
+                 FunctionWrapper<void(const TopicSubscription &)> &visit)
+{
+	size_t matches = 0;
+	auto   fire    = [&](const Node *node) {
+		if (node->isSubscribed)
+		{
+			visit(node->subscription);
+			matches++;
+		}
+	};
+	bool             isLast;
+	std::string_view level = next_level(topic, isLast);
+	// Wildcards at the first level do not match topics starting with `$`,
+	// which are reserved for the broker (MQTT 3.1.1 section 4.7.2).
+	bool wildcardsMatch = !isFirstLevel || !level.starts_with('$');
+	for (const Node *node = children; node != nullptr; node = node->next)
+	{
+		std::string_view name = node->level();
+		if (name == "#")
+		{
+			if (wildcardsMatch)
+			{
+				fire(node);
+			}
+		}
+		else if ((wildcardsMatch && (name == "+")) || (name == level))
+		{
+			if (!isLast)
+			{
+				matches += match(node->children, topic, false, visit);
+				continue;
+			}
+			fire(node);
+			// `a/#` also matches `a`.
+			for (const Node *child = node->children; child != nullptr;
+			     child             = child->next)
+			{
+				if (child->level() == "#")
+				{
+					fire(child);
+				}
+			}
+		}
+	}
+	return matches;
+}
+
+size_t
+TopicTrie::match(SObj                                             allocator,
+                 std::string_view                                 topic,
+                 FunctionWrapper<void(const TopicSubscription &)> visit)
+{
+	// A callback may process more messages and so reach here again, in
+	// which case only the outermost call may free nodes.
+	bool wasDispatching = dispatching;
+	dispatching         = true;
+	size_t matches      = match(root, topic, true, visit);
+	dispatching         = wasDispatching;
+	if (!dispatching && prunePending)
+	{
+		prunePending = false;
+		prune_all(allocator, &root);
+	}
+	return matches;
+}
+
+void TopicTrie::clear(SObj allocator, Node *children)
+{
+	while (children != nullptr)
+	{
+		Node *next = children->next;
+		clear(allocator, children->children);
+		heap_free(allocator, children);
+		children = next;
+	}
+}
+
+void TopicTrie::clear(SObj allocator)
+{
+	clear(allocator, root);
+	root = nullptr;
+}
@@ -0,0 +1,122 @@
+// Copyright SCI Semiconductor and CHERIoT Contributors.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+#include <function_wrapper.hh>
+#include <mqtt.h>
+#include <string_view>
+
+/**
+ * Where to deliver the PUBLISH notifications that match a filter.
+ */
+struct TopicSubscription
+{
+	/// The callback to invoke, or null to write the publish to the ring.
+	MQTTPublishCallback callback;
+	/// The topic ID to record in the ring, if there is no callback.
+	uint16_t topicId;
+};
+
+/**
+ * Per-subscription PUBLISH destinations, indexed by topic filter.
+ *
+ * Filters are stored as a trie with one node per topic level, so a topic is
+ * matched against all of the filters in a single walk over its levels.  The
+ * `+` and `#` wildcards are nodes like any other, which are followed in
+ * addition to the literal match.  Each node is a single allocation holding
+ * the level's name, and siblings are kept in a linked list, which is compact
+ * for the small numbers of subscriptions that embedded clients have.
+ *
+ * This is used only within the MQTT compartment and must be protected by the
+ * connection's lock.  Nodes are allocated with the allocator passed to
+ * `insert` and must be freed with the same allocator.
+ */
+class TopicTrie
+{
+	struct Node;
+
+	/// The nodes for the first level of all filters.
+	Node *root = nullptr;
+
+	/**
+	 * Set while `match` is running.  Callbacks may unsubscribe, so nodes are
+	 * not freed while this is set.
+	 */
+	bool dispatching = false;
+
+	/**
+	 * Set if nodes stopped leading to a subscription while `dispatching` was
+	 * set, so that `match` frees them once it has finished.
+	 */
+	bool prunePending = false;
+
+	/**
+	 * Free the nodes at the end of `path` (an array of `depth` pointers to
+	 * the links to the nodes for each level of a filter) that no longer lead
+	 * to a subscription.
+	 */
+	void prune(SObj allocator, Node **path[], size_t depth);
+
+	/**
+	 * Free all of the nodes in the list starting at `*link`, and their
+	 * descendants, that do not lead to a subscription.
+	 */
+	static void prune_all(SObj allocator, Node **link);
+
+	/**
+	 * Invoke `visit` on the subscriptions of the nodes in `children` that
+	 * match `topic`, the levels of the topic that remain to be matched.
+	 * Returns the number of subscriptions visited.
+	 */
+	static size_t
+	match(const Node                                      *children,
+	      std::string_view                                 topic,
+	      bool                                             isFirstLevel,
+	      FunctionWrapper<void(const TopicSubscription &)> &visit);
+
+	/// Free all of the nodes in `children` and their descendants.
+	static void clear(SObj allocator, Node *children);
+
+	public:
+	/**
+	 * The maximum number of levels in a filter.  This bounds the recursion
+	 * depth of `match`.
+	 */
+	static constexpr size_t MaxFilterLevels = 16;
+
+	/**
+	 * Register `subscription` for `filter`, replacing any subscription
+	 * registered for the same filter.  Returns zero on success, `-EINVAL` if
+	 * `filter` is not a valid filter or is too deep, or `-ENOMEM` if
+	 * allocation failed.
+	 */
+	int insert(Timeout                 *t,
+	           SObj                     allocator,
+	           std::string_view         filter,
+	           const TopicSubscription &subscription);
+
+	/**
+	 * Remove the subscription registered for `filter`, if any.  Returns true
+	 * if there was one.
+	 */
+	bool remove(SObj allocator, std::string_view filter);
+
+	/**
+	 * Returns the subscription registered for `filter`, or null if there is
+	 * none.  The result is valid until the trie is next modified.
+	 */
+	const TopicSubscription *find(std::string_view filter) const;
+
+	/**
+	 * Invoke `visit` with the subscription of each filter that matches
+	 * `topic`.  Returns the number of matching filters.  Nodes that `visit`
+	 * removes are freed, with `allocator`, once all of the matching
+	 * subscriptions have been visited.
+	 */
+	size_t match(SObj                                            allocator,
+	             std::string_view                                topic,
+	             FunctionWrapper<void(const TopicSubscription &)> visit);
+
+	/// Free all of the nodes.
+	void clear(SObj allocator);
+};
@@ -11,9 +11,11 @@
  */
 #define MALLOC_QUOTA (16 * 1024)
 
+#include "synchronised-time.hh"
 #include <FreeRTOS-Compat/FreeRTOS.h>
 #include <NetAPI.h>
 #include <algorithm>
+#include <array>
 #include <cheri.hh>
 #include <core_sntp_client.h>
 #include <core_sntp_config.h>
@@ -22,7 +24,9 @@
 #include <locks.hh>
 #include <sntp.h>
 #include <stdlib.h>
+#include <string_view>
 #include <tick_macros.h>
+#include <utility>
 
 using CHERI::Capability;
 
@@ -31,12 +35,26 @@ using Debug = ConditionalDebug<false, "NTP Client">;
 #include <platform-entropy.hh>
 
 /**
- * Capability for pool.ntp.org.
+ * Capabilities for the NTP servers.  Each of the pool.ntp.org names resolves to
+ * a different set of servers, so each update samples several servers.  The
+ * names must match `ServerNames`.
  *
- * Note: In real use, this should be an NTP server controlled by the user.
+ * Note: In real use, these should be NTP servers controlled by the user.
  */
-DECLARE_AND_DEFINE_CONNECTION_CAPABILITY(NtpPool,
-                                         "pool.ntp.org",
+DECLARE_AND_DEFINE_CONNECTION_CAPABILITY(NtpPool0,
+                                         "0.pool.ntp.org",
+                                         123,
+                                         ConnectionType::ConnectionTypeUDP);
+DECLARE_AND_DEFINE_CONNECTION_CAPABILITY(NtpPool1,
+                                         "1.pool.ntp.org",
+                                         123,
+                                         ConnectionType::ConnectionTypeUDP);
+DECLARE_AND_DEFINE_CONNECTION_CAPABILITY(NtpPool2,
+                                         "2.pool.ntp.org",
+                                         123,
+                                         ConnectionType::ConnectionTypeUDP);
+DECLARE_AND_DEFINE_CONNECTION_CAPABILITY(NtpPool3,
+                                         "3.pool.ntp.org",
                                          123,
                                          ConnectionType::ConnectionTypeUDP);
 
@@ -56,45 +74,205 @@ namespace
 		return rng();
 	}
 
+	/// The number of NTP servers sampled by each update.
+	constexpr size_t ServerCount = 4;
+	/// The names of the NTP servers, which must match the capabilities.
+	constexpr std::array<std::string_view, ServerCount> ServerNames = {
+	  "0.pool.ntp.org",
+	  "1.pool.ntp.org",
+	  "2.pool.ntp.org",
+	  "3.pool.ntp.org"};
+	/// The number of samples taken from each server in an update.
+	constexpr size_t SamplesPerServer = 4;
+	/**
+	 * The minimum interval between samples from the same server.  Public
+	 * servers send a kiss-o'-death packet to clients that poll more often.
+	 */
+	constexpr Ticks SampleSpacing = MS_TO_TICKS(2000);
+	/// How long to wait for the response to each request.
+	constexpr Ticks SampleTimeout = MS_TO_TICKS(1000);
+	/**
+	 * Added to half of the round-trip delay of a sample to bound its error,
+	 * to allow for the precision of the server's clock and of ours.
+	 */
+	constexpr int64_t SampleDispersionMicroseconds = 1000;
+	/// Servers that miss this many consecutive samples are re-resolved.
+	constexpr uint32_t MaximumConsecutiveFailures = SamplesPerServer;
+	/**
+	 * How long the server addresses are used before they are resolved again,
+	 * to follow changes to the pool.  The DNS compartment does not report
+	 * record TTLs, so this is fixed.
+	 */
+	constexpr uint64_t SessionLifetimeSeconds = 24 * 60 * 60;
+
+	/**
+	 * The state of one server.
+	 */
+	struct Server
+	{
+		/// The server's IPv4 address, or zero if it is not being sampled.
+		uint32_t address;
+		/// The number of consecutive samples that the server did not answer.
+		uint32_t failures;
+		/**
+		 * True if the server stopped answering or sent a kiss-o'-death, so
+		 * the session should be recreated to resolve its name again.  Names
+		 * that did not resolve are retried only when the session expires.
+		 */
+		bool dropped;
+		/// The number of samples received from the server in this update.
+		uint32_t samples;
+		/**
+		 * The offset of the server's time from our clock, in microseconds,
+		 * measured by the sample with the lowest round-trip delay.
+		 */
+		int64_t offset;
+		/// The round-trip delay of that sample, in microseconds.
+		int64_t delay;
+		/// The cycle count at which that sample was taken.
+		uint64_t cycles;
+	};
+
 	/**
 	 * We do the DNS lookup on socket creation because the coreSNTP library
 	 * does not provide a context to the callback for the DNS lookup.  The
-	 * result is stored here so that it can be returned in `ntp_dns_resolve`.
+	 * address of the server being sampled is stored here so that it can be
+	 * returned in `ntp_dns_resolve`.
 	 */
 	uint32_t nextAddress;
 
 	/**
-	 * Create a socket and authorise it to connect to the NTP pool.
+	 * Lock serialising updates.  This protects the session, the samples and
+	 * `discipline`.
+	 */
+	FlagLockPriorityInherited updateLock;
+
+	/**
+	 * The socket and the addresses of the servers that it is authorised to
+	 * talk to.  These are kept across updates, so that periodic updates do
+	 * not pay for DNS lookups and firewall changes each time, until a server
+	 * stops answering or `SessionLifetimeSeconds` have passed.  Protected by
+	 * `updateLock`.
+	 */
+	struct
+	{
+		/// The socket, or null if there is no session.
+		SObj socket;
+		/// The servers, with the addresses that the socket is authorised for.
+		std::array<Server, ServerCount> servers;
+		/// The cycle count at which the session was created.
+		uint64_t createdCycles;
+	} session;
+
+	/**
+	 * Close the session's socket, which also removes its firewall entries.
 	 */
-	int socket_create(NetworkContext *context)
+	void session_close()
+	{
+		if (session.socket == nullptr)
+		{
+			return;
+		}
+		Timeout t{UnlimitedTimeout};
+		network_socket_close(&t, MALLOC_CAPABILITY, session.socket);
+		Debug::log("Closed NTP socket {}", session.socket);
+		session.socket = nullptr;
+	}
+
+	/**
+	 * Returns true if the session must be recreated before the next update:
+	 * if there is none, if it is too old, or if a server has stopped
+	 * answering.  Servers whose names did not resolve do not make the session
+	 * stale, so that a name that never resolves does not force a new socket
+	 * and DNS lookups on every update.
+	 */
+	bool session_is_stale()
+	{
+		if (session.socket == nullptr)
+		{
+			return true;
+		}
+		if (rdcycle64() - session.createdCycles >
+		    SessionLifetimeSeconds * CPU_TIMER_HZ)
+		{
+			return true;
+		}
+		return std::any_of(
+		  session.servers.begin(),
+		  session.servers.end(),
+		  [](const Server &server) { return server.dropped; });
+	}
+
+	/**
+	 * Create a socket and authorise it to connect to the NTP servers.  The
+	 * addresses of the servers are recorded in `session`.  Fails if none of
+	 * them can be resolved.
+	 */
+	int session_open(Timeout *timeout)
 	{
 		Debug::log("Creating socket with malloc capability: {}",
 		           MALLOC_CAPABILITY);
-		SObj socket =
-		  network_socket_udp(context->timeout, MALLOC_CAPABILITY, false);
+		SObj socket = network_socket_udp(timeout, MALLOC_CAPABILITY, false);
 		Debug::log("Created socket {}", socket);
 		if (!Capability{socket}.is_valid())
 		{
 			return -ETIMEDOUT;
 		}
-		auto address = network_socket_udp_authorise_host(
-		  context->timeout, socket, STATIC_SEALED_VALUE(NtpPool));
-		if (address.kind == NetworkAddress::AddressKindInvalid)
+		std::array<SObj, ServerCount> capabilities = {
+		  STATIC_SEALED_VALUE(NtpPool0),
+		  STATIC_SEALED_VALUE(NtpPool1),
+		  STATIC_SEALED_VALUE(NtpPool2),
+		  STATIC_SEALED_VALUE(NtpPool3)};
+		session.servers = {};
+		size_t resolved = 0;
+		for (size_t i = 0; i < ServerCount; i++)
 		{
-			Timeout unlimited{UnlimitedTimeout};
-			network_socket_close(&unlimited, MALLOC_CAPABILITY, socket);
-			context->timeout->elapse(unlimited.elapsed);
+			auto address = network_socket_udp_authorise_host(
+			  timeout, socket, capabilities[i]);
+			if (address.kind == NetworkAddress::AddressKindInvalid)
+			{
+				Debug::log("Failed to resolve {}", ServerNames[i]);
+				continue;
+			}
+			Debug::log("Authorised UDP socket to connect to {}",
+			           ServerNames[i]);
+			session.servers[i].address = address.ipv4;
+			resolved++;
+		}
+		session.socket = socket;
+		if (resolved == 0)
+		{
+			session_close();
 			return -ENOTCONN;
 		}
-		Debug::log("Authorised UDP socket to connect to ntp.pool.org");
-		nextAddress     = address.ipv4;
-		context->socket = socket;
+		session.createdCycles = rdcycle64();
 		return 0;
 	}
 
+	/**
+	 * Discard any responses that arrived after their request timed out, so
+	 * that they are not mistaken for responses to new requests.
+	 */
+	void session_drain()
+	{
+		while (true)
+		{
+			Timeout        t{0};
+			NetworkAddress address;
+			uint16_t       port;
+			auto           result = network_socket_receive_from(
+			  &t, MALLOC_CAPABILITY, session.socket, &address, &port);
+			if (result.bytesReceived <= 0)
+			{
+				return;
+			}
+			free(result.buffer);
+		}
+	}
+
 	/**
 	 * DNS resolutor callback.  Returns the value looked up during socket
-	 * creation.
+	 * creation for the server being sampled.
 	 */
 	bool ntp_dns_resolve(const SntpServerInfo_t *, uint32_t *outAddress)
 	{
@@ -107,6 +285,12 @@ namespace
 	 */
 	uint64_t ntpRequestStart;
 
+	/**
+	 * The cycle count at which the NTP response was returned by the network
+	 * stack.
+	 */
+	uint64_t ntpResponseReceived;
+
 	/**
 	 * Callback to send a UDP packet.
 	 */
@@ -135,40 +319,15 @@ namespace
 	}
 
 	/**
-	 * Callback to receive a UDP packet.  This should filter on sender address,
-	 * but we rely on the firewall dropping all packets other than the ones
-	 * from our authorised NTP server.
+	 * Callback to receive a UDP packet.  coreSNTP requires one, but it is
+	 * never called: `response_receive` receives the responses instead.
 	 */
-	int32_t ntp_udp_receive(NetworkContext_t *pNetworkContext,
+	int32_t ntp_udp_receive(NetworkContext_t *,
 	                        uint32_t,
 	                        uint16_t,
-	                        void    *pBuffer,
-	                        uint16_t bytesToRecv)
-	{
-		NetworkAddress address;
-		uint16_t       port;
-		auto result = network_socket_receive_from(pNetworkContext->timeout,
-		                                          MALLOC_CAPABILITY,
-		                                          pNetworkContext->socket,
-		                                          &address,
-		                                          &port);
-		if (result.bytesReceived > 0)
-		{
-			Debug::log("Received {} bytes, copying {} bytes from {} into "
-			           "{}-byte buffer {}",
-			           result.bytesReceived,
-			           std::min<size_t>(result.bytesReceived, bytesToRecv),
-			           result.buffer,
-			           bytesToRecv,
-			           pBuffer);
-			// This copy is annoying but the API doesn't let us do the zero-copy
-			// thing.
-			size_t bytesReceived =
-			  std::min<size_t>(result.bytesReceived, bytesToRecv);
-			memcpy(pBuffer, result.buffer, bytesReceived);
-			free(result.buffer);
-			return bytesReceived;
-		}
+	                        void *,
+	                        uint16_t)
+	{
 		return 0;
 	}
 
@@ -209,43 +368,259 @@ namespace
 	/// NTP era, used to handle 32-bit overflow in NTP timestamps.
 	uint32_t ntpEra = epoch_year_approximate() >> 32;
 
+	/// The shortest interval between polls in `sntp_discipline`.
+	constexpr uint32_t MinimumPollSeconds = 64;
+	/// The longest interval between polls in `sntp_discipline`.
+	constexpr uint32_t MaximumPollSeconds = 1024;
+	/// Offsets larger than this step the clock instead of slewing it.
+	constexpr int64_t StepThresholdMicroseconds = 128000;
+	/// The largest frequency or slew correction (500 ppm, as for `adjtime`).
+	constexpr int64_t MaximumCorrectionPpb = 500000;
+	/// Offsets below this let the poll interval grow.
+	constexpr int64_t SmallOffsetMicroseconds = 1000;
+	/// Offsets above this make the poll interval shrink.
+	constexpr int64_t LargeOffsetMicroseconds = 8000;
+	/// The number of consecutive small offsets before the interval grows.
+	constexpr uint32_t PollIncreaseThreshold = 4;
 	/**
-	 * Convert an NTP timestamp to a POSIX timeval.
+	 * Each frequency error measured between two polls moves the frequency
+	 * estimate by the error divided by this, which filters out network
+	 * jitter.
 	 */
-	constexpr struct timeval ntp_date_to_timeval(SynchronisedTime &cache,
-	                                             SntpTimestamp_t currentNTPTime,
-	                                             uint32_t        era)
+	constexpr int64_t FrequencyGainDivisor = 4;
+
+	/**
+	 * The server time in the last response, the cycle count at which it was
+	 * (approximately) correct, and the round-trip time of the request.
+	 */
+	struct
+	{
+		SntpTimestamp_t serverTime;
+		uint64_t        cycles;
+		uint64_t        delayCycles;
+	} lastSample;
+
+	/**
+	 * The state of the clock discipline, protected by `updateLock`.
+	 */
+	struct
+	{
+		/// True once the clock has been set from NTP.
+		bool isSynchronised;
+		/// The cycle count of the last sample used to update the clock.
+		uint64_t lastSampleCycles;
+		/// The current interval between polls.
+		uint32_t pollSeconds = MinimumPollSeconds;
+		/// The number of consecutive polls with a small offset.
+		uint32_t smallOffsets;
+		/// The cycle count at which `sntp_discipline` should next poll.
+		uint64_t nextPollCycles;
+	} discipline;
+
+	/**
+	 * Convert an NTP timestamp to microseconds since the UNIX epoch.
+	 */
+	int64_t ntp_to_unix_microseconds(SntpTimestamp_t ntpTime, uint32_t era)
 	{
-		timeval tv;
 		// Seconds promoted to 64 bits, still relative to the NTP epoch.
-		int64_t seconds = currentNTPTime.seconds;
+		int64_t seconds = ntpTime.seconds;
 		// Seconds now relative to UNIX epoch
 		seconds -= SNTP_TIME_AT_UNIX_EPOCH_SECS;
 		// NTP dates roll over every 136 years, so we need to add the era
 		seconds += uint64_t(era) << 32;
-		cache.seconds = seconds;
-		cache.microseconds =
-		  currentNTPTime.fractions / SNTP_FRACTION_VALUE_PER_MICROSECOND;
-		return tv;
+		return (seconds * 1000000) +
+		       (ntpTime.fractions / SNTP_FRACTION_VALUE_PER_MICROSECOND);
 	}
 
 	/**
-	 * Update the current UNIX time to reflect the last cached NTP time.
+	 * Returns the writeable view of the synchronised time.
 	 */
-	void unix_time_update(uint64_t cycles)
+	SynchronisedTime &synchronised_time()
 	{
-		auto &currentUNIXTime = *SHARED_OBJECT_WITH_PERMISSIONS(
+		return *SHARED_OBJECT_WITH_PERMISSIONS(
 		  SynchronisedTime, sntp_time_at_last_sync, true, true, false, false);
+	}
+
+	/**
+	 * Returns the time, in whole seconds and nanoseconds since the UNIX
+	 * epoch, that the clock shows at the cycle count `cycles`.  Only this
+	 * compartment writes the synchronised time, so this does not need to
+	 * check the epoch.
+	 */
+	std::pair<time_t, uint32_t> clock_read_precise(uint64_t cycles)
+	{
+		auto    &time = synchronised_time();
+		uint64_t nanoseconds =
+		  time.nanoseconds +
+		  synchronised_time_elapsed(cycles - time.cycles,
+		                            time.slewCycles,
+		                            time.slewNanosecondsPerCycle,
+		                            time.slewNanoseconds,
+		                            time.nanosecondsPerCycle);
+		return {time.seconds + time_t(nanoseconds / 1000000000),
+		        uint32_t(nanoseconds % 1000000000)};
+	}
+
+	/**
+	 * Returns the time, in microseconds since the UNIX epoch, that the clock
+	 * shows at the cycle count `cycles`.
+	 */
+	int64_t clock_read(uint64_t cycles)
+	{
+		auto [seconds, nanoseconds] = clock_read_precise(cycles);
+		return (int64_t(seconds) * 1000000) + (nanoseconds / 1000);
+	}
+
+	/**
+	 * Set the clock to show `seconds` and `nanoseconds` since the UNIX epoch
+	 * at the cycle count `cycles`, and to advance from there with the given
+	 * corrections.
+	 */
+	void clock_set(uint64_t cycles,
+	               time_t   seconds,
+	               uint32_t nanoseconds,
+	               int32_t  frequencyPpb,
+	               int32_t  slewPpb,
+	               uint64_t slewCycles)
+	{
+		auto &currentUNIXTime = synchronised_time();
 		Debug::log("Updating UNIX time");
-		Debug::log(
-		  "Current time: {}.{}", currentTime.seconds, currentTime.fractions);
 		currentUNIXTime.updatingEpoch++;
-		ntp_date_to_timeval(currentUNIXTime, currentTime, ntpEra);
+		currentUNIXTime.cycles       = cycles;
+		currentUNIXTime.seconds      = seconds;
+		currentUNIXTime.nanoseconds  = nanoseconds;
+		currentUNIXTime.frequencyPpb = frequencyPpb;
+		currentUNIXTime.slewPpb      = slewPpb;
+		currentUNIXTime.slewCycles   = slewCycles;
+		// Precompute the rates, so that readers do not need to divide.
+		currentUNIXTime.slewNanosecondsPerCycle =
+		  nanoseconds_per_cycle(int64_t(frequencyPpb) + slewPpb);
+		currentUNIXTime.slewNanoseconds = fixed_point_multiply(
+		  slewCycles, currentUNIXTime.slewNanosecondsPerCycle);
+		currentUNIXTime.nanosecondsPerCycle =
+		  nanoseconds_per_cycle(frequencyPpb);
 		currentUNIXTime.updatingEpoch++;
-		Debug::log("Updated UNIX time");
-		Debug::log("Current UNIX time: {}.{}",
+		// Wake any readers that saw the update in progress.
+		currentUNIXTime.updatingEpoch.notify_all();
+		Debug::log("Current UNIX time: {}.{}, frequency {} ppb",
 		           static_cast<uint64_t>(currentUNIXTime.seconds),
-		           currentUNIXTime.microseconds);
+		           currentUNIXTime.nanoseconds,
+		           frequencyPpb);
+	}
+
+	/**
+	 * Update the poll interval after a poll that measured `offset`
+	 * microseconds.  The interval grows while the offsets stay small, because
+	 * the frequency correction is then good enough to keep the clock accurate
+	 * for longer, and shrinks when they grow.
+	 */
+	void poll_interval_update(int64_t offset)
+	{
+		int64_t magnitude = (offset < 0) ? -offset : offset;
+		if (magnitude < SmallOffsetMicroseconds)
+		{
+			if ((++discipline.smallOffsets >= PollIncreaseThreshold) &&
+			    (discipline.pollSeconds < MaximumPollSeconds))
+			{
+				discipline.pollSeconds *= 2;
+				discipline.smallOffsets = 0;
+			}
+			return;
+		}
+		discipline.smallOffsets = 0;
+		if ((magnitude > LargeOffsetMicroseconds) &&
+		    (discipline.pollSeconds > MinimumPollSeconds))
+		{
+			discipline.pollSeconds /= 2;
+		}
+	}
+
+	/**
+	 * Update the clock, given that the server's time was `offset`
+	 * microseconds ahead of it at the cycle count `cycles`.
+	 *
+	 * If `slew` is false, if the clock has not been set yet, or if the offset
+	 * is too large, the clock is stepped to the server's time.  Otherwise,
+	 * the offset is used to refine the frequency estimate and is slewed out
+	 * over the next poll interval, and the poll interval is adapted.
+	 */
+	void clock_update(int64_t offset, uint64_t cycles, bool slew)
+	{
+		auto   &time       = synchronised_time();
+		int64_t localTime  = clock_read(cycles);
+		int64_t serverTime = localTime + offset;
+		int64_t frequency  = time.frequencyPpb;
+		Debug::log("Clock offset: {} us", offset);
+		if (!slew || !discipline.isSynchronised ||
+		    (offset > StepThresholdMicroseconds) ||
+		    (offset < -StepThresholdMicroseconds))
+		{
+			clock_set(cycles,
+			          serverTime / 1000000,
+			          (serverTime % 1000000) * 1000,
+			          time.frequencyPpb,
+			          0,
+			          0);
+			discipline.isSynchronised   = true;
+			discipline.lastSampleCycles = cycles;
+			discipline.pollSeconds      = MinimumPollSeconds;
+			discipline.smallOffsets     = 0;
+			return;
+		}
+		// The offset includes the part of the previous slew that has not been
+		// applied yet, which is not a frequency error.
+		uint64_t sinceSync = cycles - time.cycles;
+		int64_t  pending   = 0;
+		if (sinceSync < time.slewCycles)
+		{
+			uint64_t remaining = time.slewCycles - sinceSync;
+			pending = int64_t(cycles_to_microseconds(remaining) / 1000) *
+			          time.slewPpb / 1000000;
+		}
+		// Samples close together mostly measure network jitter, so only use
+		// ones about a poll interval apart to estimate the frequency.
+		int64_t interval =
+		  cycles_to_microseconds(cycles - discipline.lastSampleCycles);
+		if (interval >= int64_t(MinimumPollSeconds) * 1000000 / 2)
+		{
+			int64_t error = (offset - pending) * 1000000000 / interval;
+			frequency += error / FrequencyGainDivisor;
+			frequency = std::clamp(
+			  frequency, -MaximumCorrectionPpb, MaximumCorrectionPpb);
+		}
+		// Rebase the clock now rather than at the sample, which may be a
+		// whole burst in the past: the new rates would otherwise apply
+		// retroactively and readers would see the clock jump.  The offset is
+		// carried forward by assuming that the server's clock has advanced
+		// at our corrected rate since the sample.
+		uint64_t now     = rdcycle64();
+		int64_t  elapsed = cycles_to_microseconds(now - cycles);
+		auto [nowSeconds, nowNanoseconds] = clock_read_precise(now);
+		int64_t nowTime =
+		  int64_t(nowSeconds) * 1000000 + nowNanoseconds / 1000;
+		int64_t nowOffset =
+		  serverTime + elapsed + elapsed * frequency / 1000000000 - nowTime;
+		// Remove the offset over the next poll interval, or more slowly if
+		// that would need more than the maximum correction.
+		int64_t slewMicroseconds = int64_t(discipline.pollSeconds) * 1000000;
+		int64_t slewPpb          = nowOffset * 1000000000 / slewMicroseconds;
+		if ((slewPpb > MaximumCorrectionPpb) ||
+		    (slewPpb < -MaximumCorrectionPpb))
+		{
+			slewPpb =
+			  (nowOffset < 0) ? -MaximumCorrectionPpb : MaximumCorrectionPpb;
+			slewMicroseconds = nowOffset * 1000000000 / slewPpb;
+		}
+		uint64_t slewCycles =
+		  uint64_t(slewMicroseconds) * CPU_TIMER_HZ / 1000000;
+		clock_set(now,
+		          nowSeconds,
+		          nowNanoseconds,
+		          static_cast<int32_t>(frequency),
+		          static_cast<int32_t>(slewPpb),
+		          slewCycles);
+		discipline.lastSampleCycles = cycles;
+		poll_interval_update(offset);
 	}
 
 	/**
@@ -294,14 +669,15 @@ namespace
 	}
 
 	/**
-	 * Callback to set the current time after an NTP response.
+	 * Callback to set the current time after an NTP response.  This records
+	 * the sample, which `ntp_time_update` then applies to the clock.
 	 */
 	void ntp_time_set(const SntpServerInfo_t *pTimeServer,
 	                  const SntpTimestamp_t  *pServerTime,
 	                  int64_t                 clockOffsetMs,
 	                  SntpLeapSecondInfo_t    leapSecondInfo)
 	{
-		auto ntpRequestEnd = rdcycle64();
+		auto ntpRequestEnd = ntpResponseReceived;
 		Debug::log("NTP request took {} cycles",
 		           ntpRequestEnd - ntpRequestStart);
 		Debug::log(
@@ -314,136 +690,417 @@ namespace
 		// backwards) around the rollover point, so we need to handle the era
 		// going down by one as well as up.
 
-		currentTime.seconds = 0;
 		// As a very rough approximation, assume that the server time is
 		// accurate at the midway point of the request.
-		uint64_t cycleTime =
+		lastSample.cycles =
 		  ntpRequestStart + ((ntpRequestEnd - ntpRequestStart) / 2);
-		currentTime = *pServerTime;
-		unix_time_update(cycleTime);
+		lastSample.delayCycles = ntpRequestEnd - ntpRequestStart;
+		lastSample.serverTime  = *pServerTime;
+		currentTime           = *pServerTime;
+	}
+
+	/**
+	 * Wait for the response to the request sent with `context` and pass it to
+	 * `ntp_time_set`.  This replaces `Sntp_ReceiveTimeResponse`, which needs
+	 * the response to be copied into coreSNTP's buffer: the buffer that the
+	 * network stack returns is parsed in place.  The response is timestamped
+	 * as soon as the network stack returns it, before it is parsed.  Returns
+	 * a coreSNTP status.
+	 */
+	SntpStatus_t response_receive(Timeout          *timeout,
+	                              SntpContext_t    *context,
+	                              NetworkContext_t *networkContext)
+	{
+		while (true)
+		{
+			NetworkAddress address;
+			uint16_t       port;
+			auto result = network_socket_receive_from(timeout,
+			                                          MALLOC_CAPABILITY,
+			                                          networkContext->socket,
+			                                          &address,
+			                                          &port);
+			uint64_t received = rdcycle64();
+			if (result.bytesReceived <= 0)
+			{
+				if ((result.bytesReceived == 0) && timeout->may_block())
+				{
+					continue;
+				}
+				return ((result.bytesReceived == 0) ||
+				        (result.bytesReceived == -ETIMEDOUT))
+				         ? SntpErrorResponseTimeout
+				         : SntpErrorNetworkFailure;
+			}
+			// The socket is authorised for all of the servers, so late
+			// responses from other servers can arrive here.
+			if (address.ipv4 != context->currentServerAddr)
+			{
+				Debug::log("Dropping a packet from another server");
+				free(result.buffer);
+				continue;
+			}
+			if (result.bytesReceived < SNTP_PACKET_BASE_SIZE)
+			{
+				Debug::log("Dropping a {}-byte packet", result.bytesReceived);
+				free(result.buffer);
+				continue;
+			}
+			SntpTimestamp_t receiveTime;
+			ntp_time_get(&receiveTime);
+			SntpResponseData_t response;
+			SntpStatus_t       status =
+			  Sntp_DeserializeResponse(&context->lastRequestTime,
+			                           &receiveTime,
+			                           result.buffer,
+			                           result.bytesReceived,
+			                           &response);
+			free(result.buffer);
+			if (status == SntpSuccess)
+			{
+				ntpResponseReceived = received;
+				ntp_time_set(
+				  &context->pTimeServers[context->currentServerIndex],
+				  &response.serverTime,
+				  response.clockOffsetMs,
+				  response.leapSecondType);
+			}
+			return status;
+		}
+	}
+
+	/**
+	 * Take one sample from `server`, whose address is `address`, and record it
+	 * in `lastSample`.  Returns zero on success or a negative error code.
+	 */
+	int sample_take(Timeout                 *timeout,
+	                SntpServerInfo_t        *server,
+	                uint32_t                 address,
+	                uint8_t                 *buffer,
+	                UdpTransportInterface_t *transport)
+	{
+		nextAddress = address;
+		SntpContext_t context;
+		SntpStatus_t  status = Sntp_Init(&context,
+		                                 server,
+		                                 1,
+		                                 2000 /* timeout in MS */,
+		                                 buffer,
+		                                 SNTP_PACKET_BASE_SIZE,
+		                                 ntp_dns_resolve,
+		                                 ntp_time_get,
+		                                 ntp_time_set,
+		                                 transport,
+		                                 NULL);
+		if (status != SntpSuccess)
+		{
+			Debug::log("Failed to initialize SNTP client: {}", status);
+			return ntp_error_to_errno(status);
+		}
+
+		status = Sntp_SendTimeRequest(&context, rand(), 1000);
+		if (status != SntpSuccess)
+		{
+			Debug::log("Failed to send SNTP request: {}", status);
+			return ntp_error_to_errno(status);
+		}
+
+		status = response_receive(
+		  timeout,
+		  &context,
+		  static_cast<NetworkContext_t *>(transport->pUserContext));
+		if (status != SntpSuccess)
+		{
+			Debug::log("Failed to receive SNTP time response: {}", status);
+		}
+		return ntp_error_to_errno(status);
+	}
+
+	/**
+	 * Add the sample in `lastSample` to `server`.  This is the NTP clock
+	 * filter, simplified for a burst of samples: only the sample with the
+	 * lowest round-trip delay is kept, because its offset has the smallest
+	 * possible error from asymmetric delays.
+	 */
+	void sample_record(Server &server)
+	{
+		int64_t delay = cycles_to_microseconds(lastSample.delayCycles);
+		if ((server.samples++ > 0) && (delay >= server.delay))
+		{
+			return;
+		}
+		server.offset =
+		  ntp_to_unix_microseconds(lastSample.serverTime, ntpEra) -
+		  clock_read(lastSample.cycles);
+		server.delay  = delay;
+		server.cycles = lastSample.cycles;
+	}
+
+	/**
+	 * Combine the samples of the servers that agree with each other.
+	 *
+	 * The true time lies within half the round-trip delay (plus a dispersion)
+	 * of each correct server's offset.  Marzullo's algorithm, as in NTP's
+	 * selection algorithm, finds the intersection of the largest number of
+	 * these intervals.  Servers whose intervals do not contain it are
+	 * rejected as falsetickers, and the others are combined, weighted by the
+	 * inverse of their errors, into `offset` at the cycle count `cycles`.
+	 *
+	 * Returns false if no majority of the servers that answered agree.
+	 */
+	bool servers_select(const std::array<Server, ServerCount> &servers,
+	                    int64_t                               &offset,
+	                    uint64_t                              &cycles)
+	{
+		struct Edge
+		{
+			int64_t value;
+			/// +1 for the start of an interval, -1 for the end.
+			int type;
+		};
+		std::array<Edge, 2 * ServerCount> edges;
+		size_t                            edgeCount  = 0;
+		size_t                            candidates = 0;
+		auto distance = [](const Server &server) {
+			return server.delay / 2 + SampleDispersionMicroseconds;
+		};
+		for (auto &server : servers)
+		{
+			if (server.samples == 0)
+			{
+				continue;
+			}
+			edges[edgeCount++] = {server.offset - distance(server), 1};
+			edges[edgeCount++] = {server.offset + distance(server), -1};
+			candidates++;
+		}
+		if (candidates == 0)
+		{
+			return false;
+		}
+		// Starts sort before ends with the same value, so that intervals that
+		// touch count as overlapping.
+		std::sort(edges.begin(),
+		          edges.begin() + edgeCount,
+		          [](const Edge &a, const Edge &b) {
+			          return (a.value < b.value) ||
+			                 ((a.value == b.value) && (a.type > b.type));
+		          });
+		int     overlap = 0;
+		int     best    = 0;
+		int64_t low     = 0;
+		int64_t high    = 0;
+		for (size_t i = 0; i < edgeCount; i++)
+		{
+			overlap += edges[i].type;
+			if (overlap > best)
+			{
+				// This is a start, so there is at least one more edge.
+				best = overlap;
+				low  = edges[i].value;
+				high = edges[i + 1].value;
+			}
+		}
+		if (size_t(best) * 2 <= candidates)
+		{
+			Debug::log("Only {} of {} NTP servers agree", best, candidates);
+			return false;
+		}
+		auto isSurvivor = [&](const Server &server) {
+			return (server.samples > 0) &&
+			       (server.offset - distance(server) <= low) &&
+			       (server.offset + distance(server) >= high);
+		};
+		// Combine relative to the survivor with the lowest delay, so that the
+		// weighted sum cannot overflow even if the clock has never been set.
+		const Server *peer = nullptr;
+		for (auto &server : servers)
+		{
+			if (isSurvivor(server) &&
+			    ((peer == nullptr) || (server.delay < peer->delay)))
+			{
+				peer = &server;
+			}
+		}
+		int64_t weightedSum = 0;
+		int64_t totalWeight = 0;
+		for (auto &server : servers)
+		{
+			if (isSurvivor(server))
+			{
+				int64_t weight = 1000000 / distance(server);
+				weightedSum += weight * (server.offset - peer->offset);
+				totalWeight += weight;
+			}
+		}
+		offset = peer->offset + (weightedSum / totalWeight);
+		cycles = peer->cycles;
+		Debug::log("{} of {} NTP servers agree, offset {} us",
+		           best,
+		           candidates,
+		           offset);
+		return true;
 	}
 
 	/**
 	 * Update the current cached time from NTP.
 	 *
+	 * This takes a burst of samples, interleaved across the servers so that
+	 * no server is polled too often, until each server has provided
+	 * `SamplesPerServer` or the timeout expires.  The samples are then
+	 * filtered and combined with `sample_record` and `servers_select`.  If
+	 * `slew` is true, small offsets are slewed out and used to refine the
+	 * frequency estimate, otherwise the clock is stepped (see
+	 * `clock_update`).  A step does not need the lowest-delay sample of a
+	 * whole burst, so in that case the burst stops after the first round in
+	 * which a majority of the servers agree.
+	 *
 	 * FIXME: There should be a hook for integrators to use the authentication
 	 * API and provide their own time server.
+	 *
+	 * `updateLock` must be held.
 	 */
-	int ntp_time_update(Timeout *timeout)
+	int ntp_time_update_locked(Timeout *timeout, bool slew)
 	{
-		static FlagLockPriorityInherited lock;
-		NetworkContext                   udpContext{timeout, nullptr};
+		// The buffer for coreSNTP's packets, reused across updates.
+		static uint8_t buffer[SNTP_PACKET_BASE_SIZE];
+
+		if (session_is_stale())
 		{
-			if (LockGuard guard{lock, timeout})
+			session_close();
+			if (int ret = session_open(timeout); ret != 0)
 			{
-				// FIXME: Timeout on allocation
-				std::unique_ptr<uint8_t> buffer{
-				  new uint8_t[SNTP_PACKET_BASE_SIZE]};
+				return ret;
+			}
+		}
+		else
+		{
+			session_drain();
+		}
+		auto &servers = session.servers;
+		for (auto &server : servers)
+		{
+			server.samples = 0;
+		}
+		NetworkContext udpContext{timeout, session.socket};
 
-				if (int ret = socket_create(&udpContext); ret != 0)
-				{
-					return ret;
-				}
-				Debug::log("Created NTP socket {}", udpContext.socket);
-
-				/* Setup list of time servers. */
-				SntpServerInfo_t timeServers[] = {
-				  {.pServerName   = "pool.ntp.org",
-				   .serverNameLen = strlen("pool.ntp.org"),
-				   .port          = 123}};
-
-				/* Set the UDP transport interface object. */
-				UdpTransportInterface_t udpTransportIntf;
-
-				udpTransportIntf.pUserContext = &udpContext;
-				udpTransportIntf.sendTo       = ntp_udp_send;
-				udpTransportIntf.recvFrom     = ntp_udp_receive;
-
-				/* Context variable. */
-				SntpContext_t context;
-
-				/* Initialize context. */
-				SntpStatus_t status =
-				  Sntp_Init(&context,
-				            timeServers,
-				            sizeof(timeServers) / sizeof(SntpServerInfo_t),
-				            2000 /* timeout in MS */,
-				            buffer.get(),
-				            SNTP_PACKET_BASE_SIZE,
-				            ntp_dns_resolve,
-				            ntp_time_get,
-				            ntp_time_set,
-				            &udpTransportIntf,
-				            NULL);
-
-				if (status != SntpSuccess)
-				{
-					Debug::log("Failed to initialize SNTP client: {}", status);
-					Timeout t{UnlimitedTimeout};
-					network_socket_close(
-					  &t, MALLOC_CAPABILITY, udpContext.socket);
-					timeout->elapse(t.elapsed);
-					return ntp_error_to_errno(status);
-				}
+		/* Setup list of time servers. */
+		std::array<SntpServerInfo_t, ServerCount> timeServers;
+		for (size_t i = 0; i < ServerCount; i++)
+		{
+			timeServers[i] = {.pServerName   = ServerNames[i].data(),
+			                  .serverNameLen = ServerNames[i].size(),
+			                  .port          = 123};
+		}
+
+		/* Set the UDP transport interface object. */
+		UdpTransportInterface_t udpTransportIntf;
 
-				/* Loop of SNTP client for period time synchronization. */
-				/* @[code_example_sntp_send_receive] */
-				status = Sntp_SendTimeRequest(&context, rand(), 1000);
-				if (status != SntpSuccess)
+		udpTransportIntf.pUserContext = &udpContext;
+		udpTransportIntf.sendTo       = ntp_udp_send;
+		udpTransportIntf.recvFrom     = ntp_udp_receive;
+
+		int      lastError = -ETIMEDOUT;
+		size_t   samples   = 0;
+		bool     selected  = false;
+		int64_t  offset;
+		uint64_t cycles;
+		for (size_t round = 0;
+		     (round < SamplesPerServer) && timeout->may_block();
+		     round++)
+		{
+			Timeout spacing{SampleSpacing};
+			for (size_t i = 0; (i < ServerCount) && timeout->may_block(); i++)
+			{
+				Server &server = servers[i];
+				if (server.address == 0)
 				{
-					Debug::log("Failed to send SNTP request: {}", status);
-					Timeout t{UnlimitedTimeout};
-					network_socket_close(
-					  &t, MALLOC_CAPABILITY, udpContext.socket);
-					timeout->elapse(t.elapsed);
-					return ntp_error_to_errno(status);
+					continue;
 				}
-
-				SntpStatus_t lastStatus = SntpSuccess;
-				do
+				Timeout t{std::min(timeout->remaining, SampleTimeout)};
+				udpContext.timeout = &t;
+				int ret            = sample_take(&t,
+				                                 &timeServers[i],
+				                                 server.address,
+				                                 buffer,
+				                                 &udpTransportIntf);
+				timeout->elapse(t.elapsed);
+				spacing.elapse(t.elapsed);
+				if (ret != 0)
 				{
-					// `timeout` is updated through `context`.
-					status = Sntp_ReceiveTimeResponse(&context, 0);
-					if (status != lastStatus)
+					lastError = ret;
+					// Stop sampling servers that refuse to answer us or that
+					// seem to have gone away.  They will be resolved again
+					// (probably to a different server) at the next update.
+					if ((ret == -ECONNREFUSED) ||
+					    (++server.failures >= MaximumConsecutiveFailures))
 					{
-						Debug::log("SNTP receive status: {}", status);
-						lastStatus = status;
+						server.address = 0;
+						server.dropped = true;
 					}
-					if ((status == SntpNoResponseReceived) &&
-					    timeout->may_block())
-					{
-						Timeout t{MS_TO_TICKS(100)};
-						thread_sleep(&t);
-						timeout->elapse(t.elapsed);
-					}
-				} while (status == SntpNoResponseReceived &&
-				         timeout->may_block());
-
-				if (status != SntpSuccess)
+					continue;
+				}
+				server.failures = 0;
+				sample_record(server);
+				samples++;
+			}
+			if (!slew && (samples > 0))
+			{
+				selected = servers_select(servers, offset, cycles);
+				if (selected)
 				{
-					Debug::log("Failed to receive SNTP time response: {}",
-					           status);
-					Timeout t{UnlimitedTimeout};
-					network_socket_close(
-					  &t, MALLOC_CAPABILITY, udpContext.socket);
-					timeout->elapse(t.elapsed);
-					return ntp_error_to_errno(status);
+					break;
 				}
-
-				Debug::log("Received new time from NTP!");
 			}
-			else
+			// Wait before sampling the same servers again.
+			if ((round + 1 < SamplesPerServer) && spacing.may_block() &&
+			    timeout->may_block())
 			{
-				return -ETIMEDOUT;
+				Timeout t{std::min(timeout->remaining, spacing.remaining)};
+				thread_sleep(&t);
+				timeout->elapse(t.elapsed);
 			}
 		}
-		Timeout t{UnlimitedTimeout};
-		network_socket_close(&t, MALLOC_CAPABILITY, udpContext.socket);
-		timeout->elapse(t.elapsed);
-		Debug::log("Closed NTP socket {}", udpContext.socket);
+		if (samples == 0)
+		{
+			// The socket may no longer work (for example, if the network
+			// stack has been restarted), so start again next time.
+			session_close();
+			return lastError;
+		}
+		if (!selected && !servers_select(servers, offset, cycles))
+		{
+			return -ECONNREFUSED;
+		}
+		Debug::log("Received new time from NTP!");
+		clock_update(offset, cycles, slew);
 		return 0;
 	}
 
+	/**
+	 * Update the current cached time from NTP, as `ntp_time_update_locked`.
+	 * If `slew` is true, this also schedules the next poll of
+	 * `sntp_discipline`.
+	 */
+	int ntp_time_update(Timeout *timeout, bool slew)
+	{
+		LockGuard guard{updateLock, timeout};
+		if (!guard)
+		{
+			return -ETIMEDOUT;
+		}
+		int result = ntp_time_update_locked(timeout, slew);
+		if (slew)
+		{
+			// Retry failed polls after the minimum interval.
+			uint32_t interval =
+			  (result == 0) ? discipline.pollSeconds : MinimumPollSeconds;
+			discipline.nextPollCycles =
+			  rdcycle64() + uint64_t(interval) * CPU_TIMER_HZ;
+		}
+		return result;
+	}
+
 } // namespace
 
 int sntp_update(Timeout *timeout)
@@ -453,5 +1110,44 @@ int sntp_update(Timeout *timeout)
 		Debug::log("Invalid timeout pointer: {}", timeout);
 		return -EINVAL;
 	}
-	return ntp_time_update(timeout);
+	return ntp_time_update(timeout, false);
+}
+
+int sntp_discipline(Timeout *timeout)
+{
+	if (!check_timeout_pointer(timeout))
+	{
+		Debug::log("Invalid timeout pointer: {}", timeout);
+		return -EINVAL;
+	}
+	// Each poll gets at most this long, so that a lost packet does not block
+	// the loop for the whole timeout.
+	constexpr Ticks    PollTimeout   = MS_TO_TICKS(10000);
+	constexpr uint64_t CyclesPerTick = CPU_TIMER_HZ / 1000 * MS_PER_TICK;
+	int                result        = -ETIMEDOUT;
+	while (timeout->may_block())
+	{
+		uint64_t nextPoll;
+		if (LockGuard g{updateLock, timeout})
+		{
+			nextPoll = discipline.nextPollCycles;
+		}
+		else
+		{
+			break;
+		}
+		uint64_t now = rdcycle64();
+		if (now >= nextPoll)
+		{
+			Timeout t{std::min(timeout->remaining, PollTimeout)};
+			result = ntp_time_update(&t, true);
+			timeout->elapse(t.elapsed);
+			continue;
+		}
+		Ticks   ticks = (nextPoll - now) / CyclesPerTick + 1;
+		Timeout t{std::min(timeout->remaining, ticks)};
+		thread_sleep(&t);
+		timeout->elapse(t.elapsed);
+	}
+	return result;
 }
@@ -0,0 +1,125 @@
+// Copyright SCI Semiconductor and CHERIoT Contributors.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+#include <sntp.h>
+
+/**
+ * The nominal duration of a cycle, in 32.32 fixed-point nanoseconds.
+ */
+constexpr uint64_t NominalNanosecondsPerCycle =
+  (uint64_t(1000000000) << 32) / CPU_TIMER_HZ;
+
+/**
+ * The number of low bits of the cycle count that the coarse clocks ignore.
+ * This is chosen so that the coarse clocks have a resolution of about a
+ * millisecond.
+ */
+constexpr unsigned CoarseShift = []() {
+	unsigned shift = 0;
+	while ((uint64_t(2) << shift) <= CPU_TIMER_HZ / 1000)
+	{
+		shift++;
+	}
+	return shift;
+}();
+
+/**
+ * The number of low bits of a 32.32 fixed-point rate that the coarse clocks
+ * ignore.  This is the smallest shift that leaves the nominal rate in 31 bits,
+ * so that the shifted rate fits in 32 bits even with large corrections and
+ * still has a precision of about one part per billion.
+ */
+constexpr unsigned CoarseRateShift = []() {
+	unsigned shift = 0;
+	while ((NominalNanosecondsPerCycle >> shift) >= (uint64_t(1) << 31))
+	{
+		shift++;
+	}
+	return shift;
+}();
+
+static_assert(CoarseShift + CoarseRateShift <= 32,
+              "CPU_TIMER_HZ is too low for the coarse clocks");
+
+/**
+ * Convert a number of cycles to microseconds at the nominal `CPU_TIMER_HZ`.
+ */
+inline uint64_t cycles_to_microseconds(uint64_t cycles)
+{
+	if (CPU_TIMER_HZ / 1000000 > 0)
+	{
+		cycles /= CPU_TIMER_HZ / 1000000;
+	}
+	return cycles;
+}
+
+/**
+ * Returns the integer part of `cycles` multiplied by the 32.32 fixed-point
+ * `multiplier`.  The product is split into 32-bit halves, because there is
+ * no 128-bit multiplication on RV32, so this is four 32x32-bit multiplies.
+ */
+inline uint64_t fixed_point_multiply(uint64_t cycles, uint64_t multiplier)
+{
+	uint64_t cyclesHigh     = cycles >> 32;
+	uint64_t cyclesLow      = uint32_t(cycles);
+	uint64_t multiplierHigh = multiplier >> 32;
+	uint64_t multiplierLow  = uint32_t(multiplier);
+	return ((cyclesHigh * multiplierHigh) << 32) + (cyclesHigh * multiplierLow) +
+	       (cyclesLow * multiplierHigh) + ((cyclesLow * multiplierLow) >> 32);
+}
+
+/**
+ * Returns approximately `fixed_point_multiply(cycles, multiplier)`, with the
+ * low `CoarseShift` bits of `cycles` and the low `CoarseRateShift` bits of
+ * `multiplier` ignored.  This needs two 32x32-bit multiplies instead of four,
+ * and the remaining bits of `multiplier` keep the rate accurate to about one
+ * part per billion, so the coarse clocks lose resolution but do not drift
+ * from the precise ones.
+ */
+inline uint64_t coarse_multiply(uint64_t cycles, uint64_t multiplier)
+{
+	constexpr unsigned ProductShift = 32 - CoarseShift - CoarseRateShift;
+	uint64_t           coarse       = cycles >> CoarseShift;
+	uint64_t           rate         = uint32_t(multiplier >> CoarseRateShift);
+	uint64_t           coarseHigh   = coarse >> 32;
+	uint64_t           coarseLow    = uint32_t(coarse);
+	return ((coarseHigh * rate) << (32 - ProductShift)) +
+	       ((coarseLow * rate) >> ProductShift);
+}
+
+/**
+ * Returns the 32.32 fixed-point duration of a cycle when the cycle counter's
+ * nominal frequency is corrected by `correctionPpb` parts per billion.
+ */
+inline uint64_t nanoseconds_per_cycle(int64_t correctionPpb)
+{
+	return NominalNanosecondsPerCycle +
+	       (int64_t(NominalNanosecondsPerCycle) * correctionPpb) / 1000000000;
+}
+
+/**
+ * Returns the number of nanoseconds by which the clock described by a
+ * `SynchronisedTime` advances in `elapsedCycles` cycles after its
+ * synchronisation point, given its `slewCycles`, `slewNanosecondsPerCycle`,
+ * `slewNanoseconds`, and `nanosecondsPerCycle` fields.  `Multiply` is
+ * `fixed_point_multiply` or `coarse_multiply`.
+ */
+template<uint64_t (*Multiply)(uint64_t, uint64_t) = fixed_point_multiply>
+inline uint64_t synchronised_time_elapsed(uint64_t elapsedCycles,
+                                          uint64_t slewCycles,
+                                          uint64_t slewNanosecondsPerCycle,
+                                          uint64_t slewNanoseconds,
+                                          uint64_t nanosecondsPerCycle)
+{
+	if (elapsedCycles < slewCycles)
+	{
+		return Multiply(elapsedCycles, slewNanosecondsPerCycle);
+	}
+	if (nanosecondsPerCycle == 0)
+	{
+		nanosecondsPerCycle = NominalNanosecondsPerCycle;
+	}
+	return slewNanoseconds +
+	       Multiply(elapsedCycles - slewCycles, nanosecondsPerCycle);
+}
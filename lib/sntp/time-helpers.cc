@@ -1,6 +1,7 @@
 // Copyright SCI Semiconductor and CHERIoT Contributors.
 // SPDX-License-Identifier: MIT
 
+#include "synchronised-time.hh"
 #include <compartment-macros.h>
 #include <cstdint>
 #include <debug.hh>
@@ -10,48 +11,129 @@
 
 using Debug = ConditionalDebug<false, "Time helper">;
 
-int timeval_calculate(struct timeval *__restrict tp)
+namespace
 {
-	struct SynchronisedTime *sntpTime = SHARED_OBJECT_WITH_PERMISSIONS(
-	  SynchronisedTime, sntp_time_at_last_sync, true, false, false, false);
-	struct timeval time;
-	uint64_t       cycles;
-	uint32_t       epoch;
-	do
+	/**
+	 * 10^-9, rounded up, in 0.64 fixed point.  `fixed_point_multiply` by this
+	 * gives seconds in 32.32 fixed point, so shifting the result right by 32
+	 * divides by 10^9 (give or take one), without a 64-bit division, which
+	 * RV32 does in software.
+	 */
+	constexpr uint64_t SecondsPerNanosecond = (~uint64_t(0) / 1000000000) + 1;
+
+	/**
+	 * Add `nanoseconds` to `time`.
+	 */
+	void timespec_add(struct timespec &time, uint64_t nanoseconds)
 	{
-		epoch = atomic_load(&sntpTime->updatingEpoch);
-		// If the low bit is set then the time is being updated.  Wait for the
-		// update to finish.
-		if (epoch & 0x1)
+		nanoseconds += time.tv_nsec;
+		uint64_t seconds =
+		  fixed_point_multiply(nanoseconds, SecondsPerNanosecond) >> 32;
+		int64_t remainder = nanoseconds - (seconds * 1000000000);
+		// The reciprocal is rounded, so the quotient may be off by one.
+		if (remainder < 0)
+		{
+			seconds--;
+			remainder += 1000000000;
+		}
+		else if (remainder >= 1000000000)
 		{
-			Debug::log("Waiting for SNTP update");
-			// Wait for the update to finish
-			sntpTime->updatingEpoch.wait(epoch);
-			continue;
+			seconds++;
+			remainder -= 1000000000;
 		}
-		time.tv_sec  = sntpTime->seconds;
-		time.tv_usec = sntpTime->microseconds;
-		cycles       = sntpTime->cycles;
-	} while ((epoch & 0x1) || epoch != atomic_load(&sntpTime->updatingEpoch));
-	Debug::log("Got raw time {}.{}", uint64_t(time.tv_sec), time.tv_usec);
-	uint64_t now = rdcycle64();
-	Debug::log(
-	  "Elapsed cycles {} (now: {}, timestamp: {}", now - cycles, now, cycles);
-	// Elapsed time in cycles
-	uint64_t elapsed = now - cycles;
-	// Convert to microseconds
-	if (CPU_TIMER_HZ / 1000000 > 0)
+		time.tv_sec += seconds;
+		time.tv_nsec = remainder;
+	}
+
+	/**
+	 * Read the time synchronised with NTP into `time`, using `Multiply` to
+	 * convert cycles to nanoseconds.
+	 */
+	template<uint64_t (*Multiply)(uint64_t, uint64_t)>
+	void realtime_read(struct timespec &time)
 	{
-		elapsed /= CPU_TIMER_HZ / 1000000;
+		struct SynchronisedTime *sntpTime = SHARED_OBJECT_WITH_PERMISSIONS(
+		  SynchronisedTime, sntp_time_at_last_sync, true, false, false, false);
+		uint64_t cycles;
+		uint64_t slewCycles;
+		uint64_t slewNanosecondsPerCycle;
+		uint64_t slewNanoseconds;
+		uint64_t nanosecondsPerCycle;
+		uint32_t epoch;
+		do
+		{
+			epoch = atomic_load(&sntpTime->updatingEpoch);
+			// If the low bit is set then the time is being updated.  Wait for
+			// the update to finish.
+			if (epoch & 0x1)
+			{
+				Debug::log("Waiting for SNTP update");
+				// Wait for the update to finish
+				sntpTime->updatingEpoch.wait(epoch);
+				continue;
+			}
+			time.tv_sec             = sntpTime->seconds;
+			time.tv_nsec            = sntpTime->nanoseconds;
+			cycles                  = sntpTime->cycles;
+			slewCycles              = sntpTime->slewCycles;
+			slewNanosecondsPerCycle = sntpTime->slewNanosecondsPerCycle;
+			slewNanoseconds         = sntpTime->slewNanoseconds;
+			nanosecondsPerCycle     = sntpTime->nanosecondsPerCycle;
+		} while ((epoch & 0x1) ||
+		         epoch != atomic_load(&sntpTime->updatingEpoch));
+		uint64_t now = rdcycle64();
+		Debug::log("Elapsed cycles {} (now: {}, timestamp: {}",
+		           now - cycles,
+		           now,
+		           cycles);
+		// Elapsed time in nanoseconds, corrected for the clock's drift.
+		uint64_t elapsed =
+		  synchronised_time_elapsed<Multiply>(now - cycles,
+		                                      slewCycles,
+		                                      slewNanosecondsPerCycle,
+		                                      slewNanoseconds,
+		                                      nanosecondsPerCycle);
+		timespec_add(time, elapsed);
 	}
-	Debug::log("Adjusted elapsed microseconds {}", elapsed);
-	uint64_t usec = time.tv_usec + elapsed;
-	if (usec >= 1000000)
+
+	/**
+	 * Read the time since boot into `time`, using `Multiply` to convert
+	 * cycles to nanoseconds.
+	 */
+	template<uint64_t (*Multiply)(uint64_t, uint64_t)>
+	void monotonic_read(struct timespec &time)
 	{
-		time.tv_sec += usec / 1000000;
-		usec %= 1000000;
+		time = {0, 0};
+		timespec_add(time, Multiply(rdcycle64(), NominalNanosecondsPerCycle));
 	}
-	time.tv_usec = usec;
-	*tp          = time;
+} // namespace
+
+int timeval_calculate(struct timeval *__restrict tp)
+{
+	struct timespec time;
+	realtime_read<fixed_point_multiply>(time);
+	Debug::log("Time {}.{}", uint64_t(time.tv_sec), time.tv_nsec);
+	tp->tv_sec  = time.tv_sec;
+	tp->tv_usec = time.tv_nsec / 1000;
 	return 0;
 }
+
+int clock_gettime(clockid_t clock, struct timespec *tp)
+{
+	switch (clock)
+	{
+		case CLOCK_REALTIME:
+			realtime_read<fixed_point_multiply>(*tp);
+			return 0;
+		case CLOCK_REALTIME_COARSE:
+			realtime_read<coarse_multiply>(*tp);
+			return 0;
+		case CLOCK_MONOTONIC:
+			monotonic_read<fixed_point_multiply>(*tp);
+			return 0;
+		case CLOCK_MONOTONIC_COARSE:
+			monotonic_read<coarse_multiply>(*tp);
+			return 0;
+	}
+	return -EINVAL;
+}
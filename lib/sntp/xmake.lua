@@ -15,6 +15,6 @@ compartment("SNTP")
   add_files("../../third_party/coreSNTP/source/core_sntp_client.c",
             "../../third_party/coreSNTP/source/core_sntp_serializer.c")
   on_load(function(target)
-    target:values_set("shared_objects", { sntp_time_at_last_sync = 24 }, {expand = false})
+    target:values_set("shared_objects", { sntp_time_at_last_sync = 64 }, {expand = false})
   end)
 
@@ -0,0 +1,20 @@
+// Copyright SCI Semiconductor and CHERIoT Contributors.
+// SPDX-License-Identifier: MIT
+
+#include "tls-crypto-backend.h"
+
+/**
+ * Software reference backend.  These are the constant-time implementations
+ * that `br_ssl_engine_set_default_aes_gcm` selects on 32-bit targets without
+ * AES instructions.  The same implementations are used on the host, so host
+ * and device measurements of this backend are comparable.
+ */
+const TLSCryptoBackend *tls_crypto_backend()
+{
+	static const TLSCryptoBackend Reference = {
+	  &br_aes_ct_ctr_vtable,
+	  &br_ghash_ctmul,
+	  &br_sha256_vtable,
+	};
+	return &Reference;
+}
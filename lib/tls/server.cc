@@ -0,0 +1,249 @@
+// Copyright SCI Semiconductor and CHERIoT Contributors.
+// SPDX-License-Identifier: MIT
+
+#include "tls-internal.h"
+#include <algorithm>
+#include <cheri.hh>
+#include <debug.hh>
+#include <limits>
+#include <string.h>
+#include <tls.h>
+
+using Debug = ConditionalDebug<false, "TLS">;
+using namespace CHERI;
+
+namespace
+{
+	/**
+	 * The size of an entry in BearSSL's LRU session cache (`LRU_ENTRY_LEN` in
+	 * `ssl_lru.c`).
+	 */
+	constexpr size_t SessionCacheEntrySize = 100;
+
+	/// The largest certificate chain that we accept.
+	constexpr size_t MaxChainLength = 8;
+
+	/// The largest session cache that we accept.
+	constexpr size_t MaxSessionCacheEntries =
+	  std::numeric_limits<uint16_t>::max();
+
+	__always_inline SKey tls_server_key()
+	{
+		return STATIC_SEALING_TYPE(TLSServer);
+	}
+
+	LockedSessionCache *
+	locked_cache(const br_ssl_session_cache_class **context)
+	{
+		return reinterpret_cast<LockedSessionCache *>(context);
+	}
+
+	const br_ssl_session_cache_class LockedSessionCacheVtable = {
+	  sizeof(LockedSessionCache),
+	  [](const br_ssl_session_cache_class **ctx,
+	     br_ssl_server_context             *serverContext,
+	     const br_ssl_session_parameters   *parameters) {
+		  auto     *cache = locked_cache(ctx);
+		  LockGuard g{cache->lock};
+		  cache->lru.vtable->save(&cache->lru.vtable, serverContext, parameters);
+	  },
+	  [](const br_ssl_session_cache_class **ctx,
+	     br_ssl_server_context             *serverContext,
+	     br_ssl_session_parameters         *parameters) {
+		  auto     *cache = locked_cache(ctx);
+		  LockGuard g{cache->lock};
+		  return cache->lru.vtable->load(
+		    &cache->lru.vtable, serverContext, parameters);
+	  },
+	};
+
+	/**
+	 * Round `size` up to a multiple of the capability size, so that
+	 * structures containing pointers can follow it.
+	 */
+	size_t capability_align(size_t size)
+	{
+		return (size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+	}
+} // namespace
+
+TLSServer *tls_server_unseal(SObj sealedServer)
+{
+	Sealed<TLSServer> sealed{sealedServer};
+	return token_unseal(tls_server_key(), sealed);
+}
+
+bool tls_server_retain(Timeout *t, TLSServer *server)
+{
+	if (LockGuard g{server->lock, t})
+	{
+		server->connections++;
+		return true;
+	}
+	return false;
+}
+
+void tls_server_release(TLSServer *server)
+{
+	LockGuard g{server->lock};
+	server->connections--;
+}
+
+bool tls_server_engine_init(br_ssl_server_context *context, TLSServer *server)
+{
+	/*
+	 * Clients that we serve are mostly browsers and other modern stacks,
+	 * which all support this suite.
+	 */
+	static const uint16_t Suites[] = {
+	  BR_TLS_ECDHE_ECDSA_WITH_AES_128_GCM_SHA256,
+	};
+
+	br_ssl_server_zero(context);
+	br_ssl_engine_set_versions(&context->eng, BR_TLS12, BR_TLS12);
+	br_ssl_engine_set_suites(
+	  &context->eng, Suites, (sizeof Suites) / (sizeof Suites[0]));
+	br_ssl_engine_set_default_ec(&context->eng);
+	/*
+	 * The issuer key type is only used by the ECDH (not ECDHE) suites,
+	 * which we do not offer.
+	 */
+	br_ssl_server_set_single_ec(context,
+	                            server->chain,
+	                            server->chainLength,
+	                            &server->key,
+	                            BR_KEYTYPE_SIGN,
+	                            0,
+	                            br_ssl_engine_get_ec(&context->eng),
+	                            br_ecdsa_sign_asn1_get_default());
+	if (!tls_engine_crypto_init(&context->eng))
+	{
+		return false;
+	}
+	if (server->cacheEnabled)
+	{
+		br_ssl_server_set_cache(context, &server->cache.vtable);
+	}
+	return true;
+}
+
+SObj tls_server_create(Timeout                   *t,
+                       SObj                       allocator,
+                       const br_x509_certificate *chain,
+                       size_t                     chainLength,
+                       const br_ec_private_key   *key,
+                       size_t                     sessionCacheEntries)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return nullptr;
+	}
+	if ((chainLength == 0) || (chainLength > MaxChainLength) ||
+	    (sessionCacheEntries > MaxSessionCacheEntries) ||
+	    (heap_claim_fast(t, chain, key) != 0) ||
+	    !check_pointer<PermissionSet{Permission::Load}>(
+	      chain, chainLength * sizeof(br_x509_certificate)) ||
+	    !check_pointer<PermissionSet{Permission::Load}>(key))
+	{
+		Debug::log("Invalid certificate chain {} or key {}", chain, key);
+		return nullptr;
+	}
+	// Copy the descriptors so that the caller cannot change the lengths
+	// between the checks and the copies below.
+	br_x509_certificate certificates[MaxChainLength];
+	std::copy(chain, chain + chainLength, certificates);
+	br_ec_private_key privateKey = *key;
+	if (!check_pointer<PermissionSet{Permission::Load}>(privateKey.x,
+	                                                    privateKey.xlen))
+	{
+		Debug::log("Invalid key {}", privateKey.x);
+		return nullptr;
+	}
+	size_t certificatesSize = 0;
+	for (size_t i = 0; i < chainLength; i++)
+	{
+		if (!check_pointer<PermissionSet{Permission::Load}>(
+		      certificates[i].data, certificates[i].data_len))
+		{
+			Debug::log("Invalid certificate {}", certificates[i].data);
+			return nullptr;
+		}
+		certificatesSize += certificates[i].data_len;
+	}
+	// Layout: the header, the certificate array, the session cache, then
+	// the certificate and key bytes.
+	size_t chainSize = chainLength * sizeof(br_x509_certificate);
+	size_t cacheSize =
+	  capability_align(sessionCacheEntries * SessionCacheEntrySize);
+	void *unsealed;
+	SObj  sealed = token_sealed_unsealed_alloc(t,
+	                                           allocator,
+	                                           tls_server_key(),
+	                                           sizeof(TLSServer) + chainSize +
+	                                             cacheSize + certificatesSize +
+	                                             privateKey.xlen,
+	                                           &unsealed);
+	if (sealed == nullptr)
+	{
+		Debug::log("Failed to allocate TLS server");
+		return nullptr;
+	}
+	auto *server        = new (unsealed) TLSServer{};
+	server->chain       = reinterpret_cast<br_x509_certificate *>(server + 1);
+	server->chainLength = chainLength;
+	auto *cacheStore =
+	  reinterpret_cast<unsigned char *>(server->chain + chainLength);
+	auto *data = cacheStore + cacheSize;
+	// The bounds of each buffer were checked above.  Claim each one while
+	// copying it so that it cannot be freed during the copy.
+	for (size_t i = 0; i < chainLength; i++)
+	{
+		if (heap_claim_fast(t, certificates[i].data) != 0)
+		{
+			token_obj_destroy(allocator, tls_server_key(), sealed);
+			return nullptr;
+		}
+		memcpy(data, certificates[i].data, certificates[i].data_len);
+		server->chain[i] = {data, certificates[i].data_len};
+		data += certificates[i].data_len;
+	}
+	if (heap_claim_fast(t, privateKey.x) != 0)
+	{
+		token_obj_destroy(allocator, tls_server_key(), sealed);
+		return nullptr;
+	}
+	memcpy(data, privateKey.x, privateKey.xlen);
+	server->key = {privateKey.curve, data, privateKey.xlen};
+	if (sessionCacheEntries > 0)
+	{
+		server->cacheEnabled = true;
+		server->cache.vtable = &LockedSessionCacheVtable;
+		br_ssl_session_cache_lru_init(
+		  &server->cache.lru, cacheStore, cacheSize);
+	}
+	Debug::log("Created TLS server with {} certificates and {} cache entries",
+	           chainLength,
+	           sessionCacheEntries);
+	return sealed;
+}
+
+int tls_server_destroy(SObj allocator, SObj sealedServer)
+{
+	auto *server = tls_server_unseal(sealedServer);
+	if (server == nullptr)
+	{
+		return -EINVAL;
+	}
+	Timeout t{0};
+	if (!server->lock.try_lock(&t))
+	{
+		return -EBUSY;
+	}
+	if (server->connections != 0)
+	{
+		server->lock.unlock();
+		return -EBUSY;
+	}
+	server->lock.upgrade_for_destruction();
+	return token_obj_destroy(allocator, tls_server_key(), sealedServer);
+}
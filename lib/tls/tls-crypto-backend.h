@@ -0,0 +1,49 @@
+// Copyright SCI Semiconductor and CHERIoT Contributors.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+#include "../../third_party/BearSSL/inc/bearssl.h"
+
+/**
+ * Symmetric-crypto backend for the TLS compartment.
+ *
+ * The TLS compartment takes the implementations of the primitives used for
+ * record protection and handshake hashing from a backend, selected at build
+ * time with the `tls-crypto-backend` xmake option.  The default is the
+ * software reference backend in `crypto_backend_reference.cc`, which uses
+ * BearSSL's constant-time implementations.  Integrators with AES or SHA
+ * accelerators can provide a source file that defines
+ * `tls_crypto_backend()` and pass its path as the option's value.
+ *
+ * BearSSL stores the state of these primitives in fixed-size fields of its
+ * own structures, so backend contexts must fit.  The sizes are checked each
+ * time that a connection is created, and connections cannot be created with a
+ * backend that does not meet these requirements:
+ *
+ *  - `aesCounter->context_size` must not exceed
+ *    `sizeof(br_aes_gen_ctr_keys)`.
+ *  - `sha256->context_size` must not exceed `sizeof(br_hash_compat_context)`
+ *    and the class must implement `state` and `set_state`, which the
+ *    handshake transcript uses to run several hashes in one buffer.
+ *
+ * The TLS 1.2 PRF always uses BearSSL's software HMAC-SHA-256.
+ */
+struct TLSCryptoBackend
+{
+	/// AES in counter mode, used for AES-GCM records.
+	const br_block_ctr_class *aesCounter;
+	/// GHASH, used for AES-GCM authentication.
+	br_ghash ghash;
+	/**
+	 * SHA-256, used for the handshake transcript and to hash distinguished
+	 * names and signed data when validating certificates.
+	 */
+	const br_hash_class *sha256;
+};
+
+/**
+ * Returns the backend.  This is called each time a TLS connection is
+ * created, so a backend that needs to map a device can do so lazily here.
+ * The result must not be null.
+ */
+const TLSCryptoBackend *tls_crypto_backend();
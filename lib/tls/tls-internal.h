@@ -0,0 +1,247 @@
+// Copyright SCI Semiconductor and CHERIoT Contributors.
+// SPDX-License-Identifier: MIT
+
+#pragma once
+#include "../../third_party/BearSSL/inc/bearssl.h"
+#include <locks.hh>
+#include <sntp.h>
+#include <token.h>
+
+/**
+ * Internal helpers and data structures for use inside of the TLS compartment.
+ * These should be called or used only from/in the TLS compartment.
+ */
+
+/**
+ * An entry in the validation cache.
+ */
+struct ValidationCacheEntry
+{
+	/// The SHA-256 hash of the end-entity certificate.
+	uint8_t leafHash[br_sha256_SIZE];
+	/**
+	 * The time (in seconds since the UNIX epoch) after which this entry is
+	 * no longer valid.  Zero for an unused entry.
+	 */
+	time_t expiry;
+};
+
+/**
+ * A cache of end-entity certificates whose chains have been validated
+ * against the trust anchors in a store.  A connection that is presented with
+ * a cached end-entity certificate does not validate the rest of the chain.
+ */
+struct ValidationCache
+{
+	/// Lock protecting the entries.
+	FlagLockPriorityInherited lock;
+	/// The maximum time that an entry can remain in the cache.
+	uint32_t maxAgeSeconds;
+	/// The number of entries.
+	size_t entriesCount;
+	/// The entries, which follow this structure in memory.
+	ValidationCacheEntry *entries;
+};
+
+/**
+ * A set of trust anchors, indexed by a hash of their distinguished names.
+ *
+ * This is the unsealed form of the object returned by
+ * `tls_trust_anchor_store_create`.  The anchors and their hashes are stored
+ * in the same allocation as this structure.
+ */
+struct TrustAnchorStore
+{
+	/// Lock protecting `connections` and `cache`.
+	FlagLockPriorityInherited lock;
+	/**
+	 * The number of connections that may still use this store to validate a
+	 * certificate chain.
+	 */
+	uint32_t connections;
+	/// The number of trust anchors in the store.
+	size_t anchorsCount;
+	/**
+	 * The trust anchors, sorted by DN hash.  These are copies of the
+	 * caller's structures and so still point to the caller's DN and key
+	 * data.
+	 */
+	br_x509_trust_anchor *anchors;
+	/**
+	 * The first 64 bits of the SHA-256 hash of the DN of each entry in
+	 * `anchors`, in ascending order.
+	 */
+	uint64_t *hashes;
+	/**
+	 * The validation cache.  Null unless enabled with
+	 * `tls_trust_anchor_store_cache_enable`.  This is set only once, but
+	 * connections still read it with `lock` held so that they see the
+	 * cache's contents initialised.
+	 */
+	ValidationCache *cache;
+	/// The allocator that `cache` was allocated with.
+	SObj cacheAllocator;
+};
+
+/**
+ * Wrapper around the BearSSL minimal X.509 engine that narrows the set of
+ * trust anchors that the engine considers for each certificate.
+ *
+ * The minimal engine hashes the DN of every trust anchor that it is given
+ * for each certificate in the chain.  This wrapper buffers the start of each
+ * certificate until it has seen the issuer and subject DNs, looks both up in
+ * a `TrustAnchorStore`, and then gives the minimal engine only the anchors
+ * whose DNs may match.
+ */
+struct IndexedX509Context
+{
+	/// The maximum number of trust anchors that will be passed to the engine.
+	static constexpr size_t MaxCandidates = 4;
+	/**
+	 * The number of bytes of each certificate that will be buffered while
+	 * looking for the issuer and subject DNs.  If the DNs do not fit, the
+	 * engine is given every anchor in the store.
+	 */
+	static constexpr size_t PrefixSize = 768;
+	/// The vtable.  This must be the first field.
+	const br_x509_class *vtable;
+	/// The wrapped minimal engine.
+	br_x509_minimal_context *inner;
+	/**
+	 * The store used to find trust anchors.  The connection that owns this
+	 * context holds a reference to the store for as long as the context
+	 * exists.
+	 */
+	TrustAnchorStore *store;
+	/// The trust anchors that may match the current certificate.
+	br_x509_trust_anchor candidates[MaxCandidates];
+	/// The buffered start of the current certificate.
+	uint8_t prefix[PrefixSize];
+	/// The number of bytes in `prefix`.
+	size_t prefixLength;
+	/**
+	 * Set once the trust anchors have been selected for the current
+	 * certificate and data are passed straight to the inner engine.
+	 */
+	bool forwarding;
+	/// The index of the current certificate in the chain.
+	size_t certificateIndex;
+	/// The running hash of the end-entity certificate.
+	br_sha256_context leafHash;
+	/**
+	 * The earliest notAfter time of the certificates seen so far in this
+	 * chain.
+	 */
+	time_t chainExpiry;
+	/**
+	 * The store's validation cache, read at the start of each chain, or
+	 * null if it has not been enabled.
+	 */
+	ValidationCache *cache;
+	/**
+	 * True if the result of validating this chain may be added to the
+	 * store's validation cache.
+	 */
+	bool cacheable;
+	/**
+	 * True if the end-entity certificate was found in the validation cache.
+	 * The rest of the chain is then ignored.
+	 */
+	bool cacheHit;
+};
+
+/**
+ * Unseal a trust anchor store.  Returns `nullptr` if `sealedStore` is not a
+ * valid trust anchor store.
+ */
+TrustAnchorStore *trust_anchor_store_unseal(SObj sealedStore);
+
+/**
+ * Record a new connection that uses `store`.  Returns false if the store's
+ * lock could not be acquired before the timeout expired.
+ */
+bool trust_anchor_store_retain(Timeout *t, TrustAnchorStore *store);
+
+/**
+ * Record that a connection that used `store` no longer needs it.
+ */
+void trust_anchor_store_release(TrustAnchorStore *store);
+
+/**
+ * Initialise `context` to wrap the minimal X.509 engine `inner`, which must
+ * already have been initialised, selecting trust anchors from `store`.
+ */
+void indexed_x509_init(IndexedX509Context      *context,
+                       br_x509_minimal_context *inner,
+                       TrustAnchorStore        *store);
+
+/**
+ * Wrapper around BearSSL's LRU session cache that serialises access to it,
+ * so that it can be shared by the connections of a server.
+ */
+struct LockedSessionCache
+{
+	/// The vtable.  This must be the first field.
+	const br_ssl_session_cache_class *vtable;
+	/// Lock protecting `lru`.
+	FlagLockPriorityInherited lock;
+	/// The wrapped cache.
+	br_ssl_session_cache_lru lru;
+};
+
+/**
+ * The configuration for a TLS server.
+ *
+ * This is the unsealed form of the object returned by `tls_server_create`.
+ * The certificate chain, the private key and the session cache storage are
+ * stored in the same allocation as this structure.
+ */
+struct TLSServer
+{
+	/// Lock protecting `connections`.
+	FlagLockPriorityInherited lock;
+	/// The number of open connections that use this server.
+	uint32_t connections;
+	/// The certificate chain, end-entity certificate first.
+	br_x509_certificate *chain;
+	/// The number of certificates in `chain`.
+	size_t chainLength;
+	/// The server's private key.
+	br_ec_private_key key;
+	/// True if `cache` is used.
+	bool cacheEnabled;
+	/// The session cache.
+	LockedSessionCache cache;
+};
+
+/**
+ * Unseal a TLS server configuration.  Returns `nullptr` if `sealedServer` is
+ * not a valid server.
+ */
+TLSServer *tls_server_unseal(SObj sealedServer);
+
+/**
+ * Record a new connection that uses `server`.  Returns false if the server's
+ * lock could not be acquired before the timeout expired.
+ */
+bool tls_server_retain(Timeout *t, TLSServer *server);
+
+/**
+ * Record that a connection that uses `server` has been closed.
+ */
+void tls_server_release(TLSServer *server);
+
+/**
+ * Initialise `context` for a connection to `server`.  This sets up the
+ * credentials, cipher suites and session cache, but not the I/O buffers.
+ * Returns false if the crypto backend is not usable.
+ */
+bool tls_server_engine_init(br_ssl_server_context *context, TLSServer *server);
+
+/**
+ * Configure the symmetric cryptography, handshake hash and PRF of `engine`
+ * from the crypto backend.  This is shared by client and server contexts.
+ * Returns false, without configuring anything, if the backend's contexts do
+ * not fit in BearSSL's structures.
+ */
+bool tls_engine_crypto_init(br_ssl_engine_context *engine);
@@ -2,11 +2,17 @@
 // SPDX-License-Identifier: MIT
 
 #include "../../third_party/BearSSL/inc/bearssl.h"
+#include "tls-crypto-backend.h"
+#include "tls-internal.h"
 #include <NetAPI.h>
 #include <debug.hh>
 #include <function_wrapper.hh>
+#include <futex.h>
+#include <limits>
 #include <locks.hh>
 #include <platform-entropy.hh>
+#include <riscvreg.h>
+#include <string.h>
 #include <timeout.h>
 #include <tls.h>
 #include <token.h>
@@ -23,6 +29,166 @@ namespace
 	  false
 #endif
 	  ;
+
+	/**
+	 * The size of each connection's output buffer.  This bounds the size of
+	 * the records that we send: a record can carry up to this size minus
+	 * `BR_SSL_BUFSIZE_OUTPUT - 16384` bytes of plaintext.  The default is the
+	 * smallest buffer that BearSSL will accept.
+	 */
+	constexpr size_t OutputBufferSize =
+#ifdef CHERIOT_TLS_OUTPUT_BUFFER_SIZE
+	  CHERIOT_TLS_OUTPUT_BUFFER_SIZE
+#else
+	  837
+#endif
+	  ;
+	static_assert(OutputBufferSize >= 837 &&
+	                OutputBufferSize <= BR_SSL_BUFSIZE_OUTPUT,
+	              "Invalid TLS output buffer size");
+
+	/**
+	 * Dynamic record sizing.  A connection that starts sending, or resumes
+	 * after an idle period, uses records small enough to fit in a single
+	 * TCP segment so that the peer can decrypt the first bytes without
+	 * waiting for a second segment.  Once enough data has been sent in a
+	 * burst that throughput matters more than latency, records grow to
+	 * whatever fits in the output buffer.
+	 */
+	constexpr size_t SmallRecordSize = 1369;
+	/// The number of bytes in a burst after which records grow.
+	constexpr size_t RecordGrowthThreshold = 64 * 1024;
+	/// The idle time after which records shrink again.
+	constexpr uint64_t RecordIdleResetMilliseconds = 1000;
+
+	/**
+	 * States for the initial handshake of a TLS connection.
+	 */
+	enum HandshakeState : uint32_t
+	{
+		/// The handshake has not yet completed.
+		HandshakeInProgress,
+		/// The handshake has completed and application data can be exchanged.
+		HandshakeComplete,
+		/// The handshake failed.  The connection can only be closed.
+		HandshakeFailed,
+	};
+
+	/**
+	 * Counts the TLS records in a stream of bytes, which may be split at
+	 * arbitrary points.  This looks only at the five-byte record headers.
+	 */
+	struct RecordCounter
+	{
+		/// Bytes of the current record's body that have not yet been seen.
+		uint32_t bodyRemaining = 0;
+		/// The number of bytes of the current record header seen so far.
+		uint8_t headerBytes = 0;
+		/// The body length from the current record header.
+		uint16_t bodyLength = 0;
+
+		/**
+		 * Process `length` bytes from the stream and add the number of
+		 * records that start in them to `records`.
+		 */
+		void update(const uint8_t *data, size_t length, uint32_t &records)
+		{
+			while (length > 0)
+			{
+				if (bodyRemaining > 0)
+				{
+					size_t skip = std::min<size_t>(length, bodyRemaining);
+					bodyRemaining -= skip;
+					data += skip;
+					length -= skip;
+					continue;
+				}
+				// The length is the last two bytes of the header.
+				if (headerBytes >= 3)
+				{
+					bodyLength = (bodyLength << 8) | *data;
+				}
+				data++;
+				length--;
+				if (++headerBytes == 5)
+				{
+					records++;
+					bodyRemaining = bodyLength;
+					bodyLength    = 0;
+					headerBytes   = 0;
+				}
+			}
+		}
+	};
+
+	/**
+	 * Adds the cycles between its construction and destruction to a
+	 * counter.
+	 */
+	struct CycleCounter
+	{
+		/// The counter to update.
+		uint64_t &total;
+		/// The cycle count when this was constructed.
+		uint64_t start = rdcycle64();
+		~CycleCounter()
+		{
+			total += rdcycle64() - start;
+		}
+	};
+
+	/**
+	 * Wrapper around an X.509 engine that counts the cycles spent in it.
+	 */
+	struct TimedX509Context
+	{
+		/// The vtable.  This must be the first field.
+		const br_x509_class *vtable;
+		/// The wrapped X.509 engine.
+		const br_x509_class **inner;
+		/// The counter to add the time spent in the engine to.
+		uint64_t *cycles;
+	};
+
+	TimedX509Context *timed_context(const br_x509_class *const *context)
+	{
+		return reinterpret_cast<TimedX509Context *>(
+		  const_cast<const br_x509_class **>(context));
+	}
+
+	const br_x509_class TimedX509Vtable = {
+	  sizeof(TimedX509Context),
+	  [](const br_x509_class **ctx, const char *serverName) {
+		  auto        *context = timed_context(ctx);
+		  CycleCounter c{*context->cycles};
+		  (*context->inner)->start_chain(context->inner, serverName);
+	  },
+	  [](const br_x509_class **ctx, uint32_t length) {
+		  auto        *context = timed_context(ctx);
+		  CycleCounter c{*context->cycles};
+		  (*context->inner)->start_cert(context->inner, length);
+	  },
+	  [](const br_x509_class **ctx, const unsigned char *buffer, size_t length) {
+		  auto        *context = timed_context(ctx);
+		  CycleCounter c{*context->cycles};
+		  (*context->inner)->append(context->inner, buffer, length);
+	  },
+	  [](const br_x509_class **ctx) {
+		  auto        *context = timed_context(ctx);
+		  CycleCounter c{*context->cycles};
+		  (*context->inner)->end_cert(context->inner);
+	  },
+	  [](const br_x509_class **ctx) {
+		  auto        *context = timed_context(ctx);
+		  CycleCounter c{*context->cycles};
+		  return (*context->inner)->end_chain(context->inner);
+	  },
+	  [](const br_x509_class *const *ctx, unsigned *usages) {
+		  auto *context = timed_context(ctx);
+		  return (*context->inner)->get_pkey(context->inner, usages);
+	  },
+	};
+
 	/**
 	 * The object for a sealed TLS connection.
 	 */
@@ -30,42 +196,136 @@ namespace
 	{
 		/// The underlying TCP socket.
 		SObj socket;
+		/**
+		 * The capability used to connect a client connection, kept so that
+		 * `tls_connection_reconnect` can connect to the same host again.
+		 * Null for server connections.
+		 */
+		SObj connectionCapability = nullptr;
 		/**
 		 * The allocator used to allocate memory for this object.  Needed for
 		 * freeing it and for allocating internal buffers.
 		 */
 		SObj allocator;
-		/// The BearSSL client context.
-		br_ssl_client_context *clientContext;
-		/// The BearSSL X.509 context.
-		br_x509_minimal_context *x509Context;
+		/**
+		 * The BearSSL client or server context.  This is a
+		 * `br_ssl_client_context` unless `server` is set, in which case it
+		 * is a `br_ssl_server_context`.
+		 */
+		void *sslContext;
+		/// The engine in `sslContext`.
+		br_ssl_engine_context *engine;
+		/// The BearSSL X.509 context.  Null for server connections.
+		br_x509_minimal_context *x509Context = nullptr;
+		/**
+		 * The configuration for a server connection, or null for a client
+		 * connection.  Each server connection is counted by its server.
+		 */
+		TLSServer *server = nullptr;
+		/**
+		 * The wrapper around the X.509 context that selects trust anchors
+		 * from a trust anchor store.  Null if the connection was created
+		 * with an array of trust anchors.
+		 */
+		IndexedX509Context *indexedX509Context = nullptr;
 		/// The input buffer for the TLS engine.
 		unsigned char *iobufIn;
 		/// The output buffer for the TLS engine.
 		unsigned char            *iobufOut;
 		FlagLockPriorityInherited lock;
-		TLSContext(SObj                     socket,
-		           SObj                     allocator,
-		           br_ssl_client_context   *clientContext,
-		           br_x509_minimal_context *x509Context,
-		           unsigned char           *iobufIn,
-		           unsigned char           *iobufOut)
+		/**
+		 * The state of the initial handshake, one of the `HandshakeState`
+		 * values.  This is modified only with the lock held but is also used
+		 * as a futex word so that threads can wait for a handshake that is
+		 * being driven by another thread.
+		 */
+		uint32_t handshakeState = HandshakeInProgress;
+		/**
+		 * The auto-cork window, in milliseconds, or zero if auto-cork is
+		 * disabled.
+		 */
+		uint32_t autocorkMilliseconds = 0;
+		/**
+		 * The cycle count after which the next send flushes the data held
+		 * back by auto-cork, or zero if no data are being held back.
+		 */
+		uint64_t corkWindowEnd = 0;
+		/// Profiling counters, reported by `tls_connection_statistics`.
+		TLSStatistics statistics = {};
+		/// Record counter for data sent to the network.
+		RecordCounter recordsOut;
+		/// Record counter for data received from the network.
+		RecordCounter recordsIn;
+		/// Wrapper that counts the time spent in the X.509 engine.
+		TimedX509Context x509Timer;
+		/// The cycle count when the handshake started.
+		uint64_t handshakeStart = 0;
+		/**
+		 * The cycle count when the server's first flight had been
+		 * processed, or zero if this has not yet happened.
+		 */
+		uint64_t serverFlightEnd = 0;
+		/// Cycles spent inside the TLS engine processing records.
+		uint64_t engineCycles = 0;
+		/// The value of `engineCycles` when `serverFlightEnd` was set.
+		uint64_t engineCyclesAtServerFlightEnd = 0;
+		/**
+		 * The number of bytes of plaintext in the record that the engine is
+		 * currently building.
+		 */
+		size_t recordFill = 0;
+		/**
+		 * The number of bytes of plaintext sent since the last idle period,
+		 * saturating at `RecordGrowthThreshold`.
+		 */
+		size_t burstBytes = 0;
+		/// The cycle count at the start of the last send.
+		uint64_t lastSend = 0;
+		/**
+		 * True if the connection is parked: the I/O buffers have been
+		 * freed and `iobufIn` and `iobufOut` are null.
+		 */
+		bool parked = false;
+		TLSContext(SObj                   socket,
+		           SObj                   allocator,
+		           void                  *sslContext,
+		           br_ssl_engine_context *engine,
+		           unsigned char         *iobufIn,
+		           unsigned char         *iobufOut)
 		  : socket{socket},
 		    allocator{allocator},
-		    clientContext{clientContext},
-		    x509Context{x509Context},
+		    sslContext{sslContext},
+		    engine{engine},
 		    iobufIn{iobufIn},
 		    iobufOut{iobufOut}
 		{
 		}
 		~TLSContext()
 		{
-			Timeout t{UnlimitedTimeout};
-			network_socket_close(&t, allocator, socket);
-			heap_free(allocator, iobufIn);
-			heap_free(allocator, iobufOut);
-			heap_free(allocator, clientContext);
-			heap_free(allocator, x509Context);
+			if (socket != nullptr)
+			{
+				Timeout t{UnlimitedTimeout};
+				network_socket_close(&t, allocator, socket);
+			}
+			if (!parked)
+			{
+				heap_free(allocator, iobufIn);
+				heap_free(allocator, iobufOut);
+			}
+			heap_free(allocator, sslContext);
+			if (x509Context != nullptr)
+			{
+				heap_free(allocator, x509Context);
+			}
+			if (indexedX509Context != nullptr)
+			{
+				trust_anchor_store_release(indexedX509Context->store);
+				heap_free(allocator, indexedX509Context);
+			}
+			if (server != nullptr)
+			{
+				tls_server_release(server);
+			}
 		}
 	};
 
@@ -81,8 +341,65 @@ namespace
 		return source();
 	}
 
-	ssize_t
-	with_sealed_tls_context(Timeout *timeout, SObj sealed, auto callback)
+	/**
+	 * The size of the input buffer for client connections.  Servers send us
+	 * records that are at most this size minus
+	 * `BR_SSL_BUFSIZE_INPUT - 16384` bytes, which BearSSL requests with the
+	 * maximum fragment length extension.
+	 */
+	constexpr size_t ClientInputBufferSize = 837;
+
+	/**
+	 * The size of the input buffer for server connections.  Clients rarely
+	 * negotiate a maximum fragment length, so this must be large enough for
+	 * a browser's ClientHello and for requests, in records of up to 4 KiB.
+	 */
+	constexpr size_t ServerInputBufferSize = 4096 + 325;
+
+	/**
+	 * Reallocate the I/O buffers of a parked connection.  BearSSL keeps
+	 * offsets into its buffers and, when a connection is parked, nothing
+	 * before the current offsets is live, so the engine can continue with
+	 * fresh buffers.  Returns 0 on success or `-ENOMEM`.
+	 */
+	int tls_unpark(Timeout *t, TLSContext *connection)
+	{
+		size_t inputBufferSize = (connection->server == nullptr)
+		                           ? ClientInputBufferSize
+		                           : ServerInputBufferSize;
+
+		auto *iobufIn = static_cast<unsigned char *>(
+		  heap_allocate(t, connection->allocator, inputBufferSize));
+		if (!Capability{iobufIn}.is_valid())
+		{
+			return -ENOMEM;
+		}
+		auto *iobufOut = static_cast<unsigned char *>(
+		  heap_allocate(t, connection->allocator, OutputBufferSize));
+		if (!Capability{iobufOut}.is_valid())
+		{
+			heap_free(connection->allocator, iobufIn);
+			return -ENOMEM;
+		}
+		connection->iobufIn      = iobufIn;
+		connection->iobufOut     = iobufOut;
+		connection->engine->ibuf = iobufIn;
+		connection->engine->obuf = iobufOut;
+		connection->parked       = false;
+		Debug::log("Unparked TLS connection");
+		return 0;
+	}
+
+	/**
+	 * Unseal a TLS connection, acquire its lock, and invoke `callback` with
+	 * the unsealed context.  Unless `allowPendingHandshake` is set, this
+	 * fails with `-ENOTCONN` if the connection's initial handshake has not
+	 * completed, and unparks the connection if it is parked.
+	 */
+	ssize_t with_sealed_tls_context(Timeout *timeout,
+	                                SObj     sealed,
+	                                auto     callback,
+	                                bool     allowPendingHandshake = false)
 	{
 		Sealed<TLSContext> sealedContext{sealed};
 		auto              *unsealed = token_unseal(tls_key(), sealedContext);
@@ -94,13 +411,26 @@ namespace
 		if (LockGuard g{unsealed->lock, timeout})
 		{
 			auto state =
-			  br_ssl_engine_current_state(&unsealed->clientContext->eng);
+			  br_ssl_engine_current_state(unsealed->engine);
 			Debug::log("TLS state: {}", state);
 			if ((state & BR_SSL_CLOSED) == BR_SSL_CLOSED)
 			{
 				Debug::log(
 				  "Connection closed, last error: {}",
-				  br_ssl_engine_last_error(&unsealed->clientContext->eng));
+				  br_ssl_engine_last_error(unsealed->engine));
+			}
+			if (!allowPendingHandshake &&
+			    (unsealed->handshakeState != HandshakeComplete))
+			{
+				Debug::log("TLS handshake has not completed");
+				return -ENOTCONN;
+			}
+			if (!allowPendingHandshake && unsealed->parked)
+			{
+				if (int ret = tls_unpark(timeout, unsealed); ret != 0)
+				{
+					return ret;
+				}
 			}
 			return callback(unsealed);
 		}
@@ -108,8 +438,36 @@ namespace
 		return -ETIMEDOUT;
 	}
 
-	/// Minimal BearSSL context initialisation.
-	void br_ssl_client_init(br_ssl_client_context      *cc,
+	/**
+	 * Returns the crypto backend, or null if its contexts do not fit in the
+	 * fixed-size fields that BearSSL provides for them.  This is checked
+	 * each time because `tls_crypto_backend` may return a different backend
+	 * on each call.
+	 */
+	const TLSCryptoBackend *crypto_backend_checked()
+	{
+		const TLSCryptoBackend *backend = tls_crypto_backend();
+		if (backend->aesCounter->context_size > sizeof(br_aes_gen_ctr_keys))
+		{
+			Debug::log("AES context for crypto backend is too large ({} bytes)",
+			           backend->aesCounter->context_size);
+			return nullptr;
+		}
+		if (backend->sha256->context_size > sizeof(br_hash_compat_context))
+		{
+			Debug::log(
+			  "SHA-256 context for crypto backend is too large ({} bytes)",
+			  backend->sha256->context_size);
+			return nullptr;
+		}
+		return backend;
+	}
+
+	/**
+	 * Minimal BearSSL context initialisation.  Returns false if the crypto
+	 * backend is not usable.
+	 */
+	bool br_ssl_client_init(br_ssl_client_context      *cc,
 	                        br_x509_minimal_context    *xc,
 	                        const br_x509_trust_anchor *trustAnchors,
 	                        size_t                      trustAnchorsCount)
@@ -127,6 +485,12 @@ namespace
 #endif
 		};
 
+		const TLSCryptoBackend *backend = crypto_backend_checked();
+		if (backend == nullptr)
+		{
+			return false;
+		}
+
 		/*
 		 * Reset client context and set supported versions to TLS-1.2.
 		 */
@@ -138,7 +502,7 @@ namespace
 		 * comparisons).
 		 */
 		br_x509_minimal_init(
-		  xc, &br_sha256_vtable, trustAnchors, trustAnchorsCount);
+		  xc, backend->sha256, trustAnchors, trustAnchorsCount);
 
 		/*
 		 * Set suites and asymmetric crypto implementations. We use the
@@ -161,39 +525,32 @@ namespace
 
 		/*
 		 * Set supported hash functions, for the SSL engine and for the
-		 * X.509 engine.
+		 * X.509 engine, and the PRF and symmetric encryption.
 		 */
-		br_ssl_engine_set_hash(&cc->eng, br_sha256_ID, &br_sha256_vtable);
-		Debug::log("Setting vtable for br_sha256_ID: {}", &br_sha256_vtable);
+		if (!tls_engine_crypto_init(&cc->eng))
+		{
+			return false;
+		}
 		for (int i = 0; i < 6; i++)
 		{
 			Debug::log("hash engines[{}] = {}", i, cc->eng.mhash.impl[i]);
 		}
 
-		br_x509_minimal_set_hash(xc, br_sha256_ID, &br_sha256_vtable);
+		br_x509_minimal_set_hash(xc, br_sha256_ID, backend->sha256);
 
 		/*
 		 * Link the X.509 engine in the SSL engine.
 		 */
 		br_ssl_engine_set_x509(&cc->eng, &xc->vtable);
-
-		/*
-		 * Set the PRF implementations.
-		 */
-		br_ssl_engine_set_prf_sha256(&cc->eng, &br_tls12_sha256_prf);
-
-		/*
-		 * Symmetric encryption. We use the "default" implementations
-		 * (fastest among constant-time implementations).
-		 */
-		br_ssl_engine_set_default_aes_gcm(&cc->eng);
+		return true;
 	}
 
 	int receive_records(Timeout *t, TLSContext *connection)
 	{
-		auto      *engine = &connection->clientContext->eng;
-		size_t     length;
-		Capability inputBuffer = br_ssl_engine_recvrec_buf(engine, &length);
+		auto          *engine = connection->engine;
+		size_t         length;
+		unsigned char *rawBuffer   = br_ssl_engine_recvrec_buf(engine, &length);
+		Capability     inputBuffer = rawBuffer;
 		inputBuffer.bounds().set_inexact_at_most(length);
 		length = inputBuffer.length();
 
@@ -214,6 +571,10 @@ namespace
 		{
 			return received;
 		}
+		connection->recordsIn.update(
+		  rawBuffer, received, connection->statistics.recordsIn);
+		connection->statistics.wireBytesIn += received;
+		CycleCounter c{connection->engineCycles};
 		br_ssl_engine_recvrec_ack(engine, received);
 		return received;
 	}
@@ -228,7 +589,7 @@ namespace
 	 */
 	std::pair<int, bool> send_records(Timeout *t, TLSContext *connection)
 	{
-		auto      *engine = &connection->clientContext->eng;
+		auto      *engine = connection->engine;
 		size_t     readyLength;
 		Capability readyBuffer =
 		  br_ssl_engine_sendrec_buf(engine, &readyLength);
@@ -244,6 +605,14 @@ namespace
 		Debug::log("Send returned {}", sent);
 		if (sent > 0)
 		{
+			connection->recordsOut.update(
+			  readyBuffer, sent, connection->statistics.recordsOut);
+			connection->statistics.wireBytesOut += sent;
+			if (size_t(sent) < readyLength)
+			{
+				connection->statistics.partialSends++;
+			}
+			CycleCounter c{connection->engineCycles};
 			br_ssl_engine_sendrec_ack(engine, sent);
 		}
 		else
@@ -253,6 +622,466 @@ namespace
 		return {sent, sent < readyLength};
 	}
 
+	/**
+	 * Close the record that the engine is building.  The resulting record is
+	 * sent by the caller.
+	 */
+	void record_flush(TLSContext *connection)
+	{
+		connection->recordFill = 0;
+		connection->statistics.flushes++;
+		br_ssl_engine_flush(connection->engine, 0);
+	}
+
+	/**
+	 * Returns the maximum number of bytes of plaintext to put in each record
+	 * for a send that starts now.
+	 */
+	size_t record_size_limit(TLSContext *connection)
+	{
+		constexpr uint64_t CyclesPerMilliSecond = CPU_TIMER_HZ / 1000;
+		uint64_t           now                  = rdcycle64();
+		if (now - connection->lastSend >
+		    RecordIdleResetMilliseconds * CyclesPerMilliSecond)
+		{
+			connection->burstBytes = 0;
+		}
+		connection->lastSend = now;
+		return connection->burstBytes >= RecordGrowthThreshold
+		         ? std::numeric_limits<size_t>::max()
+		         : SmallRecordSize;
+	}
+
+	/**
+	 * Flush any data held back by auto-cork and send all pending records.
+	 * Returns 0 on success or a negative error code if sending failed.
+	 */
+	int corked_flush(Timeout *t, TLSContext *connection)
+	{
+		auto *engine              = connection->engine;
+		connection->corkWindowEnd = 0;
+		record_flush(connection);
+		while ((br_ssl_engine_current_state(engine) & BR_SSL_SENDREC) ==
+		       BR_SSL_SENDREC)
+		{
+			auto [sent, unfinished] = send_records(t, connection);
+			if (sent == -ECOMPARTMENTFAIL)
+			{
+				return -ENOTCONN;
+			}
+			if (sent <= 0)
+			{
+				return sent == 0 ? -ENOTCONN : sent;
+			}
+		}
+		return 0;
+	}
+
+	/**
+	 * If the auto-cork window has closed, ask the engine to flush the data
+	 * that it is holding back.  The resulting records are sent by the caller.
+	 */
+	void corked_window_check(TLSContext *connection)
+	{
+		if ((connection->corkWindowEnd != 0) &&
+		    (rdcycle64() >= connection->corkWindowEnd))
+		{
+			Debug::log("Auto-cork window closed, flushing");
+			connection->corkWindowEnd = 0;
+			record_flush(connection);
+		}
+	}
+
+	/**
+	 * Record a new handshake state for `connection` and wake any threads
+	 * waiting for the handshake to finish.
+	 */
+	void handshake_state_set(TLSContext *connection, HandshakeState state)
+	{
+		connection->handshakeState = state;
+		futex_wake(&connection->handshakeState,
+		           std::numeric_limits<uint32_t>::max());
+	}
+
+	/**
+	 * Compute the handshake phase timers once the handshake has completed.
+	 * The engine does all of its handshake cryptography while processing
+	 * received records, so the engine time is subtracted from the time spent
+	 * waiting for each flight.
+	 */
+	void handshake_statistics_update(TLSContext *connection)
+	{
+		auto    &statistics = connection->statistics;
+		uint64_t end        = rdcycle64();
+		if (connection->serverFlightEnd == 0)
+		{
+			connection->serverFlightEnd = end;
+			connection->engineCyclesAtServerFlightEnd =
+			  connection->engineCycles;
+		}
+		statistics.handshakeCycles = end - connection->handshakeStart;
+		statistics.serverFlightCycles =
+		  connection->serverFlightEnd - connection->handshakeStart -
+		  connection->engineCyclesAtServerFlightEnd;
+		statistics.keyExchangeCycles =
+		  connection->engineCycles - statistics.x509Cycles;
+		statistics.finishedCycles =
+		  end - connection->serverFlightEnd -
+		  (connection->engineCycles - connection->engineCyclesAtServerFlightEnd);
+	}
+
+	/**
+	 * Drive the initial handshake for `connection` until it completes, it
+	 * fails, or the timeout expires.  This must be called with the
+	 * connection's lock held, or before the connection has been returned to
+	 * the caller.
+	 *
+	 * A client connection that has no socket yet first connects to the host
+	 * (which includes resolving its name).  If the timeout expires before the
+	 * connection is made then the next call tries again.
+	 *
+	 * Returns 0 if the handshake has completed, `-EINPROGRESS` if the timeout
+	 * expired first, or `-ECONNABORTED` if the handshake failed.
+	 */
+	int handshake_run(Timeout *t, TLSContext *connection)
+	{
+		if (connection->handshakeState == HandshakeComplete)
+		{
+			return 0;
+		}
+		if (connection->handshakeState == HandshakeFailed)
+		{
+			return -ECONNABORTED;
+		}
+		auto *engine = connection->engine;
+		auto  fail   = [&]() {
+			handshake_state_set(connection, HandshakeFailed);
+			return -ECONNABORTED;
+		};
+		if ((connection->socket == nullptr) &&
+		    (connection->connectionCapability != nullptr))
+		{
+			uint64_t connectStart = rdcycle64();
+			connection->socket    = network_socket_connect_tcp(
+			   t, connection->allocator, connection->connectionCapability);
+			if (connection->socket == nullptr)
+			{
+				// The network API doesn't distinguish running out of time
+				// from failing, so treat failure with time left as fatal.
+				if (!t->may_block())
+				{
+					return -EINPROGRESS;
+				}
+				Debug::log("Failed to connect to host");
+				return fail();
+			}
+			connection->statistics.tcpConnectCycles =
+			  rdcycle64() - connectStart;
+		}
+		if (connection->handshakeStart == 0)
+		{
+			connection->handshakeStart = rdcycle64();
+		}
+		// Note from the BearSSL API spec: 'The first time the sendapp channel
+		// opens marks the completion of the initial handshake'. We are thus
+		// safe to return as soon as we see the first `BR_SSL_SENDAPP` flag.
+		for (auto state = br_ssl_engine_current_state(engine);
+		     ((state & (BR_SSL_SENDAPP)) == 0);
+		     state = br_ssl_engine_current_state(engine))
+		{
+			Debug::log("TLS state: {}", state);
+			Debug::log("Last error: {}", br_ssl_engine_last_error(engine));
+			if ((state & BR_SSL_CLOSED) == BR_SSL_CLOSED)
+			{
+				Debug::log("Connection closed, last error: {}",
+				           br_ssl_engine_last_error(engine));
+				return fail();
+			}
+			if ((state & BR_SSL_SENDREC) == BR_SSL_SENDREC)
+			{
+				// The first time that we have something to send after
+				// receiving records, the server's first flight (ServerHello to
+				// ServerHelloDone) has been processed.
+				if ((connection->serverFlightEnd == 0) &&
+				    (connection->statistics.recordsIn > 0))
+				{
+					connection->serverFlightEnd = rdcycle64();
+					connection->engineCyclesAtServerFlightEnd =
+					  connection->engineCycles;
+				}
+				// If we need to send records, send them first.
+				auto [sent, unfinished] = send_records(t, connection);
+				if (sent == -ETIMEDOUT)
+				{
+					return -EINPROGRESS;
+				}
+				if (sent <= 0)
+				{
+					return fail();
+				}
+			}
+			else if ((state & BR_SSL_RECVREC) == BR_SSL_RECVREC)
+			{
+				int received = receive_records(t, connection);
+				if (received == -ETIMEDOUT)
+				{
+					return -EINPROGRESS;
+				}
+				if (received <= 0)
+				{
+					return fail();
+				}
+			}
+			else
+			{
+				if (!t->may_block())
+				{
+					return -EINPROGRESS;
+				}
+			}
+		}
+		handshake_statistics_update(connection);
+		handshake_state_set(connection, HandshakeComplete);
+		return 0;
+	}
+
+	/**
+	 * Destroy a TLS context that was created by `tls_context_create`.  The
+	 * caller must either hold the lock or be the only holder of the sealed
+	 * capability.
+	 */
+	void tls_context_destroy(SObj sealed, TLSContext *context)
+	{
+		auto allocator = context->allocator;
+		context->~TLSContext();
+		token_obj_destroy(allocator, tls_key(), sealed);
+	}
+
+	/**
+	 * Allocate I/O buffers for `engine`, and a sealed TLS context that owns
+	 * them, `socket` and `sslContext`.  The input buffer is `inputBufferSize`
+	 * bytes.  Returns the sealed context on success, and provides the
+	 * unsealed version via `context`, after releasing `socket` and
+	 * `sslContext` into it.  Returns `nullptr` on failure, leaving the caller
+	 * with ownership of `socket` and `sslContext`.
+	 */
+	template<typename SocketPointer, typename ContextPointer>
+	SObj tls_context_seal(Timeout               *t,
+	                      SObj                   allocator,
+	                      SocketPointer         &socket,
+	                      ContextPointer        &sslContext,
+	                      br_ssl_engine_context *engine,
+	                      size_t                 inputBufferSize,
+	                      TLSContext           *&context)
+	{
+		auto deleter = [=](void *ptr) { heap_free(allocator, ptr); };
+		std::unique_ptr<unsigned char, decltype(deleter)> iobufIn{
+		  static_cast<unsigned char *>(
+		    heap_allocate(t, allocator, inputBufferSize)),
+		  deleter};
+		std::unique_ptr<unsigned char, decltype(deleter)> iobufOut{
+		  static_cast<unsigned char *>(
+		    heap_allocate(t, allocator, OutputBufferSize)),
+		  deleter};
+		if (!Capability{iobufIn.get()}.is_valid() ||
+		    !Capability{iobufOut.get()}.is_valid())
+		{
+			Debug::log("Failed to allocate buffers");
+			return nullptr;
+		}
+
+		Debug::log("Setting up TLS buffers");
+		br_ssl_engine_set_buffers_bidi(engine,
+		                               iobufIn.get(),
+		                               inputBufferSize,
+		                               iobufOut.get(),
+		                               OutputBufferSize);
+
+		auto entropy = rand();
+		br_ssl_engine_inject_entropy(engine, &entropy, sizeof(entropy));
+
+		void *unsealed;
+		SObj  sealed = token_sealed_unsealed_alloc(
+		   t, allocator, tls_key(), sizeof(TLSContext), &unsealed);
+		Debug::log("Created tls context sealed with {}", tls_key());
+		if (sealed == nullptr)
+		{
+			Debug::log("Failed to allocate TLS context");
+			return nullptr;
+		}
+		context = new (unsealed) TLSContext{socket.release(),
+		                                    allocator,
+		                                    sslContext.release(),
+		                                    engine,
+		                                    iobufIn.release(),
+		                                    iobufOut.release()};
+		return sealed;
+	}
+
+	/**
+	 * Set up a TLS context for the host identified by `connectionCapability`
+	 * that is ready to start the handshake.  This does not connect to the
+	 * host: `handshake_run` does that before sending the first record.
+	 * Returns the sealed context on success, and provides the unsealed
+	 * version via `context`.  Returns `nullptr` on failure.
+	 *
+	 * If `trustAnchorStore` is not null then trust anchors are selected from
+	 * it, and `trustAnchors` and `trustAnchorsCount` are ignored.  The caller
+	 * must hold a reference to the store, which is passed to the connection
+	 * on success.
+	 */
+	SObj tls_context_create(Timeout                    *t,
+	                        SObj                        allocator,
+	                        SObj                        connectionCapability,
+	                        const br_x509_trust_anchor *trustAnchors,
+	                        size_t                      trustAnchorsCount,
+	                        TrustAnchorStore           *trustAnchorStore,
+	                        TLSContext                *&context)
+	{
+		if (trustAnchorStore != nullptr)
+		{
+			trustAnchors      = trustAnchorStore->anchors;
+			trustAnchorsCount = trustAnchorStore->anchorsCount;
+		}
+		const char *hostname = network_host_get(connectionCapability);
+		if (hostname == nullptr)
+		{
+			Debug::log("Failed to get hostname");
+			return nullptr;
+		}
+		// The TCP connection is made by `handshake_run`, so that the context
+		// starts without a socket.
+		std::unique_ptr<struct SObjStruct, void (*)(SObj)> socket{nullptr,
+		                                                          nullptr};
+		auto deleter = [=](void *ptr) { heap_free(allocator, ptr); };
+		std::unique_ptr<br_ssl_client_context, decltype(deleter)> clientContext{
+		  static_cast<br_ssl_client_context *>(
+		    heap_allocate(t, allocator, sizeof(br_ssl_client_context))),
+		  deleter};
+		if (!Capability{clientContext.get()}.is_valid())
+		{
+			Debug::log("Failed to allocate client context");
+			return nullptr;
+		}
+		std::unique_ptr<br_x509_minimal_context, decltype(deleter)> x509Context{
+		  static_cast<br_x509_minimal_context *>(
+		    heap_allocate(t, allocator, sizeof(br_x509_minimal_context))),
+		  deleter};
+		if (!Capability{x509Context.get()}.is_valid())
+		{
+			Debug::log("Failed to allocate X509 context");
+			return nullptr;
+		}
+		Debug::log("Initialising TLS context");
+		if (!br_ssl_client_init(clientContext.get(),
+		                        x509Context.get(),
+		                        trustAnchors,
+		                        trustAnchorsCount))
+		{
+			Debug::log("Failed to initialise client context");
+			return nullptr;
+		}
+		std::unique_ptr<IndexedX509Context, decltype(deleter)>
+		  indexedX509Context{nullptr, deleter};
+		if (trustAnchorStore != nullptr)
+		{
+			indexedX509Context.reset(static_cast<IndexedX509Context *>(
+			  heap_allocate(t, allocator, sizeof(IndexedX509Context))));
+			if (!Capability{indexedX509Context.get()}.is_valid())
+			{
+				Debug::log("Failed to allocate indexed X509 context");
+				return nullptr;
+			}
+			indexed_x509_init(
+			  indexedX509Context.get(), x509Context.get(), trustAnchorStore);
+			br_ssl_engine_set_x509(&clientContext->eng,
+			                       &indexedX509Context->vtable);
+		}
+
+		auto *client = clientContext.get();
+		SObj  sealed = tls_context_seal(t,
+		                                allocator,
+		                                socket,
+		                                clientContext,
+		                                &client->eng,
+		                                ClientInputBufferSize,
+		                                context);
+		if (sealed == nullptr)
+		{
+			return nullptr;
+		}
+		context->connectionCapability = connectionCapability;
+		context->x509Context          = x509Context.release();
+		context->indexedX509Context   = indexedX509Context.release();
+
+		// Interpose on the X.509 engine to measure certificate validation.
+		context->x509Timer = {&TimedX509Vtable,
+		                      context->engine->x509ctx,
+		                      &context->statistics.x509Cycles};
+		br_ssl_engine_set_x509(context->engine, &context->x509Timer.vtable);
+
+		Debug::log("Resetting TLS connection for {}", hostname);
+		br_ssl_client_reset(client, hostname, 0);
+		return sealed;
+	}
+
+	/**
+	 * Process records from the network until the engine of `connection`,
+	 * whose lock must be held, has application data ready to read.  Returns
+	 * zero when data are ready, or a negative error code.
+	 */
+	int wait_for_application_data(Timeout *t, TLSContext *connection)
+	{
+		auto *engine = connection->engine;
+		while (true)
+		{
+			auto state = br_ssl_engine_current_state(engine);
+			if ((state & BR_SSL_CLOSED) == BR_SSL_CLOSED)
+			{
+				return -ENOTCONN;
+			}
+			if ((state & BR_SSL_RECVAPP) == BR_SSL_RECVAPP)
+			{
+				return 0;
+			}
+			if ((state & BR_SSL_RECVREC) == BR_SSL_RECVREC)
+			{
+				// Don't hold back data that the peer may be waiting
+				// for while we wait for the peer.
+				if (connection->corkWindowEnd != 0)
+				{
+					if (int ret = corked_flush(t, connection); ret != 0)
+					{
+						return ret;
+					}
+				}
+				int received = receive_records(t, connection);
+				if (received == -ETIMEDOUT)
+				{
+					return -ETIMEDOUT;
+				}
+				if (received <= 0)
+				{
+					// The receive failed. This can happen for a
+					// number of reasons, but most likely if the
+					// link died. After getting -ENOTCONN, the
+					// caller of this API should close the TLS
+					// socket.
+					return -ENOTCONN;
+				}
+				// Next loop iteration, we'll check whether the
+				// records contained application data.
+			}
+			else
+			{
+				if (!t->may_block())
+				{
+					return -ETIMEDOUT;
+				}
+			}
+		}
+	}
+
 	/**
 	 * Helper to receive data from the TLS connection. This uses the
 	 * `prepareBuffer` function to acquire a buffer for the data.
@@ -269,221 +1098,443 @@ namespace
 		}
 		return with_sealed_tls_context(
 		  t, sealedConnection, [&](TLSContext *connection) {
-			  auto *engine = &connection->clientContext->eng;
-			  while (true)
+			  if (int ret = wait_for_application_data(t, connection);
+			      ret != 0)
+			  {
+				  return ret;
+			  }
+			  // There are data ready to receive, return them
+			  // immediately.
+			  auto          *engine = connection->engine;
+			  size_t         unsignedLength;
+			  int            length;
+			  unsigned char *inputBuffer =
+			    br_ssl_engine_recvapp_buf(engine, &unsignedLength);
+			  Debug::log("TLS engine has {} bytes ready to receive, "
+			             "returning to caller",
+			             unsignedLength);
+			  length = unsignedLength;
+			  void *receivedBuffer =
+			    prepareBuffer(length, connection->allocator);
+			  if (receivedBuffer == nullptr)
 			  {
-				  auto state = br_ssl_engine_current_state(engine);
-				  if ((state & BR_SSL_CLOSED) == BR_SSL_CLOSED)
-				  {
-					  return -ENOTCONN;
-				  }
-				  if ((state & BR_SSL_RECVAPP) == BR_SSL_RECVAPP)
-				  {
-					  // If there are data ready to receive, return
-					  // it immediately.
-					  size_t         unsignedLength;
-					  int            length;
-					  unsigned char *inputBuffer =
-					    br_ssl_engine_recvapp_buf(engine, &unsignedLength);
-					  Debug::log("TLS engine has {} bytes ready to receive, "
-					             "returning to caller",
-					             unsignedLength);
-					  length = unsignedLength;
-					  void *receivedBuffer =
-					    prepareBuffer(length, connection->allocator);
-					  if (receivedBuffer == nullptr)
-					  {
-						  // `prepareBuffer` sets length to an
-						  // error code if it cannot supply an
-						  // appropriate buffer
-						  Debug::log("TLS engine failed to prepare receive "
-						             "buffer, error {}",
-						             length);
-
-						  return length;
-					  }
-					  memcpy(receivedBuffer, inputBuffer, length);
-					  br_ssl_engine_recvapp_ack(engine, length);
-					  Debug::log(
-					    "Received {} bytes into {}", length, receivedBuffer);
-					  return ssize_t(length);
-				  }
-				  if ((state & BR_SSL_RECVREC) == BR_SSL_RECVREC)
-				  {
-					  int received = receive_records(t, connection);
-					  if (received == -ETIMEDOUT)
-					  {
-						  return -ETIMEDOUT;
-					  }
-					  if (received <= 0)
-					  {
-						  // The receive failed. This
-						  // can happen for a number of
-						  // reasons, but most likely
-						  // if the link died. After
-						  // getting -ENOTCONN, the
-						  // caller of this API should
-						  // close the TLS socket.
-						  return -ENOTCONN;
-					  }
-					  // Next loop iteration, we'll try pulling the
-					  // data out of the TLS engine.
-				  }
-				  else
-				  {
-					  if (!t->may_block())
-					  {
-						  return -ETIMEDOUT;
-					  }
-				  }
+				  // `prepareBuffer` sets length to an error code if
+				  // it cannot supply an appropriate buffer
+				  Debug::log("TLS engine failed to prepare receive "
+				             "buffer, error {}",
+				             length);
+
+				  return length;
 			  }
+			  memcpy(receivedBuffer, inputBuffer, length);
+			  br_ssl_engine_recvapp_ack(engine, length);
+			  connection->statistics.applicationBytesIn += length;
+			  Debug::log("Received {} bytes into {}", length, receivedBuffer);
+			  return length;
 		  });
 	}
 
+	/**
+	 * Send the contents of the `count` buffers in `vectors` on
+	 * `connection`, whose lock must be held.  The entries in `vectors` are
+	 * updated to describe the data that have not yet been sent.  The engine
+	 * is flushed, according to `flags` and the auto-cork setting, only once
+	 * all of the data have been handed to it.  Returns the number of bytes
+	 * sent or a negative error code.
+	 */
+	ssize_t send_vectors(Timeout       *t,
+	                     TLSContext    *connection,
+	                     TLSSendVector *vectors,
+	                     size_t         count,
+	                     int            flags)
+	{
+		auto  *engine      = connection->engine;
+		bool   forceLoop   = false;
+		size_t totalSent   = 0;
+		size_t recordLimit = record_size_limit(connection);
+		size_t current     = 0;
+		// Skip empty buffers so that `current < count` means that there are
+		// data left to send.
+		auto skipEmpty = [&]() {
+			while ((current < count) && (vectors[current].length == 0))
+			{
+				current++;
+			}
+		};
+		skipEmpty();
+		corked_window_check(connection);
+		if (connection->recordFill >= recordLimit)
+		{
+			// The limit has shrunk below the size of a corked record.
+			record_flush(connection);
+		}
+		while ((current < count) || forceLoop)
+		{
+			forceLoop  = false;
+			auto state = br_ssl_engine_current_state(engine);
+			if ((state & BR_SSL_CLOSED) == BR_SSL_CLOSED)
+			{
+				return -ENOTCONN;
+			}
+			if ((state & BR_SSL_SENDREC) == BR_SSL_SENDREC)
+			{
+				// If there's data ready to send over the network, prioritise
+				// sending it
+				auto [sent, unfinished] = send_records(t, connection);
+				if (sent == -ECOMPARTMENTFAIL)
+				{
+					// The TCP/IP stack crashed; tell the
+					// caller that the link is dead.
+					return -ENOTCONN;
+				}
+				if (sent <= 0)
+				{
+					return sent;
+				}
+				forceLoop = unfinished;
+			}
+			else if (((state & BR_SSL_SENDAPP) == BR_SSL_SENDAPP) &&
+			         (current < count))
+			{
+				void  *buffer = vectors[current].buffer;
+				size_t length = vectors[current].length;
+				size_t         readyLength;
+				unsigned char *readyBuffer =
+				  br_ssl_engine_sendapp_buf(engine, &readyLength);
+				// Don't let the record grow past the current limit.  The
+				// engine closes the record itself if we fill its buffer.
+				size_t toSend = std::min(
+				  {length, readyLength, recordLimit - connection->recordFill});
+				Debug::log("TLS engine can accept {} bytes, sending {} bytes",
+				           readyLength,
+				           toSend);
+				int ret = heap_claim_fast(t, buffer);
+				if (ret != 0)
+				{
+					return ret;
+				}
+				if (!check_pointer<Permission::Load>(buffer, toSend))
+				{
+					return -EPERM;
+				}
+				memcpy(readyBuffer, buffer, toSend);
+				br_ssl_engine_sendapp_ack(engine, toSend);
+				connection->statistics.applicationBytesOut += toSend;
+				if (connection->burstBytes < RecordGrowthThreshold)
+				{
+					connection->burstBytes += toSend;
+				}
+				connection->recordFill =
+				  (toSend == readyLength) ? 0 : connection->recordFill + toSend;
+				vectors[current].length -= toSend;
+				vectors[current].buffer =
+				  static_cast<uint8_t *>(buffer) + toSend;
+				totalSent += toSend;
+				skipEmpty();
+				if (connection->recordFill >= recordLimit)
+				{
+					// The record has reached the size limit, send it
+					// regardless of the flush policy.
+					record_flush(connection);
+				}
+				else if (((flags & TLSSendNoFlush) == 0) && (current == count))
+				{
+					if (connection->autocorkMilliseconds == 0)
+					{
+						record_flush(connection);
+					}
+					else if (connection->corkWindowEnd == 0)
+					{
+						// The engine will build a record as soon as its
+						// buffer is full, so we only need to bound how
+						// many writes a partial record coalesces.
+						constexpr uint64_t CyclesPerMilliSecond =
+						  CPU_TIMER_HZ / 1000;
+						connection->corkWindowEnd =
+						  rdcycle64() + connection->autocorkMilliseconds *
+						                  CyclesPerMilliSecond;
+					}
+				}
+				// Make sure that we try to send the data we just put in the
+				// buffer.
+				forceLoop = true;
+			}
+			else
+			{
+				// If all of the data have been handed to the engine and
+				// there are no records to send, we're done.
+				if (current == count)
+				{
+					break;
+				}
+				if (t->may_block())
+				{
+					Timeout shortSleep{1};
+					thread_sleep(&shortSleep);
+					t->elapse(shortSleep.elapsed);
+				}
+				// Check for timeout. Note that we want to
+				// run this after the short sleep as we may
+				// now have timed out.
+				if (!t->may_block())
+				{
+					// Timed out.
+					break;
+				}
+			}
+		}
+		return totalSent > 0 ? ssize_t(totalSent) : -ETIMEDOUT;
+	}
+
 } // namespace
 
+bool tls_engine_crypto_init(br_ssl_engine_context *engine)
+{
+	const TLSCryptoBackend *backend = crypto_backend_checked();
+	if (backend == nullptr)
+	{
+		return false;
+	}
+
+	br_ssl_engine_set_hash(engine, br_sha256_ID, backend->sha256);
+	Debug::log("Setting vtable for br_sha256_ID: {}", backend->sha256);
+
+	/*
+	 * Set the PRF implementations.
+	 */
+	br_ssl_engine_set_prf_sha256(engine, &br_tls12_sha256_prf);
+
+	/*
+	 * Symmetric encryption. The GCM record layer is BearSSL's, the AES
+	 * and GHASH implementations come from the crypto backend.
+	 */
+	br_ssl_engine_set_gcm(
+	  engine, &br_sslrec_in_gcm_vtable, &br_sslrec_out_gcm_vtable);
+	br_ssl_engine_set_aes_ctr(engine, backend->aesCounter);
+	br_ssl_engine_set_ghash(engine, backend->ghash);
+	return true;
+}
+
 SObj tls_connection_create(Timeout                    *t,
                            SObj                        allocator,
                            SObj                        connectionCapability,
                            const br_x509_trust_anchor *trustAnchors,
                            size_t                      trustAnchorsCount)
 {
-	const char *hostname = network_host_get(connectionCapability);
-	if (hostname == nullptr)
+	TLSContext *context = nullptr;
+	SObj        sealed  = tls_context_create(t,
+	                                         allocator,
+	                                         connectionCapability,
+	                                         trustAnchors,
+	                                         trustAnchorsCount,
+	                                         nullptr,
+	                                         context);
+	if (sealed == nullptr)
+	{
+		return nullptr;
+	}
+	// Nothing else can see this connection yet, so we can drive the
+	// handshake without acquiring the lock.
+	if (handshake_run(t, context) != 0)
+	{
+		Debug::log("TLS handshake did not complete");
+		tls_context_destroy(sealed, context);
+		return nullptr;
+	}
+	return sealed;
+}
+
+SObj tls_connection_create_async(Timeout                    *t,
+                                 SObj                        allocator,
+                                 SObj                        connectionCapability,
+                                 const br_x509_trust_anchor *trustAnchors,
+                                 size_t                      trustAnchorsCount)
+{
+	TLSContext *context = nullptr;
+	return tls_context_create(t,
+	                          allocator,
+	                          connectionCapability,
+	                          trustAnchors,
+	                          trustAnchorsCount,
+	                          nullptr,
+	                          context);
+}
+
+SObj tls_connection_create_with_store(Timeout *t,
+                                      SObj     allocator,
+                                      SObj     connectionCapability,
+                                      SObj     trustAnchorStore)
+{
+	auto *store = trust_anchor_store_unseal(trustAnchorStore);
+	if (store == nullptr)
+	{
+		Debug::log("Invalid trust anchor store {}", trustAnchorStore);
+		return nullptr;
+	}
+	// Take the reference before reading the store, so that it cannot be
+	// destroyed underneath us.
+	if (!trust_anchor_store_retain(t, store))
 	{
-		Debug::log("Failed to get hostname");
 		return nullptr;
 	}
+	TLSContext *context = nullptr;
+	SObj        sealed  = tls_context_create(t,
+	                                         allocator,
+	                                         connectionCapability,
+	                                         nullptr,
+	                                         0,
+	                                         store,
+	                                         context);
+	if (sealed == nullptr)
+	{
+		trust_anchor_store_release(store);
+		return nullptr;
+	}
+	if (handshake_run(t, context) != 0)
+	{
+		Debug::log("TLS handshake did not complete");
+		tls_context_destroy(sealed, context);
+		return nullptr;
+	}
+	return sealed;
+}
+
+SObj tls_server_connection_create(Timeout *t,
+                                  SObj     allocator,
+                                  SObj     sealedServer,
+                                  SObj     acceptedSocket)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return nullptr;
+	}
+	// From here on, the socket is closed if anything fails.
 	auto socketDeleter = [&](SObj s) {
 		Timeout unlimited{UnlimitedTimeout};
 		network_socket_close(&unlimited, allocator, s);
 		t->elapse(unlimited.elapsed);
 	};
 	std::unique_ptr<struct SObjStruct, decltype(socketDeleter)> socket{
-	  network_socket_connect_tcp(t, allocator, connectionCapability),
-	  socketDeleter};
-	if (socket == nullptr)
+	  acceptedSocket, socketDeleter};
+	auto *server = tls_server_unseal(sealedServer);
+	if (server == nullptr)
 	{
-		Debug::log("Failed to connect to host");
+		Debug::log("Invalid TLS server {}", sealedServer);
 		return nullptr;
 	}
+	// Count the connection before reading the server, so that it cannot be
+	// destroyed underneath us.  From here on, the count is dropped if
+	// anything fails before the connection takes it over.
+	if (!tls_server_retain(t, server))
+	{
+		return nullptr;
+	}
+	auto serverReleaser = [](TLSServer *s) { tls_server_release(s); };
+	std::unique_ptr<TLSServer, decltype(serverReleaser)> serverReference{
+	  server, serverReleaser};
 	auto deleter = [=](void *ptr) { heap_free(allocator, ptr); };
-	std::unique_ptr<br_ssl_client_context, decltype(deleter)> clientContext{
-	  static_cast<br_ssl_client_context *>(
-	    heap_allocate(t, allocator, sizeof(br_ssl_client_context))),
+	std::unique_ptr<br_ssl_server_context, decltype(deleter)> serverContext{
+	  static_cast<br_ssl_server_context *>(
+	    heap_allocate(t, allocator, sizeof(br_ssl_server_context))),
 	  deleter};
-	if (!Capability{clientContext.get()}.is_valid())
+	if (!Capability{serverContext.get()}.is_valid())
 	{
-		Debug::log("Failed to allocate client context");
+		Debug::log("Failed to allocate server context");
 		return nullptr;
 	}
-	std::unique_ptr<br_x509_minimal_context, decltype(deleter)> x509Context{
-	  static_cast<br_x509_minimal_context *>(
-	    heap_allocate(t, allocator, sizeof(br_x509_minimal_context))),
-	  deleter};
-	auto *engine = &clientContext->eng;
-	if (!Capability{x509Context.get()}.is_valid())
+	if (!tls_server_engine_init(serverContext.get(), server))
 	{
-		Debug::log("Failed to allocate X509 context");
+		Debug::log("Failed to initialise server context");
 		return nullptr;
 	}
-	Debug::log("Initialising TLS context");
-	br_ssl_client_init(
-	  clientContext.get(), x509Context.get(), trustAnchors, trustAnchorsCount);
-
-	static constexpr size_t                           MinimumBufferSize = 837;
-	std::unique_ptr<unsigned char, decltype(deleter)> iobufIn{
-	  static_cast<unsigned char *>(
-	    heap_allocate(t, allocator, MinimumBufferSize)),
-	  deleter};
-	std::unique_ptr<unsigned char, decltype(deleter)> iobufOut{
-	  static_cast<unsigned char *>(
-	    heap_allocate(t, allocator, MinimumBufferSize)),
-	  deleter};
-	if (!Capability{iobufIn.get()}.is_valid() ||
-	    !Capability{iobufOut.get()}.is_valid())
+	TLSContext *context = nullptr;
+	SObj        sealed  = tls_context_seal(t,
+	                                       allocator,
+	                                       socket,
+	                                       serverContext,
+	                                       &serverContext->eng,
+	                                       ServerInputBufferSize,
+	                                       context);
+	if (sealed == nullptr)
 	{
-		Debug::log("Failed to allocate buffers");
 		return nullptr;
 	}
+	context->server = serverReference.release();
+	br_ssl_server_reset(
+	  static_cast<br_ssl_server_context *>(context->sslContext));
+	// Nothing else can see this connection yet, so we can drive the
+	// handshake without acquiring the lock.
+	if (handshake_run(t, context) != 0)
+	{
+		Debug::log("TLS server handshake did not complete");
+		tls_context_destroy(sealed, context);
+		return nullptr;
+	}
+	return sealed;
+}
 
-	Debug::log("Setting up TLS buffers");
-	br_ssl_engine_set_buffers_bidi(&clientContext->eng,
-	                               iobufIn.get(),
-	                               MinimumBufferSize,
-	                               iobufOut.get(),
-	                               MinimumBufferSize);
-
-	auto entropy = rand();
-	br_ssl_engine_inject_entropy(
-	  &clientContext->eng, &entropy, sizeof(entropy));
+int tls_connection_progress(Timeout *t, SObj sealedConnection)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+	return with_sealed_tls_context(
+	  t,
+	  sealedConnection,
+	  [&](TLSContext *connection) { return handshake_run(t, connection); },
+	  true);
+}
 
-	void *unsealed;
-	SObj  sealed = token_sealed_unsealed_alloc(
-	   t, allocator, tls_key(), sizeof(TLSContext), &unsealed);
-	Debug::log("Created tls context sealed with {}", tls_key());
-	if (sealed == nullptr)
+int tls_connection_wait(Timeout *t, SObj sealedConnection)
+{
+	if (!check_timeout_pointer(t))
 	{
-		Debug::log("Failed to allocate TLS context");
-		return nullptr;
+		return -EINVAL;
 	}
-	TLSContext *context = new (unsealed) TLSContext{socket.release(),
-	                                                allocator,
-	                                                clientContext.release(),
-	                                                x509Context.release(),
-	                                                iobufIn.release(),
-	                                                iobufOut.release()};
-	auto        cleanup = [&](auto *) {
-        context->~TLSContext();
-        token_obj_destroy(allocator, tls_key(), sealed);
-	};
-	std::unique_ptr<struct SObjStruct, decltype(cleanup)> sealedContext{
-	  sealed, cleanup};
-
-	// Try to connect to the server.
-	Debug::log("Resetting TLS connection for {}", hostname);
-	br_ssl_client_reset(context->clientContext, hostname, 0);
-
-	// Note from the BearSSL API spec: 'The first time the sendapp channel
-	// opens marks the completion of the initial handshake'. We are thus
-	// safe to return as soon as we see the first `BR_SSL_SENDAPP` flag.
-	for (auto state = br_ssl_engine_current_state(engine);
-	     ((state & (BR_SSL_SENDAPP)) == 0);
-	     state = br_ssl_engine_current_state(engine))
-	{
-		Debug::log("TLS state: {}", state);
-		Debug::log("Last error: {}", br_ssl_engine_last_error(engine));
-		if ((state & BR_SSL_CLOSED) == BR_SSL_CLOSED)
-		{
-			Debug::log("Connection closed, last error: {}",
-			           br_ssl_engine_last_error(engine));
-			return nullptr;
-		}
-		if ((state & BR_SSL_SENDREC) == BR_SSL_SENDREC)
-		{
-			// If we need to send records, send them first.
-			auto [sent, unfinished] = send_records(t, context);
-			if (sent <= 0)
-			{
-				return nullptr;
-			}
-		}
-		else if ((state & BR_SSL_RECVREC) == BR_SSL_RECVREC)
-		{
-			if (receive_records(t, context) <= 0)
-			{
-				return nullptr;
-			}
-		}
-		else
+	Sealed<TLSContext> sealedContext{sealedConnection};
+	auto              *tls = token_unseal(tls_key(), sealedContext);
+	if (tls == nullptr)
+	{
+		Debug::log("Failed to unseal TLS context {}", sealedConnection);
+		return -EINVAL;
+	}
+	// Make sure that the context is not freed while we wait.  We do not
+	// take the lock: the thread driving the handshake holds it.  The fast
+	// claim only lasts until the next cross-compartment call, so it protects
+	// the context until the real claim is in place.
+	if (heap_claim_fast(t, tls) != 0)
+	{
+		return -EINVAL;
+	}
+	SObj allocator = tls->allocator;
+	if (heap_claim(allocator, tls) <= 0)
+	{
+		return -EINVAL;
+	}
+	uint32_t state;
+	while ((state = tls->handshakeState) == HandshakeInProgress)
+	{
+		if (futex_timed_wait(t, &tls->handshakeState, state) == -ETIMEDOUT)
 		{
-			if (!t->may_block())
-			{
-				return nullptr;
-			}
+			heap_free(allocator, tls);
+			return -ETIMEDOUT;
 		}
 	}
-	return sealedContext.release();
+	heap_free(allocator, tls);
+	return state == HandshakeComplete ? 0 : -ECONNABORTED;
+}
+
+int tls_connection_poll(Timeout *t, SObj sealedConnection)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+	return with_sealed_tls_context(
+	  t, sealedConnection, [&](TLSContext *connection) {
+		  return wait_for_application_data(t, connection);
+	  });
 }
 
 ssize_t tls_connection_send(Timeout *t,
@@ -498,86 +1549,263 @@ ssize_t tls_connection_send(Timeout *t,
 	}
 	return with_sealed_tls_context(
 	  t, sealedConnection, [&](TLSContext *connection) {
-		  auto  *engine    = &connection->clientContext->eng;
-		  bool   forceLoop = false;
-		  size_t totalSent = 0;
-		  while ((length > 0) || forceLoop)
+		  TLSSendVector vector{buffer, length};
+		  return send_vectors(t, connection, &vector, 1, flags);
+	  });
+}
+
+ssize_t tls_connection_sendv(Timeout             *t,
+                             SObj                 sealedConnection,
+                             const TLSSendVector *vectors,
+                             size_t               count,
+                             int                  flags)
+{
+	if (!check_timeout_pointer(t) || (count > TLSSendVectorMax))
+	{
+		return -EINVAL;
+	}
+	// Copy the vectors so that the caller cannot change them while we are
+	// using them.  Each buffer is checked as it is used.
+	TLSSendVector copy[TLSSendVectorMax];
+	if ((heap_claim_fast(t, vectors) != 0) ||
+	    !check_pointer<PermissionSet{Permission::Load}>(
+	      vectors, count * sizeof(TLSSendVector)))
+	{
+		return -EINVAL;
+	}
+	memcpy(copy, vectors, count * sizeof(TLSSendVector));
+	return with_sealed_tls_context(
+	  t, sealedConnection, [&](TLSContext *connection) {
+		  return send_vectors(t, connection, copy, count, flags);
+	  });
+}
+
+int tls_connection_autocork_set(Timeout *t,
+                                SObj     sealedConnection,
+                                uint32_t windowMilliseconds)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+	return with_sealed_tls_context(
+	  t, sealedConnection, [&](TLSContext *connection) {
+		  connection->autocorkMilliseconds = windowMilliseconds;
+		  // Turning auto-cork off should not leave data stranded.
+		  if (windowMilliseconds == 0 && connection->corkWindowEnd != 0)
 		  {
-			  forceLoop  = false;
-			  auto state = br_ssl_engine_current_state(engine);
-			  if ((state & BR_SSL_CLOSED) == BR_SSL_CLOSED)
-			  {
-				  return -ENOTCONN;
-			  }
-			  if ((state & BR_SSL_SENDREC) == BR_SSL_SENDREC)
-			  {
-				  // If there's data ready to send over the network, prioritise
-				  // sending it
-				  auto [sent, unfinished] = send_records(t, connection);
-				  if (sent == -ECOMPARTMENTFAIL)
-				  {
-					  // The TCP/IP stack crashed; tell the
-					  // caller that the link is dead.
-					  return -ENOTCONN;
-				  }
-				  if (sent <= 0)
-				  {
-					  return sent;
-				  }
-				  forceLoop = unfinished;
-			  }
-			  else if (((state & BR_SSL_SENDAPP) == BR_SSL_SENDAPP) &&
-			           (length > 0))
+			  return corked_flush(t, connection);
+		  }
+		  return 0;
+	  });
+}
+
+int tls_connection_flush(Timeout *t, SObj sealedConnection)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+	return with_sealed_tls_context(
+	  t, sealedConnection, [&](TLSContext *connection) {
+		  return corked_flush(t, connection);
+	  });
+}
+
+int tls_connection_park(Timeout *t, SObj sealedConnection)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+	return with_sealed_tls_context(
+	  t,
+	  sealedConnection,
+	  [&](TLSContext *connection) {
+		  if (connection->parked)
+		  {
+			  return 0;
+		  }
+		  if (connection->handshakeState != HandshakeComplete)
+		  {
+			  return -ENOTCONN;
+		  }
+		  auto *engine = connection->engine;
+		  // Send anything that is buffered so that the output buffer holds
+		  // no live data.
+		  if ((connection->recordFill != 0) ||
+		      ((br_ssl_engine_current_state(engine) & BR_SSL_SENDREC) ==
+		       BR_SSL_SENDREC))
+		  {
+			  if (int ret = corked_flush(t, connection); ret != 0)
 			  {
-				  size_t         readyLength;
-				  unsigned char *readyBuffer =
-				    br_ssl_engine_sendapp_buf(engine, &readyLength);
-				  size_t toSend = std::min(length, readyLength);
-				  Debug::log("TLS engine can accept {} bytes, sending {} bytes",
-				             readyLength,
-				             toSend);
-				  int ret = heap_claim_fast(t, buffer);
-				  if (ret != 0)
-				  {
-					  return ret;
-				  }
-				  if (!check_pointer<Permission::Load>(buffer, toSend))
-				  {
-					  return -EPERM;
-				  }
-				  memcpy(readyBuffer, buffer, toSend);
-				  br_ssl_engine_sendapp_ack(engine, toSend);
-				  length -= toSend;
-				  buffer = static_cast<uint8_t *>(buffer) + toSend;
-				  totalSent += toSend;
-				  if ((flags & TLSSendNoFlush) == 0)
-				  {
-					  br_ssl_engine_flush(engine, 0);
-				  }
-				  // Make sure that we try to send the data we just put in the
-				  // buffer.
-				  forceLoop = true;
+				  return ret;
 			  }
-			  else
+		  }
+		  auto state = br_ssl_engine_current_state(engine);
+		  if ((state & BR_SSL_CLOSED) == BR_SSL_CLOSED)
+		  {
+			  return -ENOTCONN;
+		  }
+		  // The input buffer holds live data if the application has not
+		  // read everything or if the engine has part of a record.
+		  if (((state & BR_SSL_RECVAPP) == BR_SSL_RECVAPP) ||
+		      (connection->recordsIn.headerBytes != 0) ||
+		      (connection->recordsIn.bodyRemaining != 0))
+		  {
+			  return -EBUSY;
+		  }
+		  // The X.509 engine is needed only for handshakes, so refuse
+		  // renegotiation and free it.
+		  br_ssl_engine_add_flags(engine, BR_OPT_NO_RENEGOTIATION);
+		  if (connection->x509Context != nullptr)
+		  {
+			  heap_free(connection->allocator, connection->x509Context);
+			  connection->x509Context = nullptr;
+		  }
+		  if (connection->indexedX509Context != nullptr)
+		  {
+			  trust_anchor_store_release(
+			    connection->indexedX509Context->store);
+			  heap_free(connection->allocator,
+			            connection->indexedX509Context);
+			  connection->indexedX509Context = nullptr;
+		  }
+		  heap_free(connection->allocator, connection->iobufIn);
+		  heap_free(connection->allocator, connection->iobufOut);
+		  connection->iobufIn  = nullptr;
+		  connection->iobufOut = nullptr;
+		  engine->ibuf         = nullptr;
+		  engine->obuf         = nullptr;
+		  connection->parked   = true;
+		  Debug::log("Parked TLS connection");
+		  return 0;
+	  },
+	  true);
+}
+
+int tls_connection_reconnect(Timeout *t, SObj sealedConnection)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+	return with_sealed_tls_context(
+	  t,
+	  sealedConnection,
+	  [&](TLSContext *connection) {
+		  if (connection->connectionCapability == nullptr)
+		  {
+			  return -EINVAL;
+		  }
+		  // If the server declines to resume the session then we need the
+		  // X.509 engine for a full handshake, and parking freed it.
+		  // Unparking does not restore it, so check for the engine itself.
+		  if (connection->x509Context == nullptr)
+		  {
+			  return -ENOTSUP;
+		  }
+		  const char *hostname =
+		    network_host_get(connection->connectionCapability);
+		  if (hostname == nullptr)
+		  {
+			  return -EINVAL;
+		  }
+		  // The old link is assumed to be dead, so don't try to send a
+		  // close_notify on it.
+		  if (connection->socket != nullptr)
+		  {
+			  Timeout unlimited{UnlimitedTimeout};
+			  network_socket_close(
+			    &unlimited, connection->allocator, connection->socket);
+			  t->elapse(unlimited.elapsed);
+		  }
+		  uint64_t connectStart = rdcycle64();
+		  connection->socket    = network_socket_connect_tcp(
+		     t, connection->allocator, connection->connectionCapability);
+		  if (connection->socket == nullptr)
+		  {
+			  Debug::log("Failed to reconnect to host");
+			  handshake_state_set(connection, HandshakeFailed);
+			  return -ENOTCONN;
+		  }
+		  auto &statistics            = connection->statistics;
+		  statistics.tcpConnectCycles = rdcycle64() - connectStart;
+		  statistics.x509Cycles       = 0;
+		  // Nothing buffered for the old link can be sent on the new one.
+		  connection->recordsIn                     = {};
+		  connection->recordsOut                    = {};
+		  connection->recordFill                    = 0;
+		  connection->corkWindowEnd                 = 0;
+		  connection->burstBytes                    = 0;
+		  connection->handshakeStart                = 0;
+		  connection->serverFlightEnd               = 0;
+		  connection->engineCycles                  = 0;
+		  connection->engineCyclesAtServerFlightEnd = 0;
+		  connection->handshakeState                = HandshakeInProgress;
+		  // The engine keeps the parameters of the last session, so
+		  // resetting it with `resume_session` set offers the session ID
+		  // to the server.  If the server accepts, the handshake takes a
+		  // single round trip and skips the key exchange and certificate
+		  // validation.
+		  br_ssl_session_parameters previous;
+		  br_ssl_engine_get_session_parameters(connection->engine, &previous);
+		  Debug::log("Resuming TLS connection for {}", hostname);
+		  if (br_ssl_client_reset(
+		        static_cast<br_ssl_client_context *>(connection->sslContext),
+		        hostname,
+		        1) == 0)
+		  {
+			  handshake_state_set(connection, HandshakeFailed);
+			  return -ECONNABORTED;
+		  }
+		  statistics.reconnects++;
+		  int ret = handshake_run(t, connection);
+		  if (ret == 0)
+		  {
+			  br_ssl_session_parameters current;
+			  br_ssl_engine_get_session_parameters(connection->engine,
+			                                       &current);
+			  // A server that resumes a session echoes its ID.
+			  if ((previous.session_id_len != 0) &&
+			      (current.session_id_len == previous.session_id_len) &&
+			      (memcmp(current.session_id,
+			              previous.session_id,
+			              current.session_id_len) == 0))
 			  {
-				  if (t->may_block())
-				  {
-					  Timeout shortSleep{1};
-					  thread_sleep(&shortSleep);
-					  t->elapse(shortSleep.elapsed);
-				  }
-				  // Check for timeout. Note that we want to
-				  // run this after the short sleep as we may
-				  // now have timed out.
-				  if (!t->may_block())
-				  {
-					  // Timed out.
-					  break;
-				  }
+				  Debug::log("Resumed TLS session");
+				  statistics.sessionsResumed++;
 			  }
 		  }
-		  return totalSent > 0 ? int(totalSent) : -ETIMEDOUT;
-	  });
+		  return ret;
+	  },
+	  true);
+}
+
+int tls_connection_statistics(Timeout       *t,
+                              SObj           sealedConnection,
+                              TLSStatistics *statistics)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+	return with_sealed_tls_context(
+	  t,
+	  sealedConnection,
+	  [&](TLSContext *connection) {
+		  if (int ret = heap_claim_fast(t, statistics); ret != 0)
+		  {
+			  return ret;
+		  }
+		  if (!check_pointer<PermissionSet{Permission::Store}>(statistics))
+		  {
+			  return -EPERM;
+		  }
+		  *statistics = connection->statistics;
+		  return 0;
+	  },
+	  true);
 }
 
 NetworkReceiveResult tls_connection_receive(Timeout *t, SObj sealedConnection)
@@ -679,10 +1907,18 @@ int tls_connection_close(Timeout *t, SObj sealed)
 		Debug::log("Failed to acquire lock on TLS context during close");
 		return -ETIMEDOUT;
 	}
-	auto *engine = &tls->clientContext->eng;
-	br_ssl_engine_close(engine);
-	auto state = br_ssl_engine_current_state(&tls->clientContext->eng);
-	do
+	auto *engine = tls->engine;
+	// A parked connection needs its buffers back to send the close_notify
+	// alert.  If they cannot be allocated, or if the connection was never
+	// made, skip the graceful shutdown.
+	bool graceful = (tls->socket != nullptr) &&
+	                (!tls->parked || (tls_unpark(t, tls) == 0));
+	if (graceful)
+	{
+		br_ssl_engine_close(engine);
+	}
+	auto state = br_ssl_engine_current_state(tls->engine);
+	while (graceful && ((state & BR_SSL_CLOSED) != BR_SSL_CLOSED))
 	{
 		// Silently discard any pending app data
 		if ((state & BR_SSL_RECVAPP) == BR_SSL_RECVAPP)
@@ -727,14 +1963,17 @@ int tls_connection_close(Timeout *t, SObj sealed)
 				break;
 			}
 		}
-		state = br_ssl_engine_current_state(&tls->clientContext->eng);
-	} while ((state & BR_SSL_CLOSED) != BR_SSL_CLOSED);
+		state = br_ssl_engine_current_state(tls->engine);
+	}
+	// Wake anyone waiting for a handshake that will now never complete.
+	if (tls->handshakeState == HandshakeInProgress)
+	{
+		handshake_state_set(tls, HandshakeFailed);
+	}
 	// At this point, we have shut down the TLS connection.  We can now
 	// close the socket and free memory.  This is the point of no return,
 	// so upgrade the lock for destruction.
 	tls->lock.upgrade_for_destruction();
-	auto allocator = tls->allocator;
-	tls->~TLSContext();
-	token_obj_destroy(allocator, tls_key(), sealed);
+	tls_context_destroy(sealed, tls);
 	return 0;
 }
@@ -0,0 +1,715 @@
+// Copyright SCI Semiconductor and CHERIoT Contributors.
+// SPDX-License-Identifier: MIT
+
+#include "tls-internal.h"
+#include <algorithm>
+#include <cheri.hh>
+#include <debug.hh>
+#include <limits>
+#include <string.h>
+#include <tls.h>
+
+using Debug = ConditionalDebug<false, "TLS">;
+using namespace CHERI;
+
+namespace
+{
+	__always_inline SKey trust_anchor_store_key()
+	{
+		return STATIC_SEALING_TYPE(TLSTrustAnchorStore);
+	}
+
+	/**
+	 * Compute the index key for a DN: the first 64 bits of its SHA-256
+	 * hash.  This must hash the same bytes as the minimal X.509 engine,
+	 * which hashes the entire encoded DN, including the outer header.
+	 */
+	uint64_t dn_hash(const unsigned char *dn, size_t length)
+	{
+		br_sha256_context context;
+		unsigned char     hash[br_sha256_SIZE];
+		br_sha256_init(&context);
+		br_sha256_update(&context, dn, length);
+		br_sha256_out(&context, hash);
+		uint64_t key;
+		memcpy(&key, hash, sizeof(key));
+		return key;
+	}
+
+	/**
+	 * Parse the DER tag and length at `offset` in `buffer`.  On success,
+	 * returns true and sets `tag`, `headerLength` (the size of the tag and
+	 * length) and `length` (the size of the contents).  Returns false if
+	 * the header is not entirely within the first `size` bytes of the
+	 * buffer, or is not one that can appear in a certificate.
+	 */
+	bool der_header(const uint8_t *buffer,
+	                size_t         size,
+	                size_t         offset,
+	                uint8_t       &tag,
+	                size_t        &headerLength,
+	                size_t        &length)
+	{
+		if (offset + 2 > size)
+		{
+			return false;
+		}
+		tag           = buffer[offset];
+		uint8_t first = buffer[offset + 1];
+		if (first < 0x80)
+		{
+			headerLength = 2;
+			length       = first;
+			return true;
+		}
+		size_t lengthBytes = first & 0x7f;
+		if ((lengthBytes == 0) || (lengthBytes > 3) ||
+		    (offset + 2 + lengthBytes > size))
+		{
+			return false;
+		}
+		length = 0;
+		for (size_t i = 0; i < lengthBytes; i++)
+		{
+			length = (length << 8) | buffer[offset + 2 + i];
+		}
+		headerLength = 2 + lengthBytes;
+		return true;
+	}
+
+	/**
+	 * The fields of a certificate that the X.509 wrapper needs.  Each is the
+	 * complete DER encoding of the field, including the header.
+	 */
+	struct CertificateFields
+	{
+		const uint8_t *issuer;
+		size_t         issuerLength;
+		const uint8_t *validity;
+		size_t         validityLength;
+		const uint8_t *subject;
+		size_t         subjectLength;
+	};
+
+	/**
+	 * Find the issuer, validity, and subject in the start of a DER-encoded
+	 * certificate.  Returns false if they are not all entirely contained in
+	 * the first `size` bytes of `certificate`.
+	 */
+	bool certificate_fields_find(const uint8_t     *certificate,
+	                             size_t             size,
+	                             CertificateFields &certificateFields)
+	{
+		uint8_t tag;
+		size_t  header;
+		size_t  length;
+		size_t  offset = 0;
+		// Certificate and TBSCertificate SEQUENCE headers.
+		for (int i = 0; i < 2; i++)
+		{
+			if (!der_header(certificate, size, offset, tag, header, length) ||
+			    (tag != 0x30))
+			{
+				return false;
+			}
+			offset += header;
+		}
+		// Optional explicitly tagged version.
+		if (!der_header(certificate, size, offset, tag, header, length))
+		{
+			return false;
+		}
+		if (tag == 0xa0)
+		{
+			offset += header + length;
+		}
+		// Serial number and signature algorithm, then the issuer, validity,
+		// and subject.
+		const uint8_t *fields[5];
+		size_t         lengths[5];
+		for (int i = 0; i < 5; i++)
+		{
+			if (!der_header(certificate, size, offset, tag, header, length))
+			{
+				return false;
+			}
+			fields[i]  = certificate + offset;
+			lengths[i] = header + length;
+			offset += header + length;
+		}
+		if (offset > size)
+		{
+			return false;
+		}
+		certificateFields.issuer         = fields[2];
+		certificateFields.issuerLength   = lengths[2];
+		certificateFields.validity       = fields[3];
+		certificateFields.validityLength = lengths[3];
+		certificateFields.subject        = fields[4];
+		certificateFields.subjectLength  = lengths[4];
+		return true;
+	}
+
+	/**
+	 * Parse the notAfter time from a DER-encoded certificate validity into
+	 * seconds since the UNIX epoch.  Returns false if the encoding is not
+	 * understood.
+	 */
+	bool not_after_parse(const uint8_t *validity, size_t size, time_t &notAfter)
+	{
+		uint8_t tag;
+		size_t  header;
+		size_t  length;
+		size_t  offset = 0;
+		// Validity SEQUENCE header, then skip notBefore.
+		if (!der_header(validity, size, offset, tag, header, length))
+		{
+			return false;
+		}
+		offset += header;
+		if (!der_header(validity, size, offset, tag, header, length))
+		{
+			return false;
+		}
+		offset += header + length;
+		if (!der_header(validity, size, offset, tag, header, length))
+		{
+			return false;
+		}
+		offset += header;
+		size_t yearDigits;
+		if ((tag == 0x17) && (length == 13))
+		{
+			// UTCTime: YYMMDDHHMMSSZ
+			yearDigits = 2;
+		}
+		else if ((tag == 0x18) && (length == 15))
+		{
+			// GeneralizedTime: YYYYMMDDHHMMSSZ
+			yearDigits = 4;
+		}
+		else
+		{
+			return false;
+		}
+		if ((offset + length > size) || (validity[offset + length - 1] != 'Z'))
+		{
+			return false;
+		}
+		// Year, month, day, hour, minute, second.
+		int32_t fields[6];
+		for (int i = 0; i < 6; i++)
+		{
+			size_t digits = (i == 0) ? yearDigits : 2;
+			fields[i]     = 0;
+			for (size_t j = 0; j < digits; j++)
+			{
+				uint8_t c = validity[offset++];
+				if ((c < '0') || (c > '9'))
+				{
+					return false;
+				}
+				fields[i] = fields[i] * 10 + (c - '0');
+			}
+		}
+		if (yearDigits == 2)
+		{
+			fields[0] += (fields[0] >= 50) ? 1900 : 2000;
+		}
+		// Days since the epoch, using the days-from-civil algorithm with
+		// March as the first month of the year.
+		int32_t month     = fields[1];
+		int32_t year      = fields[0] - (month <= 2);
+		int32_t era       = year / 400;
+		int32_t yearOfEra = year - era * 400;
+		int32_t dayOfYear =
+		  (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + fields[2] - 1;
+		int32_t dayOfEra =
+		  yearOfEra * 365 + yearOfEra / 4 - yearOfEra / 100 + dayOfYear;
+		int64_t days = int64_t(era) * 146097 + dayOfEra - 719468;
+		notAfter =
+		  days * 86400 + fields[3] * 3600 + fields[4] * 60 + fields[5];
+		return true;
+	}
+
+	/**
+	 * Returns true if the end-entity certificate with SHA-256 hash `hash` is
+	 * in the validation cache and has not expired.
+	 */
+	bool cache_lookup(ValidationCache *cache, const uint8_t *hash, time_t now)
+	{
+		LockGuard g{cache->lock};
+		for (size_t i = 0; i < cache->entriesCount; i++)
+		{
+			auto &entry = cache->entries[i];
+			if ((entry.expiry > now) &&
+			    (memcmp(entry.leafHash, hash, sizeof(entry.leafHash)) == 0))
+			{
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/**
+	 * Add the end-entity certificate with SHA-256 hash `hash` to the
+	 * validation cache.  This replaces any existing entry for the same
+	 * certificate or, failing that, the entry that expires first.
+	 */
+	void
+	cache_insert(ValidationCache *cache, const uint8_t *hash, time_t expiry)
+	{
+		LockGuard g{cache->lock};
+		ValidationCacheEntry *victim = &cache->entries[0];
+		for (size_t i = 0; i < cache->entriesCount; i++)
+		{
+			auto &entry = cache->entries[i];
+			if (memcmp(entry.leafHash, hash, sizeof(entry.leafHash)) == 0)
+			{
+				victim = &entry;
+				break;
+			}
+			if (entry.expiry < victim->expiry)
+			{
+				victim = &entry;
+			}
+		}
+		memcpy(victim->leafHash, hash, sizeof(victim->leafHash));
+		victim->expiry = expiry;
+	}
+
+	/**
+	 * Append the trust anchors whose DN hash is `key` to the candidate
+	 * list.  Returns false if there is not enough space.
+	 */
+	bool candidates_add(IndexedX509Context *context,
+	                    size_t             &count,
+	                    uint64_t            key)
+	{
+		auto  *store = context->store;
+		size_t low   = 0;
+		size_t high  = store->anchorsCount;
+		while (low < high)
+		{
+			size_t middle = low + (high - low) / 2;
+			if (store->hashes[middle] < key)
+			{
+				low = middle + 1;
+			}
+			else
+			{
+				high = middle;
+			}
+		}
+		for (size_t i = low;
+		     (i < store->anchorsCount) && (store->hashes[i] == key);
+		     i++)
+		{
+			if (count == IndexedX509Context::MaxCandidates)
+			{
+				return false;
+			}
+			context->candidates[count++] = store->anchors[i];
+		}
+		return true;
+	}
+
+	/**
+	 * Choose the trust anchors that the minimal engine will see for the
+	 * current certificate and then forward the buffered prefix.  This also
+	 * records the certificate's expiry time for the validation cache.
+	 */
+	void candidates_select(IndexedX509Context *context)
+	{
+		auto             *inner = context->inner;
+		CertificateFields fields;
+		size_t            count = 0;
+		bool              found = certificate_fields_find(
+		  context->prefix, context->prefixLength, fields);
+		time_t notAfter;
+		if (found &&
+		    not_after_parse(fields.validity, fields.validityLength, notAfter))
+		{
+			context->chainExpiry = std::min(context->chainExpiry, notAfter);
+		}
+		else
+		{
+			context->cacheable = false;
+		}
+		// The minimal engine compares the issuer DN against CA anchors and
+		// the subject DN against non-CA anchors, so consider both.
+		if (found &&
+		    candidates_add(
+		      context, count, dn_hash(fields.issuer, fields.issuerLength)) &&
+		    (((fields.subjectLength == fields.issuerLength) &&
+		      (memcmp(fields.subject, fields.issuer, fields.issuerLength) ==
+		       0)) ||
+		     candidates_add(
+		       context, count, dn_hash(fields.subject, fields.subjectLength))))
+		{
+			Debug::log("Selected {} candidate trust anchors", count);
+			inner->trust_anchors     = context->candidates;
+			inner->trust_anchors_num = count;
+		}
+		else
+		{
+			Debug::log("Falling back to all {} trust anchors",
+			           context->store->anchorsCount);
+			inner->trust_anchors     = context->store->anchors;
+			inner->trust_anchors_num = context->store->anchorsCount;
+		}
+		context->forwarding = true;
+		inner->vtable->append(
+		  &inner->vtable, context->prefix, context->prefixLength);
+	}
+
+	IndexedX509Context *indexed_context(const br_x509_class *const *context)
+	{
+		return reinterpret_cast<IndexedX509Context *>(
+		  const_cast<const br_x509_class **>(context));
+	}
+
+	void indexed_start_chain(const br_x509_class **ctx, const char *serverName)
+	{
+		auto *context             = indexed_context(ctx);
+		auto *inner               = context->inner;
+		context->certificateIndex = 0;
+		context->chainExpiry      = std::numeric_limits<time_t>::max();
+		{
+			LockGuard g{context->store->lock};
+			context->cache = context->store->cache;
+		}
+		context->cacheable = (context->cache != nullptr);
+		context->cacheHit  = false;
+		inner->vtable->start_chain(&inner->vtable, serverName);
+	}
+
+	void indexed_start_cert(const br_x509_class **ctx, uint32_t length)
+	{
+		auto *context = indexed_context(ctx);
+		auto *inner   = context->inner;
+		if (context->cacheHit)
+		{
+			return;
+		}
+		context->prefixLength = 0;
+		context->forwarding   = false;
+		if (context->cacheable && (context->certificateIndex == 0))
+		{
+			br_sha256_init(&context->leafHash);
+		}
+		inner->vtable->start_cert(&inner->vtable, length);
+	}
+
+	void indexed_append(const br_x509_class **ctx,
+	                    const unsigned char  *buffer,
+	                    size_t                length)
+	{
+		auto *context = indexed_context(ctx);
+		auto *inner   = context->inner;
+		if (context->cacheHit)
+		{
+			return;
+		}
+		if (context->cacheable && (context->certificateIndex == 0))
+		{
+			br_sha256_update(&context->leafHash, buffer, length);
+		}
+		if (!context->forwarding)
+		{
+			size_t copy = std::min(
+			  length, IndexedX509Context::PrefixSize - context->prefixLength);
+			memcpy(context->prefix + context->prefixLength, buffer, copy);
+			context->prefixLength += copy;
+			buffer += copy;
+			length -= copy;
+			CertificateFields fields;
+			if ((context->prefixLength < IndexedX509Context::PrefixSize) &&
+			    !certificate_fields_find(
+			      context->prefix, context->prefixLength, fields))
+			{
+				return;
+			}
+			candidates_select(context);
+		}
+		if (length > 0)
+		{
+			inner->vtable->append(&inner->vtable, buffer, length);
+		}
+	}
+
+	void indexed_end_cert(const br_x509_class **ctx)
+	{
+		auto *context = indexed_context(ctx);
+		auto *inner   = context->inner;
+		if (context->cacheHit)
+		{
+			return;
+		}
+		// Short or malformed certificate, let the engine deal with it.
+		if (!context->forwarding)
+		{
+			candidates_select(context);
+		}
+		inner->vtable->end_cert(&inner->vtable);
+		// The minimal engine checks the end-entity certificate's validity
+		// period and server name while processing it, but verifies its
+		// signature only when it sees the next certificate.  If the end-entity
+		// certificate has passed those checks and its chain has previously
+		// been validated, skip the rest of the chain.
+		if (context->cacheable && (context->certificateIndex == 0) &&
+		    (inner->err == 0))
+		{
+			uint8_t hash[br_sha256_SIZE];
+			br_sha256_out(&context->leafHash, hash);
+			if (cache_lookup(context->cache, hash, time(nullptr)))
+			{
+				Debug::log("End-entity certificate found in validation cache");
+				context->cacheHit = true;
+			}
+		}
+		context->certificateIndex++;
+	}
+
+	unsigned indexed_end_chain(const br_x509_class **ctx)
+	{
+		auto    *context = indexed_context(ctx);
+		auto    *inner   = context->inner;
+		unsigned result  = inner->vtable->end_chain(&inner->vtable);
+		if (context->cacheHit)
+		{
+			// The minimal engine will report that the truncated chain is
+			// not trusted, but will still provide the public key.
+			return result == BR_ERR_X509_NOT_TRUSTED ? BR_ERR_OK : result;
+		}
+		if ((result == BR_ERR_OK) && context->cacheable)
+		{
+			auto  *cache = context->cache;
+			time_t now   = time(nullptr);
+			time_t expiry =
+			  std::min(context->chainExpiry, now + cache->maxAgeSeconds);
+			if ((now > 0) && (expiry > now))
+			{
+				uint8_t hash[br_sha256_SIZE];
+				br_sha256_out(&context->leafHash, hash);
+				Debug::log("Caching validated chain until {}", expiry);
+				cache_insert(cache, hash, expiry);
+			}
+		}
+		return result;
+	}
+
+	const br_x509_pkey *indexed_get_pkey(const br_x509_class *const *ctx,
+	                                     unsigned                   *usages)
+	{
+		auto *context = indexed_context(ctx);
+		auto *inner   = context->inner;
+		return inner->vtable->get_pkey(&inner->vtable, usages);
+	}
+
+	const br_x509_class IndexedX509Vtable = {
+	  sizeof(IndexedX509Context),
+	  indexed_start_chain,
+	  indexed_start_cert,
+	  indexed_append,
+	  indexed_end_cert,
+	  indexed_end_chain,
+	  indexed_get_pkey,
+	};
+
+} // namespace
+
+TrustAnchorStore *trust_anchor_store_unseal(SObj sealedStore)
+{
+	Sealed<TrustAnchorStore> sealed{sealedStore};
+	return token_unseal(trust_anchor_store_key(), sealed);
+}
+
+bool trust_anchor_store_retain(Timeout *t, TrustAnchorStore *store)
+{
+	if (LockGuard g{store->lock, t})
+	{
+		store->connections++;
+		return true;
+	}
+	return false;
+}
+
+void trust_anchor_store_release(TrustAnchorStore *store)
+{
+	LockGuard g{store->lock};
+	store->connections--;
+}
+
+void indexed_x509_init(IndexedX509Context      *context,
+                       br_x509_minimal_context *inner,
+                       TrustAnchorStore        *store)
+{
+	context->vtable       = &IndexedX509Vtable;
+	context->inner        = inner;
+	context->store        = store;
+	context->prefixLength = 0;
+	context->forwarding   = false;
+	context->cache        = nullptr;
+	context->cacheable    = false;
+	context->cacheHit     = false;
+}
+
+SObj tls_trust_anchor_store_create(Timeout                    *t,
+                                   SObj                        allocator,
+                                   const br_x509_trust_anchor *trustAnchors,
+                                   size_t                      trustAnchorsCount)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return nullptr;
+	}
+	// Reject counts for which the size of the store would overflow.
+	constexpr size_t MaxAnchors =
+	  (std::numeric_limits<size_t>::max() - sizeof(TrustAnchorStore)) /
+	  (sizeof(br_x509_trust_anchor) + sizeof(uint64_t));
+	if (trustAnchorsCount > MaxAnchors)
+	{
+		Debug::log("Too many trust anchors: {}", trustAnchorsCount);
+		return nullptr;
+	}
+	if (heap_claim_fast(t, trustAnchors) != 0 ||
+	    !check_pointer<PermissionSet{Permission::Load}>(
+	      trustAnchors, trustAnchorsCount * sizeof(br_x509_trust_anchor)))
+	{
+		Debug::log("Invalid trust anchors {}", trustAnchors);
+		return nullptr;
+	}
+	size_t anchorsSize = trustAnchorsCount * sizeof(br_x509_trust_anchor);
+	size_t hashesSize  = trustAnchorsCount * sizeof(uint64_t);
+	void  *unsealed;
+	SObj   sealed = token_sealed_unsealed_alloc(
+	  t,
+	  allocator,
+	  trust_anchor_store_key(),
+	  sizeof(TrustAnchorStore) + anchorsSize + hashesSize,
+	  &unsealed);
+	if (sealed == nullptr)
+	{
+		Debug::log("Failed to allocate trust anchor store");
+		return nullptr;
+	}
+	auto *store = static_cast<TrustAnchorStore *>(unsealed);
+	store->connections = 0;
+	// The anchors follow the header and the hashes follow the anchors.  All
+	// of these are capability aligned.
+	store->anchorsCount   = trustAnchorsCount;
+	store->cache          = nullptr;
+	store->cacheAllocator = nullptr;
+	store->anchors = reinterpret_cast<br_x509_trust_anchor *>(store + 1);
+	store->hashes =
+	  reinterpret_cast<uint64_t *>(store->anchors + trustAnchorsCount);
+	// Insertion sort.  This runs once per store and CA bundles are at most a
+	// few hundred entries, so this is not worth anything more clever.
+	// The allocation was a cross-compartment call and so dropped the claim
+	// on the caller's array.
+	if (heap_claim_fast(t, trustAnchors) != 0)
+	{
+		token_obj_destroy(allocator, trust_anchor_store_key(), sealed);
+		return nullptr;
+	}
+	for (size_t i = 0; i < trustAnchorsCount; i++)
+	{
+		// Copy the descriptor so that the caller cannot change the DN
+		// between the check and the hash.
+		br_x509_trust_anchor anchor = trustAnchors[i];
+		if ((heap_claim_fast(t, trustAnchors, anchor.dn.data) != 0) ||
+		    !check_pointer<PermissionSet{Permission::Load}>(anchor.dn.data,
+		                                                    anchor.dn.len))
+		{
+			Debug::log("Invalid trust anchor DN {}", anchor.dn.data);
+			token_obj_destroy(allocator, trust_anchor_store_key(), sealed);
+			return nullptr;
+		}
+		uint64_t key = dn_hash(anchor.dn.data, anchor.dn.len);
+		size_t   j   = i;
+		while ((j > 0) && (store->hashes[j - 1] > key))
+		{
+			store->hashes[j]  = store->hashes[j - 1];
+			store->anchors[j] = store->anchors[j - 1];
+			j--;
+		}
+		store->hashes[j]  = key;
+		store->anchors[j] = anchor;
+	}
+	Debug::log("Created trust anchor store with {} anchors", trustAnchorsCount);
+	return sealed;
+}
+
+int tls_trust_anchor_store_cache_enable(Timeout *t,
+                                        SObj     allocator,
+                                        SObj     sealedStore,
+                                        size_t   entries,
+                                        uint32_t maxAgeSeconds)
+{
+	if (!check_timeout_pointer(t))
+	{
+		return -EINVAL;
+	}
+	constexpr size_t MaxEntries =
+	  (std::numeric_limits<size_t>::max() - sizeof(ValidationCache)) /
+	  sizeof(ValidationCacheEntry);
+	auto *store = trust_anchor_store_unseal(sealedStore);
+	if ((store == nullptr) || (entries == 0) || (entries > MaxEntries))
+	{
+		return -EINVAL;
+	}
+	// Check and set the cache with the lock held, so that concurrent calls
+	// cannot both allocate one.
+	LockGuard g{store->lock, t};
+	if (!g)
+	{
+		return -ETIMEDOUT;
+	}
+	if (store->cache != nullptr)
+	{
+		return -EEXIST;
+	}
+	void *memory = heap_allocate(
+	  t,
+	  allocator,
+	  sizeof(ValidationCache) + entries * sizeof(ValidationCacheEntry));
+	if (!Capability{memory}.is_valid())
+	{
+		Debug::log("Failed to allocate validation cache");
+		return -ENOMEM;
+	}
+	// Heap allocations are zeroed, so all entries start out unused.
+	auto *cache           = new (memory) ValidationCache{};
+	cache->maxAgeSeconds  = maxAgeSeconds;
+	cache->entriesCount   = entries;
+	cache->entries        = reinterpret_cast<ValidationCacheEntry *>(cache + 1);
+	store->cache          = cache;
+	store->cacheAllocator = allocator;
+	return 0;
+}
+
+int tls_trust_anchor_store_destroy(SObj allocator, SObj sealedStore)
+{
+	auto *store = trust_anchor_store_unseal(sealedStore);
+	if (store == nullptr)
+	{
+		return -EINVAL;
+	}
+	Timeout t{0};
+	if (!store->lock.try_lock(&t))
+	{
+		return -EBUSY;
+	}
+	if (store->connections != 0)
+	{
+		store->lock.unlock();
+		return -EBUSY;
+	}
+	store->lock.upgrade_for_destruction();
+	if (store->cache != nullptr)
+	{
+		heap_free(store->cacheAllocator, store->cache);
+	}
+	return token_obj_destroy(allocator, trust_anchor_store_key(), sealedStore);
+}
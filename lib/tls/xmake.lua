@@ -1,328 +1,39 @@
+includes("bearssl.lua")
+
 option("tls-rsa")
     set_default(true)
     set_description("Enable RSA (in addition to ECDSA) for TLS")
     set_showmenu(true)
     add_defines("CHERIOT_TLS_ENABLE_RSA")
 
+option("tls-output-buffer-size")
+    set_default("837")
+    set_description("Size of each TLS connection's output buffer, which bounds the record size (837 to 16469)")
+    set_showmenu(true)
+
 
 compartment("TLS")
   add_options("tls-rsa")
   set_default(false)
   -- TLS API
   add_files("tls.cc")
+  -- Trust anchor store and the X.509 wrapper that uses it.
+  add_files("trust_anchor_store.cc")
+  -- Server configurations and their session caches.
+  add_files("server.cc")
   -- Wrapper around x509_minimal.c that uses our time implementation from sntp.
   add_files("x509_minimal_wrapper.c")
+  add_files("../../third_party/BearSSL/src/x509/x509_minimal_full.c")
   -- Configuration
-  add_defines("BR_INT128=0", "BR_UMUL128=0", "BR_USE_UNIX_TIME=1")
   add_defines("CHERIOT_NO_AMBIENT_MALLOC", "CHERIOT_NO_NEW_DELETE")
-  add_includedirs("../../include", "../../third_party/BearSSL/src", "../../third_party/BearSSL/inc")
-  -- BearSSL sources:
-  -- These must be split up because Lua has a limit to the number of arguments
-  -- to a function.
-  add_files("../../third_party/BearSSL/src/settings.c")
-  add_files(
-    "../../third_party/BearSSL/src/aead/ccm.c",
-    "../../third_party/BearSSL/src/aead/eax.c",
-    "../../third_party/BearSSL/src/aead/gcm.c")
-  add_files(
-    "../../third_party/BearSSL/src/codec/ccopy.c",
-    "../../third_party/BearSSL/src/codec/dec16be.c",
-    "../../third_party/BearSSL/src/codec/dec16le.c",
-    "../../third_party/BearSSL/src/codec/dec32be.c",
-    "../../third_party/BearSSL/src/codec/dec32le.c",
-    "../../third_party/BearSSL/src/codec/dec64be.c",
-    "../../third_party/BearSSL/src/codec/dec64le.c",
-    "../../third_party/BearSSL/src/codec/enc16be.c",
-    "../../third_party/BearSSL/src/codec/enc16le.c",
-    "../../third_party/BearSSL/src/codec/enc32be.c",
-    "../../third_party/BearSSL/src/codec/enc32le.c",
-    "../../third_party/BearSSL/src/codec/enc64be.c",
-    "../../third_party/BearSSL/src/codec/enc64le.c",
-    "../../third_party/BearSSL/src/codec/pemdec.c",
-    "../../third_party/BearSSL/src/codec/pemenc.c")
-  add_files(
-    "../../third_party/BearSSL/src/ec/ec_all_m15.c",
-    "../../third_party/BearSSL/src/ec/ec_all_m31.c",
-    "../../third_party/BearSSL/src/ec/ec_c25519_i15.c",
-    "../../third_party/BearSSL/src/ec/ec_c25519_i31.c",
-    "../../third_party/BearSSL/src/ec/ec_c25519_m15.c",
-    "../../third_party/BearSSL/src/ec/ec_c25519_m31.c",
-    "../../third_party/BearSSL/src/ec/ec_c25519_m62.c",
-    "../../third_party/BearSSL/src/ec/ec_c25519_m64.c",
-    "../../third_party/BearSSL/src/ec/ec_curve25519.c",
-    "../../third_party/BearSSL/src/ec/ec_default.c",
-    "../../third_party/BearSSL/src/ec/ec_keygen.c",
-    "../../third_party/BearSSL/src/ec/ec_p256_m15.c",
-    "../../third_party/BearSSL/src/ec/ec_p256_m31.c",
-    "../../third_party/BearSSL/src/ec/ec_p256_m62.c",
-    "../../third_party/BearSSL/src/ec/ec_p256_m64.c",
-    "../../third_party/BearSSL/src/ec/ec_prime_i15.c",
-    "../../third_party/BearSSL/src/ec/ec_prime_i31.c",
-    "../../third_party/BearSSL/src/ec/ec_pubkey.c",
-    "../../third_party/BearSSL/src/ec/ec_secp256r1.c",
-    "../../third_party/BearSSL/src/ec/ec_secp384r1.c",
-    "../../third_party/BearSSL/src/ec/ec_secp521r1.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_atr.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_default_sign_asn1.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_default_sign_raw.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_default_vrfy_asn1.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_default_vrfy_raw.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_i15_bits.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_i15_sign_asn1.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_i15_sign_raw.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_i15_vrfy_asn1.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_i15_vrfy_raw.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_i31_bits.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_i31_sign_asn1.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_i31_sign_raw.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_i31_vrfy_asn1.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_i31_vrfy_raw.c",
-    "../../third_party/BearSSL/src/ec/ecdsa_rta.c")
-  add_files(
-    "../../third_party/BearSSL/src/hash/dig_oid.c",
-    "../../third_party/BearSSL/src/hash/dig_size.c",
-    "../../third_party/BearSSL/src/hash/ghash_ctmul.c",
-    "../../third_party/BearSSL/src/hash/ghash_ctmul32.c",
-    "../../third_party/BearSSL/src/hash/ghash_ctmul64.c",
-    "../../third_party/BearSSL/src/hash/ghash_pclmul.c",
-    "../../third_party/BearSSL/src/hash/ghash_pwr8.c",
-    "../../third_party/BearSSL/src/hash/md5.c",
-    "../../third_party/BearSSL/src/hash/md5sha1.c",
-    "../../third_party/BearSSL/src/hash/mgf1.c",
-    "../../third_party/BearSSL/src/hash/multihash.c",
-    "../../third_party/BearSSL/src/hash/sha1.c",
-    "../../third_party/BearSSL/src/hash/sha2big.c",
-    "../../third_party/BearSSL/src/hash/sha2small.c")
-  add_files(
-    "../../third_party/BearSSL/src/int/i15_add.c",
-    "../../third_party/BearSSL/src/int/i15_bitlen.c",
-    "../../third_party/BearSSL/src/int/i15_decmod.c",
-    "../../third_party/BearSSL/src/int/i15_decode.c",
-    "../../third_party/BearSSL/src/int/i15_decred.c",
-    "../../third_party/BearSSL/src/int/i15_encode.c",
-    "../../third_party/BearSSL/src/int/i15_fmont.c",
-    "../../third_party/BearSSL/src/int/i15_iszero.c",
-    "../../third_party/BearSSL/src/int/i15_moddiv.c",
-    "../../third_party/BearSSL/src/int/i15_modpow.c",
-    "../../third_party/BearSSL/src/int/i15_modpow2.c",
-    "../../third_party/BearSSL/src/int/i15_montmul.c",
-    "../../third_party/BearSSL/src/int/i15_mulacc.c",
-    "../../third_party/BearSSL/src/int/i15_muladd.c",
-    "../../third_party/BearSSL/src/int/i15_ninv15.c",
-    "../../third_party/BearSSL/src/int/i15_reduce.c",
-    "../../third_party/BearSSL/src/int/i15_rshift.c",
-    "../../third_party/BearSSL/src/int/i15_sub.c",
-    "../../third_party/BearSSL/src/int/i15_tmont.c",
-    "../../third_party/BearSSL/src/int/i31_add.c",
-    "../../third_party/BearSSL/src/int/i31_bitlen.c",
-    "../../third_party/BearSSL/src/int/i31_decmod.c",
-    "../../third_party/BearSSL/src/int/i31_decode.c",
-    "../../third_party/BearSSL/src/int/i31_decred.c",
-    "../../third_party/BearSSL/src/int/i31_encode.c",
-    "../../third_party/BearSSL/src/int/i31_fmont.c",
-    "../../third_party/BearSSL/src/int/i31_iszero.c",
-    "../../third_party/BearSSL/src/int/i31_moddiv.c",
-    "../../third_party/BearSSL/src/int/i31_modpow.c",
-    "../../third_party/BearSSL/src/int/i31_modpow2.c",
-    "../../third_party/BearSSL/src/int/i31_montmul.c",
-    "../../third_party/BearSSL/src/int/i31_mulacc.c",
-    "../../third_party/BearSSL/src/int/i31_muladd.c",
-    "../../third_party/BearSSL/src/int/i31_ninv31.c",
-    "../../third_party/BearSSL/src/int/i31_reduce.c",
-    "../../third_party/BearSSL/src/int/i31_rshift.c",
-    "../../third_party/BearSSL/src/int/i31_sub.c",
-    "../../third_party/BearSSL/src/int/i31_tmont.c",
-    "../../third_party/BearSSL/src/int/i32_add.c",
-    "../../third_party/BearSSL/src/int/i32_bitlen.c",
-    "../../third_party/BearSSL/src/int/i32_decmod.c",
-    "../../third_party/BearSSL/src/int/i32_decode.c",
-    "../../third_party/BearSSL/src/int/i32_decred.c",
-    "../../third_party/BearSSL/src/int/i32_div32.c",
-    "../../third_party/BearSSL/src/int/i32_encode.c",
-    "../../third_party/BearSSL/src/int/i32_fmont.c",
-    "../../third_party/BearSSL/src/int/i32_iszero.c",
-    "../../third_party/BearSSL/src/int/i32_modpow.c",
-    "../../third_party/BearSSL/src/int/i32_montmul.c",
-    "../../third_party/BearSSL/src/int/i32_mulacc.c",
-    "../../third_party/BearSSL/src/int/i32_muladd.c",
-    "../../third_party/BearSSL/src/int/i32_ninv32.c",
-    "../../third_party/BearSSL/src/int/i32_reduce.c",
-    "../../third_party/BearSSL/src/int/i32_sub.c",
-    "../../third_party/BearSSL/src/int/i32_tmont.c",
-    "../../third_party/BearSSL/src/int/i62_modpow2.c")
-  add_files(
-    "../../third_party/BearSSL/src/kdf/hkdf.c",
-    "../../third_party/BearSSL/src/kdf/shake.c")
-  add_files(
-    "../../third_party/BearSSL/src/mac/hmac.c",
-    "../../third_party/BearSSL/src/mac/hmac_ct.c")
-  add_files(
-    "../../third_party/BearSSL/src/rand/aesctr_drbg.c",
-    "../../third_party/BearSSL/src/rand/hmac_drbg.c",
-    "../../third_party/BearSSL/src/rand/sysrng.c")
-  add_files(
-    "../../third_party/BearSSL/src/rsa/rsa_default_keygen.c",
-    "../../third_party/BearSSL/src/rsa/rsa_default_modulus.c",
-    "../../third_party/BearSSL/src/rsa/rsa_default_oaep_decrypt.c",
-    "../../third_party/BearSSL/src/rsa/rsa_default_oaep_encrypt.c",
-    "../../third_party/BearSSL/src/rsa/rsa_default_pkcs1_sign.c",
-    "../../third_party/BearSSL/src/rsa/rsa_default_pkcs1_vrfy.c",
-    "../../third_party/BearSSL/src/rsa/rsa_default_priv.c",
-    "../../third_party/BearSSL/src/rsa/rsa_default_privexp.c",
-    "../../third_party/BearSSL/src/rsa/rsa_default_pss_sign.c",
-    "../../third_party/BearSSL/src/rsa/rsa_default_pss_vrfy.c",
-    "../../third_party/BearSSL/src/rsa/rsa_default_pub.c",
-    "../../third_party/BearSSL/src/rsa/rsa_default_pubexp.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_keygen.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_modulus.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_oaep_decrypt.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_oaep_encrypt.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_pkcs1_sign.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_pkcs1_vrfy.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_priv.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_privexp.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_pss_sign.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_pss_vrfy.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_pub.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i15_pubexp.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_keygen.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_keygen_inner.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_modulus.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_oaep_decrypt.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_oaep_encrypt.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_pkcs1_sign.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_pkcs1_vrfy.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_priv.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_privexp.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_pss_sign.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_pss_vrfy.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_pub.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i31_pubexp.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i32_oaep_decrypt.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i32_oaep_encrypt.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i32_pkcs1_sign.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i32_pkcs1_vrfy.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i32_priv.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i32_pss_sign.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i32_pss_vrfy.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i32_pub.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i62_keygen.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i62_oaep_decrypt.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i62_oaep_encrypt.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i62_pkcs1_sign.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i62_pkcs1_vrfy.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i62_priv.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i62_pss_sign.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i62_pss_vrfy.c",
-    "../../third_party/BearSSL/src/rsa/rsa_i62_pub.c",
-    "../../third_party/BearSSL/src/rsa/rsa_oaep_pad.c",
-    "../../third_party/BearSSL/src/rsa/rsa_oaep_unpad.c",
-    "../../third_party/BearSSL/src/rsa/rsa_pkcs1_sig_pad.c",
-    "../../third_party/BearSSL/src/rsa/rsa_pkcs1_sig_unpad.c",
-    "../../third_party/BearSSL/src/rsa/rsa_pss_sig_pad.c",
-    "../../third_party/BearSSL/src/rsa/rsa_pss_sig_unpad.c",
-    "../../third_party/BearSSL/src/rsa/rsa_ssl_decrypt.c")
-  add_files(
-    "../../third_party/BearSSL/src/ssl/prf.c",
-    "../../third_party/BearSSL/src/ssl/prf_md5sha1.c",
-    "../../third_party/BearSSL/src/ssl/prf_sha256.c",
-    "../../third_party/BearSSL/src/ssl/prf_sha384.c",
-    "../../third_party/BearSSL/src/ssl/ssl_ccert_single_ec.c",
-    "../../third_party/BearSSL/src/ssl/ssl_ccert_single_rsa.c",
-    "../../third_party/BearSSL/src/ssl/ssl_client.c",
-    "../../third_party/BearSSL/src/ssl/ssl_client_default_rsapub.c",
-    "../../third_party/BearSSL/src/ssl/ssl_client_full.c",
-    "../../third_party/BearSSL/src/ssl/ssl_engine.c",
-    "../../third_party/BearSSL/src/ssl/ssl_engine_default_aescbc.c",
-    "../../third_party/BearSSL/src/ssl/ssl_engine_default_aesccm.c",
-    "../../third_party/BearSSL/src/ssl/ssl_engine_default_aesgcm.c",
-    "../../third_party/BearSSL/src/ssl/ssl_engine_default_chapol.c",
-    "../../third_party/BearSSL/src/ssl/ssl_engine_default_descbc.c",
-    "../../third_party/BearSSL/src/ssl/ssl_engine_default_ec.c",
-    "../../third_party/BearSSL/src/ssl/ssl_engine_default_ecdsa.c",
-    "../../third_party/BearSSL/src/ssl/ssl_engine_default_rsavrfy.c",
-    "../../third_party/BearSSL/src/ssl/ssl_hashes.c",
-    "../../third_party/BearSSL/src/ssl/ssl_hs_client.c",
-    "../../third_party/BearSSL/src/ssl/ssl_hs_server.c",
-    "../../third_party/BearSSL/src/ssl/ssl_io.c",
-    "../../third_party/BearSSL/src/ssl/ssl_keyexport.c",
-    "../../third_party/BearSSL/src/ssl/ssl_lru.c",
-    "../../third_party/BearSSL/src/ssl/ssl_rec_cbc.c",
-    "../../third_party/BearSSL/src/ssl/ssl_rec_ccm.c",
-    "../../third_party/BearSSL/src/ssl/ssl_rec_chapol.c",
-    "../../third_party/BearSSL/src/ssl/ssl_rec_gcm.c",
-    "../../third_party/BearSSL/src/ssl/ssl_scert_single_ec.c",
-    "../../third_party/BearSSL/src/ssl/ssl_scert_single_rsa.c",
-    "../../third_party/BearSSL/src/ssl/ssl_server.c",
-    "../../third_party/BearSSL/src/ssl/ssl_server_full_ec.c",
-    "../../third_party/BearSSL/src/ssl/ssl_server_full_rsa.c",
-    "../../third_party/BearSSL/src/ssl/ssl_server_mine2c.c",
-    "../../third_party/BearSSL/src/ssl/ssl_server_mine2g.c",
-    "../../third_party/BearSSL/src/ssl/ssl_server_minf2c.c",
-    "../../third_party/BearSSL/src/ssl/ssl_server_minf2g.c",
-    "../../third_party/BearSSL/src/ssl/ssl_server_minr2g.c",
-    "../../third_party/BearSSL/src/ssl/ssl_server_minu2g.c",
-    "../../third_party/BearSSL/src/ssl/ssl_server_minv2g.c")
-  add_files(
-    "../../third_party/BearSSL/src/symcipher/aes_big_cbcdec.c",
-    "../../third_party/BearSSL/src/symcipher/aes_big_cbcenc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_big_ctr.c",
-    "../../third_party/BearSSL/src/symcipher/aes_big_ctrcbc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_big_dec.c",
-    "../../third_party/BearSSL/src/symcipher/aes_big_enc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_common.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct64.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct64_cbcdec.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct64_cbcenc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct64_ctr.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct64_ctrcbc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct64_dec.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct64_enc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct_cbcdec.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct_cbcenc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct_ctr.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct_ctrcbc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct_dec.c",
-    "../../third_party/BearSSL/src/symcipher/aes_ct_enc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_pwr8.c",
-    "../../third_party/BearSSL/src/symcipher/aes_pwr8_cbcdec.c",
-    "../../third_party/BearSSL/src/symcipher/aes_pwr8_cbcenc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_pwr8_ctr.c",
-    "../../third_party/BearSSL/src/symcipher/aes_pwr8_ctrcbc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_small_cbcdec.c",
-    "../../third_party/BearSSL/src/symcipher/aes_small_cbcenc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_small_ctr.c",
-    "../../third_party/BearSSL/src/symcipher/aes_small_ctrcbc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_small_dec.c",
-    "../../third_party/BearSSL/src/symcipher/aes_small_enc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_x86ni.c",
-    "../../third_party/BearSSL/src/symcipher/aes_x86ni_cbcdec.c",
-    "../../third_party/BearSSL/src/symcipher/aes_x86ni_cbcenc.c",
-    "../../third_party/BearSSL/src/symcipher/aes_x86ni_ctr.c",
-    "../../third_party/BearSSL/src/symcipher/aes_x86ni_ctrcbc.c",
-    "../../third_party/BearSSL/src/symcipher/chacha20_ct.c",
-    "../../third_party/BearSSL/src/symcipher/chacha20_sse2.c",
-    "../../third_party/BearSSL/src/symcipher/des_ct.c",
-    "../../third_party/BearSSL/src/symcipher/des_ct_cbcdec.c",
-    "../../third_party/BearSSL/src/symcipher/des_ct_cbcenc.c",
-    "../../third_party/BearSSL/src/symcipher/des_support.c",
-    "../../third_party/BearSSL/src/symcipher/des_tab.c",
-    "../../third_party/BearSSL/src/symcipher/des_tab_cbcdec.c",
-    "../../third_party/BearSSL/src/symcipher/des_tab_cbcenc.c",
-    "../../third_party/BearSSL/src/symcipher/poly1305_ctmul.c",
-    "../../third_party/BearSSL/src/symcipher/poly1305_ctmul32.c",
-    "../../third_party/BearSSL/src/symcipher/poly1305_ctmulq.c",
-    "../../third_party/BearSSL/src/symcipher/poly1305_i15.c")
-  add_files(
-    "../../third_party/BearSSL/src/x509/asn1enc.c",
-    "../../third_party/BearSSL/src/x509/encode_ec_pk8der.c",
-    "../../third_party/BearSSL/src/x509/encode_ec_rawder.c",
-    "../../third_party/BearSSL/src/x509/encode_rsa_pk8der.c",
-    "../../third_party/BearSSL/src/x509/encode_rsa_rawder.c",
-    "../../third_party/BearSSL/src/x509/skey_decoder.c")
-  add_files(
-    "../../third_party/BearSSL/src/x509/x509_decoder.c",
-    "../../third_party/BearSSL/src/x509/x509_knownkey.c",
-    --"../../third_party/BearSSL/src/x509/x509_minimal.c",
-    "../../third_party/BearSSL/src/x509/x509_minimal_full.c")
+  add_includedirs("../../include")
+  on_load(function(target)
+    target:add('options', "tls-output-buffer-size")
+    local outputBufferSize = get_config("tls-output-buffer-size")
+    target:add("defines", "CHERIOT_TLS_OUTPUT_BUFFER_SIZE=" .. tostring(outputBufferSize))
+  end)
+  -- BearSSL sources, shared with the crypto benchmark.
+  add_bearssl_crypto()
+  add_bearssl_protocol()
+  -- AES, GHASH and SHA-256 implementations.
+  add_tls_crypto_backend()
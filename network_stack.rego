@@ -144,7 +144,7 @@ sntp_cache_is_valid {
 	every c in caches {
 		# SNTP cache is the right size and is writeable only by the sntp compartment
 		data.compartment.shared_object_writeable_allow_list("sntp_time_at_last_sync", {"SNTP"})
-		c.length = 24
+		c.length = 64
 	}
 }
 